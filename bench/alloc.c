@@ -0,0 +1,63 @@
+/** @file alloc.c
+ *
+ * @brief Counting wrappers for memory allocation functions
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include "alloc.h"
+
+/** Number of allocations made since start */
+static size_t alloc_count = 0;
+
+/**
+ @brief Counting wrapper for malloc(size_t size)
+ 
+ @param[in] size Size of memory
+ @return A pointer to the allocated memory block on success, NULL on failure
+ */
+void *bench_malloc(size_t size) {
+    alloc_count++;
+    return (malloc)(size);
+}
+
+/**
+ @brief Counting wrapper for realloc(void* ptr, size_t size)
+ 
+ @param[in] ptr Pointer
+ @param[in] size Size of memory
+ @return A pointer to the reallocated memory block on success, NULL on failure
+ */
+void *bench_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return (realloc)(ptr, size);
+}
+
+/**
+ @brief Counting wrapper for calloc(size_t num, size_t size)
+ 
+ @param[in] num Number of elements to allocate
+ @param[in] size Size of each element
+ @return A pointer to the allocated memory block on success, NULL on failure
+ */
+void *bench_calloc(size_t num, size_t size) {
+    alloc_count++;
+    return (calloc)(num, size);
+}
+
+/**
+ @brief Get number of allocations made by library since start
+ 
+ Not thread safe, benchmarks run library in a single thread.
+ 
+ @return Number of malloc, realloc and calloc calls
+ */
+size_t bench_alloc_count(void) {
+    return alloc_count;
+}
@@ -0,0 +1,30 @@
+/** @file alloc.h
+ *
+ * @brief Counting wrappers for memory allocation functions
+ *
+ * Header is force-included when library sources are compiled for benchmarks,
+ * so that allocations made by the library can be counted.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_bench_alloc_h
+#define libmobi_bench_alloc_h
+
+#include <stdlib.h>
+
+#define malloc(x) bench_malloc(x)
+#define realloc(x, y) bench_realloc(x, y)
+#define calloc(x, y) bench_calloc(x, y)
+
+void *bench_malloc(size_t size);
+void *bench_realloc(void *ptr, size_t size);
+void *bench_calloc(size_t num, size_t size);
+size_t bench_alloc_count(void);
+
+#endif
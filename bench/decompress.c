@@ -0,0 +1,566 @@
+/** @file decompress.c
+ *
+ * @brief Decompression throughput benchmark
+ *
+ * Loads each document given on command line (by default all documents
+ * in tests/samples) and large synthetic documents generated from them
+ * by replicating their text records.
+ * For every document times decompression of all text records
+ * with mobi_decompress_lz77() or mobi_decompress_huffman(), and whole
+ * mobi_get_rawml() path, which includes decryption for DRM protected documents.
+ * Results are printed to stdout as JSON array, one object for each document and benchmark,
+ * with throughput in MB/s, time per record in ns and number of library allocations per record.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#endif
+#include "mobi.h"
+#include "memory.h"
+#include "read.h"
+#include "util.h"
+#include "compression.h"
+#include "alloc.h"
+
+#ifndef BENCH_SAMPLES
+# define BENCH_SAMPLES "samples"
+#endif
+#define BENCH_MIN_BYTES (64 * 1024 * 1024) /**< Minimal amount of decompressed data in each benchmark */
+#define BENCH_MAX_PASSES 1000 /**< Maximal number of passes in each benchmark */
+#define BENCH_SYNTHETIC_SIZE (32 * 1024 * 1024) /**< Minimal text size of synthetic documents */
+#define BENCH_PATH_MAX 4096 /**< Maximal length of sample path */
+#define BENCH_DRM_PID_PREFIX "sample-drm_pid" /**< Samples with this prefix have PID in file name */
+
+/**
+ @brief Document under benchmark
+ */
+typedef struct {
+    const char *path; /**< Path to document file */
+    const char *name; /**< Name of document in results */
+    bool synthetic; /**< True if document was generated from sample */
+    MOBIData *m; /**< Loaded document */
+} BenchDocument;
+
+/**
+ @brief Result of single benchmark
+ */
+typedef struct {
+    const char *name; /**< Benchmark name */
+    size_t passes; /**< Number of passes */
+    size_t records; /**< Number of text records in each pass */
+    size_t bytes; /**< Decompressed size of each pass */
+    double seconds; /**< Time of all passes */
+    size_t allocs; /**< Number of library allocations in all passes */
+} BenchResult;
+
+/** Is first result printed */
+static bool first_result = true;
+
+/**
+ @brief Print string as JSON string literal
+ 
+ @param[in] str String
+ */
+static void print_json_string(const char *str) {
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+/**
+ @brief Get name of compression type
+ 
+ @param[in] m MOBIData structure with loaded document
+ @return Compression name
+ */
+static const char * compression_name(const MOBIData *m) {
+    switch (m->rh->compression_type) {
+        case MOBI_COMPRESSION_NONE:
+            return "none";
+        case MOBI_COMPRESSION_PALMDOC:
+            return "palmdoc";
+        case MOBI_COMPRESSION_HUFFCDIC:
+            return "huffcdic";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ @brief Print benchmark result as JSON object
+ 
+ @param[in] doc Document
+ @param[in] result Result
+ */
+static void print_result(const BenchDocument *doc, const BenchResult *result) {
+    const double records = (double) result->records * (double) result->passes;
+    const double megabytes = (double) result->bytes * (double) result->passes / (1024 * 1024);
+    printf("%s\n  {\"document\": ", first_result ? "" : ",");
+    print_json_string(doc->name);
+    printf(", \"compression\": \"%s\", \"encrypted\": %s, \"synthetic\": %s",
+           compression_name(doc->m), mobi_is_encrypted(doc->m) ? "true" : "false", doc->synthetic ? "true" : "false");
+    printf(", \"benchmark\": \"%s\", \"passes\": %zu, \"records\": %zu, \"bytes\": %zu, \"seconds\": %.6f",
+           result->name, result->passes, result->records, result->bytes, result->seconds);
+    printf(", \"mb_per_s\": %.2f, \"ns_per_record\": %.1f, \"allocs_per_record\": %.3f}",
+           result->seconds > 0 ? megabytes / result->seconds : 0,
+           records > 0 ? result->seconds * 1e9 / records : 0,
+           records > 0 ? (double) result->allocs / records : 0);
+    first_result = false;
+}
+
+/**
+ @brief Get number of passes needed to decompress at least BENCH_MIN_BYTES
+ 
+ @param[in] bytes Decompressed size of each pass
+ @return Number of passes
+ */
+static size_t passes_count(const size_t bytes) {
+    if (bytes == 0) {
+        return 1;
+    }
+    const size_t passes = (BENCH_MIN_BYTES + bytes - 1) / bytes;
+    return passes > BENCH_MAX_PASSES ? BENCH_MAX_PASSES : passes;
+}
+
+/**
+ @brief Load document, set PID if it is part of sample file name
+ 
+ @param[in] path Path to document
+ @return MOBIData structure on success, NULL otherwise
+ */
+static MOBIData * load_document(const char *path) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return NULL;
+    }
+    if (mobi_load_filename(m, path) != MOBI_SUCCESS || m->rh == NULL || m->rh->text_record_count == 0) {
+        fprintf(stderr, "Loading document failed: %s\n", path);
+        mobi_free(m);
+        return NULL;
+    }
+    const char *basename = strrchr(path, '/');
+    basename = basename ? basename + 1 : path;
+    const size_t prefix_length = strlen(BENCH_DRM_PID_PREFIX);
+    if (mobi_is_encrypted(m) && strncmp(basename, BENCH_DRM_PID_PREFIX, prefix_length) == 0
+        && strlen(basename) >= prefix_length + 10) {
+        char pid[11];
+        memcpy(pid, basename + prefix_length, 10);
+        pid[10] = '\0';
+        /* '*' is not allowed in file names, it is replaced with '^' */
+        for (size_t i = 0; i < 10; i++) {
+            if (pid[i] == '^') {
+                pid[i] = '*';
+            }
+        }
+        if (mobi_drm_setkey(m, pid) != MOBI_SUCCESS) {
+            fprintf(stderr, "Setting PID failed: %s\n", path);
+        }
+    }
+    return m;
+}
+
+/**
+ @brief Get text record data without trailing entries
+ 
+ @param[in] m MOBIData structure with loaded document
+ @param[in] record Text record
+ @param[out] size Size of record data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET record_payload(const MOBIData *m, const MOBIPdbRecord *record, size_t *size) {
+    const uint16_t extra_flags = (m->mh && m->mh->extra_flags) ? *m->mh->extra_flags : 0;
+    const size_t extra_size = extra_flags ? mobi_get_record_extrasize(record, extra_flags) : 0;
+    if (extra_size == MOBI_NOTSET || extra_size > record->size) {
+        return MOBI_DATA_CORRUPT;
+    }
+    *size = record->size - extra_size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Decompress all text records with lz77 or huffman decompressor
+ 
+ @param[in] m MOBIData structure with loaded document
+ @param[in] sizes Sizes of text records data without trailing entries
+ @param[in,out] huffcdic MOBIHuffCdic structure for huff/cdic compression, NULL for palmdoc
+ @param[in,out] out Buffer for single decompressed record
+ @param[out] bytes Decompressed size of all records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET decompress_records(const MOBIData *m, const size_t *sizes, MOBIHuffCdic *huffcdic, unsigned char *out, size_t *bytes) {
+    const size_t record_maxsize = mobi_get_textrecord_maxsize(m);
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    const size_t count = m->rh->text_record_count;
+    *bytes = 0;
+    for (size_t i = 0; i < count && curr; i++) {
+        size_t len = record_maxsize;
+        MOBI_RET ret;
+        if (huffcdic) {
+            ret = mobi_decompress_huffman(out, curr->data, &len, sizes[i], huffcdic);
+        } else {
+            ret = mobi_decompress_lz77(out, curr->data, &len, sizes[i]);
+        }
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        *bytes += len;
+        curr = curr->next;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Benchmark decompressor of unencrypted palmdoc or huff/cdic document
+ 
+ Sizes of records data are calculated before timing, so only decompressor is measured.
+ Huff/cdic symbols cache is kept between passes.
+ 
+ @param[in] doc Document
+ @param[out] result Result
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET bench_decompressor(const BenchDocument *doc, BenchResult *result) {
+    const MOBIData *m = doc->m;
+    result->name = m->rh->compression_type == MOBI_COMPRESSION_HUFFCDIC ? "huffman" : "lz77";
+    const size_t count = m->rh->text_record_count;
+    size_t *sizes = malloc(count * sizeof(*sizes));
+    unsigned char *out = malloc(mobi_get_textrecord_maxsize(m));
+    MOBIHuffCdic *huffcdic = NULL;
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (sizes == NULL || out == NULL) {
+        ret = MOBI_MALLOC_FAILED;
+    }
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    for (size_t i = 0; i < count && ret == MOBI_SUCCESS; i++) {
+        if (curr == NULL) {
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        ret = record_payload(m, curr, &sizes[i]);
+        curr = curr->next;
+    }
+    if (ret == MOBI_SUCCESS && m->rh->compression_type == MOBI_COMPRESSION_HUFFCDIC) {
+        huffcdic = mobi_init_huffcdic();
+        if (huffcdic == NULL) {
+            ret = MOBI_MALLOC_FAILED;
+        } else {
+            ret = mobi_parse_huffdic(m, huffcdic);
+        }
+    }
+    if (ret == MOBI_SUCCESS) {
+        /* first pass measures size and fills symbols cache */
+        ret = decompress_records(m, sizes, huffcdic, out, &result->bytes);
+    }
+    if (ret == MOBI_SUCCESS) {
+        result->records = count;
+        result->passes = passes_count(result->bytes);
+        const size_t allocs = bench_alloc_count();
+        const clock_t start = clock();
+        for (size_t i = 0; i < result->passes && ret == MOBI_SUCCESS; i++) {
+            size_t bytes;
+            ret = decompress_records(m, sizes, huffcdic, out, &bytes);
+        }
+        result->seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+        result->allocs = bench_alloc_count() - allocs;
+    }
+    free(sizes);
+    free(out);
+    mobi_free_huffcdic(huffcdic);
+    return ret;
+}
+
+/**
+ @brief Benchmark whole mobi_get_rawml() path
+ 
+ Encrypted documents are decrypted while decompressed, records data is not modified,
+ so the same document is used in all passes.
+ 
+ @param[in] doc Document
+ @param[out] result Result
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET bench_rawml(const BenchDocument *doc, BenchResult *result) {
+    result->name = mobi_is_encrypted(doc->m) ? "decrypt+rawml" : "rawml";
+    result->records = doc->m->rh->text_record_count;
+    const size_t maxlen = mobi_get_text_maxsize(doc->m);
+    char *text = malloc(maxlen + 1);
+    if (text == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    result->passes = 0;
+    result->seconds = 0;
+    result->allocs = 0;
+    size_t passes = 1;
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t i = 0; i < passes && ret == MOBI_SUCCESS; i++) {
+        size_t len = maxlen;
+        const size_t allocs = bench_alloc_count();
+        const clock_t start = clock();
+        ret = mobi_get_rawml(doc->m, text, &len);
+        result->seconds += (double) (clock() - start) / CLOCKS_PER_SEC;
+        result->allocs += bench_alloc_count() - allocs;
+        result->passes++;
+        if (i == 0) {
+            result->bytes = len;
+            passes = passes_count(len);
+        }
+    }
+    free(text);
+    return ret;
+}
+
+/**
+ @brief Run all benchmarks applicable to document and print results
+ 
+ @param[in] doc Document
+ */
+static void bench_document(const BenchDocument *doc) {
+    BenchResult result;
+    const uint16_t compression_type = doc->m->rh->compression_type;
+    if (!mobi_is_encrypted(doc->m)
+        && (compression_type == MOBI_COMPRESSION_PALMDOC || compression_type == MOBI_COMPRESSION_HUFFCDIC)) {
+        const MOBI_RET ret = bench_decompressor(doc, &result);
+        if (ret == MOBI_SUCCESS) {
+            print_result(doc, &result);
+        } else {
+            fprintf(stderr, "%s: %s benchmark failed (%i)\n", doc->name, result.name, ret);
+        }
+    }
+    const MOBI_RET ret = bench_rawml(doc, &result);
+    if (ret == MOBI_SUCCESS) {
+        print_result(doc, &result);
+    } else {
+        fprintf(stderr, "%s: %s benchmark failed (%i)\n", doc->name, result.name, ret);
+    }
+}
+
+/**
+ @brief Replicate text records of document to reach at least BENCH_SYNTHETIC_SIZE of text
+ 
+ Copies of text records are inserted after the last text record,
+ header record indices of following records are updated.
+ Only text records and huff/cdic records indices are valid after this operation,
+ so document may only be used for text decompression.
+ 
+ @param[in,out] m MOBIData structure with loaded document
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET replicate_text(MOBIData *m) {
+    const size_t count = m->rh->text_record_count;
+    size_t factor = BENCH_SYNTHETIC_SIZE / (m->rh->text_length ? m->rh->text_length : 1) + 1;
+    if ((factor - 1) * count + m->ph->rec_count > UINT16_MAX) {
+        factor = (UINT16_MAX - m->ph->rec_count) / count + 1;
+    }
+    if ((uint64_t) m->rh->text_length * factor > UINT32_MAX) {
+        factor = UINT32_MAX / m->rh->text_length;
+    }
+    if (factor < 2) {
+        return MOBI_DATA_CORRUPT;
+    }
+    uint32_t uid = 0;
+    for (const MOBIPdbRecord *curr = m->rec; curr; curr = curr->next) {
+        if (curr->uid > uid) {
+            uid = curr->uid;
+        }
+    }
+    MOBIPdbRecord *first = mobi_get_record_by_seqnumber(m, 1);
+    MOBIPdbRecord *last = mobi_get_record_by_seqnumber(m, count);
+    if (first == NULL || last == NULL) {
+        return MOBI_DATA_CORRUPT;
+    }
+    MOBIPdbRecord *tail = last->next;
+    MOBI_RET ret = MOBI_SUCCESS;
+    size_t inserted = 0;
+    for (size_t i = 1; i < factor && ret == MOBI_SUCCESS; i++) {
+        const MOBIPdbRecord *src = first;
+        for (size_t j = 0; j < count; j++, src = src->next) {
+            MOBIPdbRecord *copy = calloc(1, sizeof(MOBIPdbRecord));
+            if (copy == NULL || (copy->data = malloc(src->size ? src->size : 1)) == NULL) {
+                free(copy);
+                ret = MOBI_MALLOC_FAILED;
+                break;
+            }
+            memcpy(copy->data, src->data, src->size);
+            copy->size = src->size;
+            copy->attributes = src->attributes;
+            uid += 2;
+            copy->uid = uid;
+            last->next = copy;
+            last = copy;
+            inserted++;
+        }
+    }
+    last->next = tail;
+    m->ph->rec_count += inserted;
+    m->rh->text_record_count += inserted;
+    m->rh->text_length *= (uint32_t) (inserted / count + 1);
+    if (m->mh && m->mh->huff_rec_index) {
+        *m->mh->huff_rec_index += (uint32_t) inserted;
+    }
+    mobi_init_recdir(m);
+    return ret;
+}
+
+/**
+ @brief Benchmark document and its synthetic copy
+ 
+ Synthetic copy is generated from the first unencrypted, non-hybrid document of each compression type.
+ 
+ @param[in] path Path to document
+ @param[in,out] synthesized Array of flags for compression types already synthesized (none, palmdoc, huffcdic)
+ */
+static void bench_path(const char *path, bool synthesized[3]) {
+    BenchDocument doc = { path, path, false, load_document(path) };
+    if (doc.m == NULL) {
+        return;
+    }
+    bench_document(&doc);
+    size_t type;
+    switch (doc.m->rh->compression_type) {
+        case MOBI_COMPRESSION_NONE:
+            type = 0;
+            break;
+        case MOBI_COMPRESSION_PALMDOC:
+            type = 1;
+            break;
+        case MOBI_COMPRESSION_HUFFCDIC:
+            type = 2;
+            break;
+        default:
+            type = 3;
+    }
+    const bool synthesize = type < 3 && !synthesized[type] && !mobi_is_encrypted(doc.m) && !mobi_is_hybrid(doc.m);
+    mobi_free(doc.m);
+    if (!synthesize) {
+        return;
+    }
+    char name[BENCH_PATH_MAX + 16];
+    snprintf(name, sizeof(name), "synthetic:%s", path);
+    BenchDocument synthetic = { path, name, true, load_document(path) };
+    if (synthetic.m == NULL) {
+        return;
+    }
+    const MOBI_RET ret = replicate_text(synthetic.m);
+    if (ret == MOBI_SUCCESS) {
+        synthesized[type] = true;
+        bench_document(&synthetic);
+    } else {
+        fprintf(stderr, "%s: generating synthetic document failed (%i)\n", path, ret);
+    }
+    mobi_free(synthetic.m);
+}
+
+/**
+ @brief Compare strings for qsort
+ 
+ @param[in] a Pointer to first string
+ @param[in] b Pointer to second string
+ @return Result of strcmp
+ */
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ @brief Benchmark all documents in samples directory
+ 
+ Files with ".mobi" extension are benchmarked in alphabetical order.
+ 
+ @param[in] dir_path Path to samples directory
+ @param[in,out] synthesized Array of flags for compression types already synthesized
+ @return 0 on success, 1 on error
+ */
+static int bench_samples(const char *dir_path, bool synthesized[3]) {
+#ifdef HAVE_DIRENT_H
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "Opening samples directory failed: %s\n", dir_path);
+        return 1;
+    }
+    char **paths = NULL;
+    size_t count = 0;
+    size_t allocated = 0;
+    struct dirent *entry;
+    int status = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        const size_t length = strlen(entry->d_name);
+        if (length < 5 || strcmp(entry->d_name + length - 5, ".mobi") != 0) {
+            continue;
+        }
+        if (count == allocated) {
+            allocated = allocated ? 2 * allocated : 16;
+            char **tmp = realloc(paths, allocated * sizeof(*paths));
+            if (tmp == NULL) {
+                status = 1;
+                break;
+            }
+            paths = tmp;
+        }
+        const size_t size = strlen(dir_path) + length + 2;
+        paths[count] = malloc(size);
+        if (paths[count] == NULL) {
+            status = 1;
+            break;
+        }
+        snprintf(paths[count++], size, "%s/%s", dir_path, entry->d_name);
+    }
+    closedir(dir);
+    if (count) {
+        qsort(paths, count, sizeof(*paths), compare_paths);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (status == 0) {
+            bench_path(paths[i], synthesized);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    return status;
+#else
+    fprintf(stderr, "Listing samples directory is not supported, pass documents as arguments: %s\n", dir_path);
+    (void) synthesized;
+    return 1;
+#endif
+}
+
+/**
+ @brief Main
+ 
+ @param[in] argc Arguments count
+ @param[in] argv Arguments array, optional paths to documents
+ @return 0 on success, 1 on error
+ */
+int main(int argc, char *argv[]) {
+    bool synthesized[3] = { false, false, false };
+    int status = 0;
+    printf("[");
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            bench_path(argv[i], synthesized);
+        }
+    } else {
+        status = bench_samples(BENCH_SAMPLES, synthesized);
+    }
+    printf("\n]\n");
+    return status;
+}
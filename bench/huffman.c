@@ -0,0 +1,259 @@
+/** @file huffman.c
+ *
+ * @brief Micro-benchmark of huff/cdic decompressor
+ *
+ * Decompresses all text records of huff/cdic compressed document
+ * with mobi_decompress_huffman() and with reference recursive decompressor
+ * (previous table1 and mincode table based implementation), verifies that outputs
+ * are identical and prints throughput of both.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mobi.h"
+#include "memory.h"
+#include "read.h"
+#include "util.h"
+#include "compression.h"
+#include "buffer.h"
+
+#ifndef BENCH_SAMPLE
+# define BENCH_SAMPLE "sample-unicode-huffdic.mobi"
+#endif
+#define BENCH_PASSES 50
+
+/**
+ @brief Read at most 8 bytes from buffer, big-endian, padded with zeroes
+ 
+ @param[in] buf MOBIBuffer structure to read from
+ @param[in,out] offset Offset to read from, increased by 4 bytes
+ @return 64-bit value
+ */
+static uint64_t reference_fill64(const MOBIBuffer *buf, size_t *offset) {
+    uint64_t val = 0;
+    for (size_t i = 0; i < 8 && *offset + i < buf->maxlen; i++) {
+        val |= (uint64_t) buf->data[*offset + i] << ((7 - i) * 8);
+    }
+    *offset += 4;
+    return val;
+}
+
+/**
+ @brief Reference decompressor, recursive implementation without lookup table and symbols cache
+ 
+ @param[out] buf_out MOBIBuffer structure with decompressed data
+ @param[in] buf_in MOBIBuffer structure with compressed data
+ @param[in] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @param[in] depth Depth of current recursion level
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET reference_huffman(MOBIBuffer *buf_out, MOBIBuffer *buf_in, const MOBIHuffCdic *huffcdic, size_t depth) {
+    if (depth > MOBI_HUFFMAN_MAXDEPTH) {
+        return MOBI_DATA_CORRUPT;
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    int8_t bitcount = 32;
+    int bitsleft = (int) (buf_in->maxlen * 8);
+    uint8_t code_length = 0;
+    size_t fill_offset = 0;
+    uint64_t buffer = reference_fill64(buf_in, &fill_offset);
+    while (ret == MOBI_SUCCESS) {
+        if (bitcount <= 0) {
+            bitcount += 32;
+            buffer = reference_fill64(buf_in, &fill_offset);
+        }
+        uint32_t code = (buffer >> bitcount) & 0xffffffffU;
+        uint32_t t1 = huffcdic->table1[code >> 24];
+        code_length = t1 & 0x1f;
+        uint32_t maxcode = (((t1 >> 8) + 1) << (32 - code_length)) - 1;
+        if (!(t1 & 0x80)) {
+            while (code < huffcdic->mincode_table[code_length]) {
+                if (++code_length >= HUFF_CODETABLE_SIZE) {
+                    return MOBI_DATA_CORRUPT;
+                }
+            }
+            maxcode = huffcdic->maxcode_table[code_length];
+        }
+        bitcount -= code_length;
+        bitsleft -= code_length;
+        if (bitsleft < 0) {
+            break;
+        }
+        uint32_t index = (uint32_t) (maxcode - code) >> (32 - code_length);
+        uint16_t cdic_index = (uint16_t) ((uint32_t)index >> huffcdic->code_length);
+        if (index >= huffcdic->index_count) {
+            return MOBI_DATA_CORRUPT;
+        }
+        uint32_t offset = huffcdic->symbol_offsets[index];
+        uint32_t symbol_length = (uint32_t) huffcdic->symbols[cdic_index][offset] << 8 | (uint32_t) huffcdic->symbols[cdic_index][offset + 1];
+        int is_decompressed = symbol_length >> 15;
+        symbol_length &= 0x7fff;
+        if (is_decompressed) {
+            mobi_buffer_addraw(buf_out, (huffcdic->symbols[cdic_index] + offset + 2), symbol_length);
+            ret = buf_out->error;
+        } else {
+            MOBIBuffer buf_sym;
+            buf_sym.data = huffcdic->symbols[cdic_index] + offset + 2;
+            buf_sym.offset = 0;
+            buf_sym.maxlen = symbol_length;
+            buf_sym.error = MOBI_SUCCESS;
+            ret = reference_huffman(buf_out, &buf_sym, huffcdic, depth + 1);
+        }
+    }
+    return ret;
+}
+
+/**
+ @brief Free symbols cache of huffcdic structure, so that next pass starts with empty cache
+ 
+ @param[in,out] huffcdic MOBIHuffCdic structure
+ */
+static void reset_cache(MOBIHuffCdic *huffcdic) {
+    free(huffcdic->cache_offsets);
+    free(huffcdic->cache_lengths);
+    free(huffcdic->cache_data);
+    huffcdic->cache_offsets = NULL;
+    huffcdic->cache_lengths = NULL;
+    huffcdic->cache_data = NULL;
+    huffcdic->cache_size = 0;
+    huffcdic->cache_maxlen = 0;
+}
+
+/**
+ @brief Decompress all text records
+ 
+ @param[in] m MOBIData structure with loaded document
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @param[out] out Buffer for decompressed text
+ @param[in,out] out_len Size of buffer, on return size of decompressed text
+ @param[in] reference Use reference decompressor if true
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET decompress_text(const MOBIData *m, MOBIHuffCdic *huffcdic, unsigned char *out, size_t *out_len, const int reference) {
+    const uint16_t extra_flags = (m->mh && m->mh->extra_flags) ? *m->mh->extra_flags : 0;
+    const size_t record_maxsize = mobi_get_textrecord_maxsize(m);
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    size_t count = m->rh->text_record_count;
+    size_t total = 0;
+    while (count-- && curr) {
+        const size_t extra_size = extra_flags ? mobi_get_record_extrasize(curr, extra_flags) : 0;
+        if (extra_size == MOBI_NOTSET || extra_size > curr->size) {
+            return MOBI_DATA_CORRUPT;
+        }
+        if (*out_len - total < record_maxsize) {
+            return MOBI_BUFFER_END;
+        }
+        size_t len = record_maxsize;
+        MOBI_RET ret;
+        if (reference) {
+            MOBIBuffer buf_in = { 0, curr->size - extra_size, curr->data, MOBI_SUCCESS };
+            MOBIBuffer buf_out = { 0, len, out + total, MOBI_SUCCESS };
+            ret = reference_huffman(&buf_out, &buf_in, huffcdic, 0);
+            len = buf_out.offset;
+        } else {
+            ret = mobi_decompress_huffman(out + total, curr->data, &len, curr->size - extra_size, huffcdic);
+        }
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        total += len;
+        curr = curr->next;
+    }
+    *out_len = total;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Run decompression passes and print throughput
+ 
+ @param[in] name Name of the run
+ @param[in] m MOBIData structure with loaded document
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @param[out] out Buffer for decompressed text
+ @param[in,out] out_len Size of buffer, on return size of decompressed text
+ @param[in] reference Use reference decompressor if true
+ @param[in] cold Empty symbols cache before each pass if true
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET run(const char *name, const MOBIData *m, MOBIHuffCdic *huffcdic, unsigned char *out, size_t *out_len, const int reference, const int cold) {
+    const size_t maxlen = *out_len;
+    reset_cache(huffcdic);
+    const clock_t start = clock();
+    for (size_t i = 0; i < BENCH_PASSES; i++) {
+        if (cold) {
+            reset_cache(huffcdic);
+        }
+        *out_len = maxlen;
+        const MOBI_RET ret = decompress_text(m, huffcdic, out, out_len, reference);
+        if (ret != MOBI_SUCCESS) {
+            printf("%s: decompression failed (%i)\n", name, ret);
+            return ret;
+        }
+    }
+    const double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    const double megabytes = (double) *out_len * BENCH_PASSES / (1024 * 1024);
+    printf("%-16s %8.3f s %10.2f MB/s\n", name, seconds, seconds > 0 ? megabytes / seconds : 0);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Main
+ 
+ @param[in] argc Arguments count
+ @param[in] argv Arguments array, optional path to huff/cdic compressed document
+ @return 0 on success, 1 on error or output mismatch
+ */
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : BENCH_SAMPLE;
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    MOBI_RET ret = mobi_load_filename(m, path);
+    if (ret != MOBI_SUCCESS || m->rh == NULL || m->rh->compression_type != MOBI_COMPRESSION_HUFFCDIC) {
+        printf("Loading huff/cdic compressed document failed: %s\n", path);
+        mobi_free(m);
+        return 1;
+    }
+    MOBIHuffCdic *huffcdic = mobi_init_huffcdic();
+    if (huffcdic == NULL || mobi_parse_huffdic(m, huffcdic) != MOBI_SUCCESS) {
+        printf("Parsing huff/cdic records failed\n");
+        mobi_free_huffcdic(huffcdic);
+        mobi_free(m);
+        return 1;
+    }
+    const size_t maxlen = (size_t) m->rh->text_record_count * mobi_get_textrecord_maxsize(m);
+    unsigned char *out1 = malloc(maxlen);
+    unsigned char *out2 = malloc(maxlen);
+    int status = 1;
+    if (out1 && out2) {
+        size_t len1 = maxlen;
+        size_t len2 = maxlen;
+        size_t len3 = maxlen;
+        printf("%s: %u text records\n", path, m->rh->text_record_count);
+        if (run("reference", m, huffcdic, out1, &len1, 1, 0) == MOBI_SUCCESS
+            && run("lookup (cold)", m, huffcdic, out2, &len2, 0, 1) == MOBI_SUCCESS
+            && run("lookup (cached)", m, huffcdic, out2, &len3, 0, 0) == MOBI_SUCCESS) {
+            if (len1 == len2 && len2 == len3 && memcmp(out1, out2, len1) == 0) {
+                printf("Outputs identical (%zu bytes)\n", len1);
+                status = 0;
+            } else {
+                printf("Output mismatch (%zu, %zu, %zu)\n", len1, len2, len3);
+            }
+        }
+    }
+    free(out1);
+    free(out2);
+    mobi_free_huffcdic(huffcdic);
+    mobi_free(m);
+    return status;
+}
@@ -37,7 +37,6 @@
 #else
 # define PRINT_RUSAGE_ARG ""
 #endif
-#include <read.h>
 /* encryption */
 #ifdef USE_ENCRYPTION
 # define PRINT_ENC_USG " [-p pid] [-P serial]"
@@ -801,14 +800,15 @@ static int loadmemory(const unsigned char* buffer, long buffer_len, unsigned cha
 		mobi_parse_kf7(m);
 	}
 	errno = 0;
-
-	MEMORY_FILE mf;
-	mf.current_file_position = 0;
-	mf.file_length = buffer_len;
-	mf.file_buffer = buffer;
+	if (buffer_len <= 0) {
+		printf("Empty input buffer\n");
+		mobi_free(m);
+		return ERROR;
+	}
 
 	/* MOBIData structure will be filled with loaded document data and metadata */
-	mobi_ret = mobi_load_file_memory(m, &mf);
+	/* Records data points into input buffer, which outlives MOBIData structure */
+	mobi_ret = mobi_load_buffer(m, buffer, (size_t) buffer_len, MOBI_LOAD_BORROW);
 
 
 	/* Try to print basic metadata, even if further loading failed */
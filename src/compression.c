@@ -9,9 +9,9 @@
  * See <http://www.gnu.org/licenses/>
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "compression.h"
-#include "buffer.h"
 #include "mobi.h"
 #include "debug.h"
 
@@ -21,6 +21,9 @@
 
  Decompressor based on this algorithm:
  http://en.wikibooks.org/wiki/Data_Compression/Dictionary_compression#PalmDoc
+ 
+ Bounds are checked once per token. Runs of literal bytes are copied in bulk,
+ back-references use wide copies unless source and destination overlap by less than a word.
 
  @param[out] out Decompressed destination data
  @param[in] in Compressed source data
@@ -31,159 +34,264 @@
  */
 MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in) {
     MOBI_RET ret = MOBI_SUCCESS;
-    MOBIBuffer *buf_in = mobi_buffer_init_null((unsigned char *) in, len_in);
-    if (buf_in == NULL) {
-        debug_print("%s\n", "Memory allocation failed");
-        return MOBI_MALLOC_FAILED;
-    }
-    MOBIBuffer *buf_out = mobi_buffer_init_null(out, *len_out);
-    if (buf_out == NULL) {
-        mobi_buffer_free_null(buf_in);
-        debug_print("%s\n", "Memory allocation failed");
-        return MOBI_MALLOC_FAILED;
-    }
-    while (ret == MOBI_SUCCESS && buf_in->offset < buf_in->maxlen) {
-        uint8_t byte = mobi_buffer_get8(buf_in);
+    const unsigned char *in_ptr = in;
+    const unsigned char *in_end = in + len_in;
+    unsigned char *out_ptr = out;
+    unsigned char *out_end = out + *len_out;
+    while (in_ptr < in_end) {
+        const uint8_t byte = *in_ptr;
         /* byte pair: space + char */
         if (byte >= 0xc0) {
-            mobi_buffer_add8(buf_out, ' ');
-            mobi_buffer_add8(buf_out, byte ^ 0x80);
+            if (out_end - out_ptr < 2) {
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            *out_ptr++ = ' ';
+            *out_ptr++ = byte ^ 0x80;
+            in_ptr++;
         }
         /* length, distance pair */
         /* 0x8000 + (distance << 3) + ((length-3) & 0x07) */
         else if (byte >= 0x80) {
-            uint8_t next = mobi_buffer_get8(buf_in);
-            uint16_t distance = ((((byte << 8) | ((uint8_t)next)) >> 3) & 0x7ff);
-            uint8_t length = (next & 0x7) + 3;
-            while (length--) {
-                mobi_buffer_move(buf_out, -distance, 1);
+            if (in_end - in_ptr < 2) {
+                ret = MOBI_BUFFER_END;
+                break;
             }
-        }
-        /* single char, not modified */
-        else if (byte >= 0x09) {
-            mobi_buffer_add8(buf_out, byte);
+            const uint8_t next = in_ptr[1];
+            in_ptr += 2;
+            const size_t distance = ((((size_t) byte << 8) | next) >> 3) & 0x7ff;
+            const size_t length = (next & 0x7) + 3;
+            /* zero distance would repeat not yet decompressed data */
+            if (distance == 0 || distance > (size_t) (out_ptr - out) || (size_t) (out_end - out_ptr) < length) {
+                debug_print("%s", "Beyond start/end of buffer\n");
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            const unsigned char *src = out_ptr - distance;
+            if (distance >= 8 && out_end - out_ptr >= 16) {
+                /* maximal length is 10, two non-overlapping word copies cover it */
+                memcpy(out_ptr, src, 8);
+                memcpy(out_ptr + 8, src + 8, 8);
+            } else if (distance >= length) {
+                memcpy(out_ptr, src, length);
+            } else {
+                /* short distance repeats pattern, byte by byte */
+                for (size_t i = 0; i < length; i++) {
+                    out_ptr[i] = src[i];
+                }
+            }
+            out_ptr += length;
         }
         /* val chars not modified */
-        else if (byte >= 0x01) {
-            mobi_buffer_copy(buf_out, buf_in, byte);
+        else if (byte >= 0x01 && byte <= 0x08) {
+            in_ptr++;
+            if ((size_t) (in_end - in_ptr) < byte || (size_t) (out_end - out_ptr) < byte) {
+                debug_print("%s", "End of buffer\n");
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            memcpy(out_ptr, in_ptr, byte);
+            out_ptr += byte;
+            in_ptr += byte;
         }
-        /* char '\0', not modified */
+        /* run of single chars (including '\0'), not modified */
         else {
-            mobi_buffer_add8(buf_out, byte);
-        }
-        if (buf_in->error || buf_out->error) {
-            ret = MOBI_BUFFER_END;
+            const unsigned char *run = in_ptr++;
+            while (in_ptr < in_end && *in_ptr < 0x80 && (*in_ptr >= 0x09 || *in_ptr == 0)) {
+                in_ptr++;
+            }
+            const size_t run_length = (size_t) (in_ptr - run);
+            if ((size_t) (out_end - out_ptr) < run_length) {
+                debug_print("%s", "Buffer full\n");
+                ret = MOBI_BUFFER_END;
+                break;
+            }
+            memcpy(out_ptr, run, run_length);
+            out_ptr += run_length;
         }
     }
-    *len_out = buf_out->offset;
-    mobi_buffer_free_null(buf_out);
-    mobi_buffer_free_null(buf_in);
+    *len_out = (size_t) (out_ptr - out);
     return ret;
 }
 
 /**
- @brief Read at most 8 bytes from buffer, big-endian
+ @brief Read at most 8 bytes from data at given offset, big-endian
  
- If buffer data is shorter returned value is padded with zeroes
+ If data is shorter returned value is padded with zeroes
  
- @param[in] buf MOBIBuffer structure to read from
+ @param[in] data Source data
+ @param[in] length Size of source data
+ @param[in] offset Offset of first byte to read
  @return 64-bit value
  */
-static MOBI_INLINE uint64_t mobi_buffer_fill64(MOBIBuffer *buf) {
+static MOBI_INLINE uint64_t mobi_huffman_fill64(const unsigned char *data, const size_t length, const size_t offset) {
     uint64_t val = 0;
-    uint8_t i = 8;
-    size_t bytesleft = buf->maxlen - buf->offset;
-    unsigned char *ptr = buf->data + buf->offset;
-    while (i-- && bytesleft--) {
-        val |= (uint64_t) *ptr++ << (i * 8);
+    if (offset < length && length - offset >= 8) {
+        const unsigned char *ptr = data + offset;
+        val = (uint64_t) ptr[0] << 56 | (uint64_t) ptr[1] << 48 | (uint64_t) ptr[2] << 40 | (uint64_t) ptr[3] << 32
+            | (uint64_t) ptr[4] << 24 | (uint64_t) ptr[5] << 16 | (uint64_t) ptr[6] << 8 | (uint64_t) ptr[7];
+        return val;
+    }
+    for (size_t i = 0; i < 8 && offset + i < length; i++) {
+        val |= (uint64_t) data[offset + i] << ((7 - i) * 8);
     }
-    /* increase counter by 4 bytes only, 4 bytes overlap on each call */
-    buf->offset += 4;
     return val;
 }
 
 /**
- @brief Internal function for huff/cdic decompression
+ @brief Store decompressed symbol in huff/cdic symbols cache
  
- Decompressor and HUFF/CDIC records parsing based on:
- perl EBook::Tools::Mobipocket
- python mobiunpack.py, calibre
+ Cache is optional, symbol is silently skipped on allocation failure.
  
- @param[out] buf_out MOBIBuffer structure with decompressed data
- @param[in] buf_in MOBIBuffer structure with compressed data
- @param[in] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
- @param[in] depth Depth of current recursion level
- @return MOBI_RET status code (on success MOBI_SUCCESS)
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @param[in] index Symbol index
+ @param[in] data Decompressed symbol data
+ @param[in] length Decompressed symbol length
  */
-static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer *buf_in, const MOBIHuffCdic *huffcdic, size_t depth) {
-    if (depth > MOBI_HUFFMAN_MAXDEPTH) {
-        debug_print("Too many levels of recursion: %zu\n", depth);
-        return MOBI_DATA_CORRUPT;
+static void mobi_huffcdic_cache_add(MOBIHuffCdic *huffcdic, const uint32_t index, const unsigned char *data, const size_t length) {
+    if (length > UINT32_MAX) {
+        return;
     }
-    MOBI_RET ret = MOBI_SUCCESS;
-    int8_t bitcount = 32;
-    /* this cast should be safe: max record size is 4096 */
-    int bitsleft = (int) (buf_in->maxlen * 8);
-    uint8_t code_length = 0;
-    uint64_t buffer = mobi_buffer_fill64(buf_in);
-    while (ret == MOBI_SUCCESS) {
-        if (bitcount <= 0) {
-            bitcount += 32;
-            buffer = mobi_buffer_fill64(buf_in);
-        }
-        uint32_t code = (buffer >> bitcount) & 0xffffffffU;
-        /* lookup code in table1 */
-        uint32_t t1 = huffcdic->table1[code >> 24];
-        /* get maxcode and codelen from t1 */
-        code_length = t1 & 0x1f;
-        uint32_t maxcode = (((t1 >> 8) + 1) << (32 - code_length)) - 1;
-        /* check termination bit */
+    if (huffcdic->cache_offsets == NULL) {
+        huffcdic->cache_offsets = calloc(huffcdic->index_count, sizeof(*huffcdic->cache_offsets));
+        huffcdic->cache_lengths = malloc(huffcdic->index_count * sizeof(*huffcdic->cache_lengths));
+        if (huffcdic->cache_offsets == NULL || huffcdic->cache_lengths == NULL) {
+            debug_print("%s\n", "Memory allocation for symbols cache failed");
+            free(huffcdic->cache_offsets);
+            free(huffcdic->cache_lengths);
+            huffcdic->cache_offsets = NULL;
+            huffcdic->cache_lengths = NULL;
+            return;
+        }
+    }
+    if (huffcdic->cache_size + length > huffcdic->cache_maxlen) {
+        size_t maxlen = huffcdic->cache_maxlen ? huffcdic->cache_maxlen : 4096;
+        while (huffcdic->cache_size + length > maxlen) {
+            maxlen *= 2;
+        }
+        unsigned char *cache_data = realloc(huffcdic->cache_data, maxlen);
+        if (cache_data == NULL) {
+            debug_print("%s\n", "Memory allocation for symbols cache failed");
+            return;
+        }
+        huffcdic->cache_data = cache_data;
+        huffcdic->cache_maxlen = maxlen;
+    }
+    if (length) {
+        memcpy(huffcdic->cache_data + huffcdic->cache_size, data, length);
+    }
+    huffcdic->cache_offsets[index] = huffcdic->cache_size + 1;
+    huffcdic->cache_lengths[index] = (uint32_t) length;
+    huffcdic->cache_size += length;
+}
+
+/**
+ @brief Build lookup table for short huffman codes
+ 
+ For every HUFF_LOOKUP_BITS bits long code prefix store code length and symbol index,
+ so that codes not longer than HUFF_LOOKUP_BITS are resolved with single table probe.
+ Entries for longer codes have zero length, they are resolved with table1 and mincode/maxcode tables.
+ Must be called after table1, mincode and maxcode tables are filled.
+ 
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed data from huff record
+ */
+void mobi_init_huffman_lookup(MOBIHuffCdic *huffcdic) {
+    for (uint32_t prefix = 0; prefix < (1U << HUFF_LOOKUP_BITS); prefix++) {
+        /* all codes with this prefix give the same length and index if length fits in prefix */
+        const uint32_t code = prefix << (32 - HUFF_LOOKUP_BITS);
+        const uint32_t t1 = huffcdic->table1[code >> 24];
+        uint32_t code_length = t1 & 0x1f;
         if (!(t1 & 0x80)) {
-            /* get offset from mincode, maxcode tables */
-            while (code < huffcdic->mincode_table[code_length]) {
-                if (++code_length >= HUFF_CODETABLE_SIZE) {
-                    debug_print("Wrong offset to mincode table: %hhu\n", code_length);
-                    return MOBI_DATA_CORRUPT;
-                }
+            while (code_length <= HUFF_LOOKUP_BITS && code < huffcdic->mincode_table[code_length]) {
+                code_length++;
             }
-            maxcode = huffcdic->maxcode_table[code_length];
-        }
-        bitcount -= code_length;
-        bitsleft -= code_length;
-        if (bitsleft < 0) {
-            break;
         }
-        /* get index for symbol offset */
-        uint32_t index = (uint32_t) (maxcode - code) >> (32 - code_length);
-        /* check which part of cdic to use */
-        uint16_t cdic_index = (uint16_t) ((uint32_t)index >> huffcdic->code_length);
-        if (index >= huffcdic->index_count) {
-            debug_print("Wrong symbol offsets index: %u\n", index);
-            return MOBI_DATA_CORRUPT;
+        if (code_length == 0 || code_length > HUFF_LOOKUP_BITS) {
+            huffcdic->lookup[prefix] = 0;
+            continue;
         }
-        /* get offset */
-        uint32_t offset = huffcdic->symbol_offsets[index];
-        uint32_t symbol_length = (uint32_t) huffcdic->symbols[cdic_index][offset] << 8 | (uint32_t) huffcdic->symbols[cdic_index][offset + 1];
-        /* 1st bit is is_decompressed flag */
-        int is_decompressed = symbol_length >> 15;
-        /* get rid of flag */
-        symbol_length &= 0x7fff;
-        if (is_decompressed) {
-            /* symbol is at (offset + 2), 2 bytes used earlier for symbol length */
-            mobi_buffer_addraw(buf_out, (huffcdic->symbols[cdic_index] + offset + 2), symbol_length);
-            ret = buf_out->error;
+        uint32_t maxcode;
+        if (t1 & 0x80) {
+            maxcode = (((t1 >> 8) + 1) << (32 - code_length)) - 1;
         } else {
-            /* symbol is compressed */
-            /* TODO cache uncompressed symbols? */
-            MOBIBuffer buf_sym;
-            buf_sym.data = huffcdic->symbols[cdic_index] + offset + 2;
-            buf_sym.offset = 0;
-            buf_sym.maxlen = symbol_length;
-            buf_sym.error = MOBI_SUCCESS;
-            ret = mobi_decompress_huffman_internal(buf_out, &buf_sym, huffcdic, depth + 1);
+            maxcode = huffcdic->maxcode_table[code_length];
         }
+        const uint32_t index = (maxcode - code) >> (32 - code_length);
+        huffcdic->lookup[prefix] = index << 8 | code_length;
     }
-    return ret;
+}
+
+/**
+ @brief Find length and symbol index of a code longer than lookup table prefix
+ 
+ @param[in] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @param[in] code Next 32 bits of compressed data
+ @param[out] code_length Length of the code
+ @param[out] index Symbol index
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_huffman_lookup_long(const MOBIHuffCdic *huffcdic, const uint32_t code, uint32_t *code_length, uint32_t *index) {
+    /* lookup code in table1 */
+    const uint32_t t1 = huffcdic->table1[code >> 24];
+    /* get maxcode and codelen from t1 */
+    uint32_t length = t1 & 0x1f;
+    uint32_t maxcode;
+    if (t1 & 0x80) {
+        maxcode = length ? (((t1 >> 8) + 1) << (32 - length)) - 1 : 0;
+    } else {
+        /* get offset from mincode, maxcode tables */
+        while (code < huffcdic->mincode_table[length]) {
+            if (++length >= HUFF_CODETABLE_SIZE) {
+                debug_print("Wrong offset to mincode table: %u\n", length);
+                return MOBI_DATA_CORRUPT;
+            }
+        }
+        maxcode = huffcdic->maxcode_table[length];
+    }
+    if (length == 0) {
+        debug_print("%s", "Wrong code length: 0\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    *code_length = length;
+    *index = (maxcode - code) >> (32 - length);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compressed data currently being decoded by huffman decompressor
+ 
+ Compressed symbols are decoded in nested frames, frame of the text record is at the bottom of the stack
+ */
+typedef struct {
+    const unsigned char *data; /**< Compressed data */
+    size_t length; /**< Size of compressed data */
+    size_t offset; /**< Offset of data to be loaded on next buffer fill */
+    uint64_t buffer; /**< Bits buffer, current code starts bitcount bits before its lower half */
+    int bitcount; /**< Position of current code in buffer */
+    size_t bitsleft; /**< Number of bits not decoded yet */
+    size_t out_start; /**< Offset in output where decompressed data of this frame starts */
+    uint32_t index; /**< Symbol index of decompressed data */
+} MOBIHuffmanFrame;
+
+/**
+ @brief Initialize huffman decompressor frame
+ 
+ @param[out] frame Frame to be initialized
+ @param[in] data Compressed data
+ @param[in] length Size of compressed data
+ @param[in] out_start Offset in output where decompressed data will be written
+ @param[in] index Symbol index of compressed data
+ */
+static MOBI_INLINE void mobi_huffman_frame_init(MOBIHuffmanFrame *frame, const unsigned char *data, const size_t length, const size_t out_start, const uint32_t index) {
+    frame->data = data;
+    frame->length = length;
+    frame->buffer = mobi_huffman_fill64(data, length, 0);
+    /* buffer is refilled after 4 bytes, 4 bytes overlap on each fill */
+    frame->offset = 4;
+    frame->bitcount = 32;
+    frame->bitsleft = length * 8;
+    frame->out_start = out_start;
+    frame->index = index;
 }
 
 /**
@@ -193,29 +301,96 @@ static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer
  perl EBook::Tools::Mobipocket
  python mobiunpack.py, calibre
  
+ Codes up to HUFF_LOOKUP_BITS long are resolved with single probe of lookup table.
+ Compressed symbols are decoded iteratively on stack of frames limited to MOBI_HUFFMAN_MAXDEPTH levels,
+ decompressed once and cached in huffcdic structure.
+ 
  @param[out] out Decompressed destination data
  @param[in] in Compressed source data
  @param[in,out] len_out Size of the memory reserved for decompressed data.
  On return it is set to actual size of decompressed data
  @param[in] len_in Size of compressed data
- @param[in] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records, decompressed symbols are cached there
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, const MOBIHuffCdic *huffcdic) {
-    MOBIBuffer *buf_in = mobi_buffer_init_null((unsigned char *) in, len_in);
-    if (buf_in == NULL) {
-        debug_print("%s\n", "Memory allocation failed");
-        return MOBI_MALLOC_FAILED;
-    }
-    MOBIBuffer *buf_out = mobi_buffer_init_null(out, *len_out);
-    if (buf_out == NULL) {
-        mobi_buffer_free_null(buf_in);
-        debug_print("%s\n", "Memory allocation failed");
-        return MOBI_MALLOC_FAILED;
+MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, MOBIHuffCdic *huffcdic) {
+    MOBI_RET ret = MOBI_SUCCESS;
+    MOBIHuffmanFrame stack[MOBI_HUFFMAN_MAXDEPTH + 1];
+    size_t depth = 0;
+    MOBIHuffmanFrame *frame = stack;
+    mobi_huffman_frame_init(frame, in, len_in, 0, 0);
+    unsigned char *out_ptr = out;
+    const unsigned char *out_end = out + *len_out;
+    while (ret == MOBI_SUCCESS) {
+        if (frame->bitcount <= 0) {
+            frame->bitcount += 32;
+            frame->buffer = mobi_huffman_fill64(frame->data, frame->length, frame->offset);
+            frame->offset += 4;
+        }
+        const uint32_t code = (frame->buffer >> frame->bitcount) & 0xffffffffU;
+        const uint32_t entry = huffcdic->lookup[code >> (32 - HUFF_LOOKUP_BITS)];
+        uint32_t code_length = entry & 0x1f;
+        uint32_t index = entry >> 8;
+        if (code_length == 0) {
+            ret = mobi_huffman_lookup_long(huffcdic, code, &code_length, &index);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+        }
+        if (code_length > frame->bitsleft) {
+            /* end of frame data */
+            if (depth == 0) {
+                break;
+            }
+            mobi_huffcdic_cache_add(huffcdic, frame->index, out + frame->out_start, (size_t) (out_ptr - out) - frame->out_start);
+            frame = &stack[--depth];
+            continue;
+        }
+        frame->bitcount -= (int) code_length;
+        frame->bitsleft -= code_length;
+        if (index >= huffcdic->index_count) {
+            debug_print("Wrong symbol offsets index: %u\n", index);
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        /* check which part of cdic to use */
+        const uint16_t cdic_index = (uint16_t) (index >> huffcdic->code_length);
+        /* get offset */
+        const unsigned char *symbol = huffcdic->symbols[cdic_index] + huffcdic->symbol_offsets[index];
+        uint32_t symbol_length = (uint32_t) symbol[0] << 8 | (uint32_t) symbol[1];
+        /* 1st bit is is_decompressed flag */
+        const int is_decompressed = symbol_length >> 15;
+        /* get rid of flag */
+        symbol_length &= 0x7fff;
+        const unsigned char *source;
+        size_t source_length;
+        if (is_decompressed) {
+            /* symbol is at (offset + 2), 2 bytes used earlier for symbol length */
+            source = symbol + 2;
+            source_length = symbol_length;
+        } else if (huffcdic->cache_offsets && huffcdic->cache_offsets[index]) {
+            /* symbol was already decompressed */
+            source = huffcdic->cache_data + huffcdic->cache_offsets[index] - 1;
+            source_length = huffcdic->cache_lengths[index];
+        } else {
+            /* symbol is compressed, decode it in nested frame */
+            if (depth == MOBI_HUFFMAN_MAXDEPTH) {
+                debug_print("Too many levels of nested symbols: %zu\n", depth + 1);
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            frame = &stack[++depth];
+            mobi_huffman_frame_init(frame, symbol + 2, symbol_length, (size_t) (out_ptr - out), index);
+            continue;
+        }
+        if ((size_t) (out_end - out_ptr) < source_length) {
+            debug_print("%s", "Buffer full\n");
+            ret = MOBI_BUFFER_END;
+            break;
+        }
+        memcpy(out_ptr, source, source_length);
+        out_ptr += source_length;
     }
-    MOBI_RET ret = mobi_decompress_huffman_internal(buf_out, buf_in, huffcdic, 0);
-    *len_out = buf_out->offset;
-    mobi_buffer_free_null(buf_out);
-    mobi_buffer_free_null(buf_in);
+    *len_out = (size_t) (out_ptr - out);
     return ret;
 }
@@ -19,8 +19,9 @@
 #endif
 
 /* FIXME: what is the reasonable value? */
-#define MOBI_HUFFMAN_MAXDEPTH 20 /**< Maximal recursion level for huffman decompression routine */
+#define MOBI_HUFFMAN_MAXDEPTH 20 /**< Maximal nesting level of compressed symbols in huffman decompression routine */
 #define HUFF_CODETABLE_SIZE 33 /**< Size of min- and maxcode tables */
+#define HUFF_LOOKUP_BITS 12 /**< Number of code bits resolved by single probe of lookup table */
 
 
 /**
@@ -33,11 +34,18 @@ typedef struct {
     uint32_t table1[256]; /**< Table of big-endian indices from HUFF record data1 */
     uint32_t mincode_table[HUFF_CODETABLE_SIZE]; /**< Table of big-endian mincodes from HUFF record data2 */
     uint32_t maxcode_table[HUFF_CODETABLE_SIZE]; /**< Table of big-endian maxcodes from HUFF record data2 */
+    uint32_t lookup[1 << HUFF_LOOKUP_BITS]; /**< Table of code lengths (bits 0-4) and symbol indices (bits 8-31) for codes up to HUFF_LOOKUP_BITS long, indexed by code prefix, zero length for longer codes */
     uint16_t *symbol_offsets; /**< Index of symbol offsets parsed from CDIC records (index_count entries) */
     unsigned char **symbols; /**< Array of pointers to start of symbols data in each CDIC record (index = number of CDIC record) */
+    size_t *cache_offsets; /**< Offsets of decompressed symbols in cache data plus one, zero if not cached (index_count entries), NULL if cache not used yet */
+    uint32_t *cache_lengths; /**< Lengths of decompressed symbols (index_count entries) */
+    unsigned char *cache_data; /**< Arena of decompressed symbols data */
+    size_t cache_size; /**< Used size of cache data */
+    size_t cache_maxlen; /**< Allocated size of cache data */
 } MOBIHuffCdic;
 
 MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in);
-MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, const MOBIHuffCdic *huffcdic);
+void mobi_init_huffman_lookup(MOBIHuffCdic *huffcdic);
+MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, MOBIHuffCdic *huffcdic);
 
 #endif
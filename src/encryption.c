@@ -32,6 +32,9 @@
 #include "randombytes.h"
 #include "sha1.h"
 #include "encryption.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #define INTERNAL_READER_KEY ((unsigned char*) "\x72\x38\x33\xb0\xb4\xf2\xe3\xca\xdf\x09\x01\xd6\xe2\xe0\x3f\x96")
 #define INTERNAL_PUBLISHER_KEY ((unsigned char*) "\x95\xda\x7b\xed\x90\x5e\x10\x2e\x44\x4c\xb5\xe5\xc0\x25\xdf\x2c")
@@ -44,6 +47,9 @@
 #define VOUCHERSIZE 48
 #define VOUCHERS_COUNT_MAX 1024
 #define VOUCHERS_SIZE_MIN 288
+#define KEYRING_BUCKETS 256 /* one bucket for each key checksum */
+#define KEYRING_VARIANTS_BUCKETS 64
+#define KEYRING_VARIANTS_MAX 1024
 #define pk1_swap(a, b) { uint16_t tmp = a; (a) = b; (b) = tmp; }
 
 /**
@@ -136,9 +142,9 @@ static MOBI_RET mobi_pk1_decrypt(unsigned char *out, const unsigned char *in, si
     }
     unsigned char key_copy[KEYSIZE];
     memcpy(key_copy, key, KEYSIZE);
-    MOBIPk1 *pk1 = calloc(1, sizeof(MOBIPk1));
+    MOBIPk1 pk1 = { 0, 0, { 0 } };
     while (length--) {
-        uint16_t inter = mobi_pk1_assemble(pk1, key_copy);
+        uint16_t inter = mobi_pk1_assemble(&pk1, key_copy);
         uint8_t cfc = inter >> 8;
         uint8_t cfd = inter & 0xff;
         uint8_t c = *in++;
@@ -148,7 +154,6 @@ static MOBI_RET mobi_pk1_decrypt(unsigned char *out, const unsigned char *in, si
         }
         *out++ = c;
     }
-    free(pk1);
     return MOBI_SUCCESS;
 }
 
@@ -165,11 +170,11 @@ static MOBI_RET mobi_pk1_encrypt(unsigned char *out, const unsigned char *in, si
     if (!out || !in) {
         return MOBI_INIT_FAILED;
     }
-    MOBIPk1 *pk1 = calloc(1, sizeof(MOBIPk1));
+    MOBIPk1 pk1 = { 0, 0, { 0 } };
     unsigned char key_copy[KEYSIZE];
     memcpy(key_copy, key, KEYSIZE);
     while (length--) {
-        uint16_t inter = mobi_pk1_assemble(pk1, key_copy);
+        uint16_t inter = mobi_pk1_assemble(&pk1, key_copy);
         uint8_t cfc = inter >> 8;
         uint8_t cfd = inter & 0xff;
         uint8_t c = *in++;
@@ -179,23 +184,44 @@ static MOBI_RET mobi_pk1_encrypt(unsigned char *out, const unsigned char *in, si
         c ^= (cfc ^ cfd);
         *out++ = c;
     }
-    free(pk1);
     return MOBI_SUCCESS;
 }
 
 
+/**
+ @brief Get DRM structure attached to document
+ 
+ @param[in] m MOBIData structure with raw data and metadata
+ @return Pointer to DRM structure, NULL if not set
+ */
+MOBIDrm * mobi_drm_get(const MOBIData *m) {
+    const MOBIInternals *internals = m->internals;
+    if (internals == NULL) {
+        return NULL;
+    }
+    return internals->drm;
+}
+
 /**
  @brief Initialize DRM structure
  
- @return Number of parsed records
+ Existing structure is reused.
+ 
+ @param[in,out] m MOBIData structure with raw data and metadata
+ @return Pointer to DRM structure, NULL on failure
  */
-static MOBIDrm * mobi_drm_init() {
-    
-    MOBIDrm *drm = calloc(1, sizeof(MOBIDrm));
-    if (drm == NULL) {
-        debug_print("%s", "Memory allocation for drm structure failed\n");
+static MOBIDrm * mobi_drm_init(MOBIData *m) {
+    MOBIInternals *internals = mobi_init_internals(m);
+    if (internals == NULL) {
+        return NULL;
+    }
+    if (internals->drm == NULL) {
+        internals->drm = calloc(1, sizeof(MOBIDrm));
+        if (internals->drm == NULL) {
+            debug_print("%s", "Memory allocation for drm structure failed\n");
+        }
     }
-    return drm;
+    return internals->drm;
 }
 
 /**
@@ -219,8 +245,9 @@ static void mobi_free_cookie(MOBICookie *cookie) {
  @param[in,out] m MOBIData structure with raw data and metadata
  */
 void mobi_free_drm(MOBIData *m) {
-    if (m->internals) {
-        MOBIDrm *drm = m->internals;
+    MOBIInternals *internals = m->internals;
+    if (internals && internals->drm) {
+        MOBIDrm *drm = internals->drm;
         if (drm->key) {
             free(drm->key);
         }
@@ -232,8 +259,8 @@ void mobi_free_drm(MOBIData *m) {
             free(drm->cookies);
         }
         drm->cookies = NULL;
-        free(m->internals);
-        m->internals = NULL;
+        free(internals->drm);
+        internals->drm = NULL;
     }
     
 }
@@ -246,10 +273,10 @@ void mobi_free_drm(MOBIData *m) {
  @return Number of parsed records
  */
 static MOBI_RET mobi_drmkey_init(MOBIData *m, const unsigned char key[KEYSIZE]) {
-    if (m->internals == NULL && (m->internals = mobi_drm_init()) == NULL) {
+    MOBIDrm *drm = mobi_drm_init(m);
+    if (drm == NULL) {
         return MOBI_MALLOC_FAILED;
     }
-    MOBIDrm *drm = m->internals;
     if (drm->key == NULL) {
         drm->key = malloc(KEYSIZE);
         if (drm->key == NULL) {
@@ -412,6 +439,44 @@ static MOBI_RET mobi_cookie_verify(const uint32_t drm_verification, const unsign
     return MOBI_DRM_KEYNOTFOUND;
 }
 
+/**
+ @brief Calculate PID key used to encrypt voucher cookie
+ 
+ @param[out] key PID key
+ @param[in] pid PID
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_drmpid_key(unsigned char key[KEYSIZE], const unsigned char *pid) {
+    memset(key, 0, KEYSIZE);
+    memcpy(key, pid, PIDSIZE - 2);
+    return mobi_pk1_encrypt(key, key, KEYSIZE, INTERNAL_READER_KEY);
+}
+
+/**
+ @brief Try to decrypt voucher cookie with given key
+ 
+ @param[out] key Main key, set on success
+ @param[in] voucher Voucher
+ @param[in] try_key Key used to decrypt cookie
+ @param[in] key_type Key type, 1 for PID key, 3 for default key
+ @return MOBI_RET status code (on success MOBI_SUCCESS, MOBI_DRM_KEYNOTFOUND if key does not match)
+ */
+static MOBI_RET mobi_voucher_try(unsigned char key[KEYSIZE], const MOBIVoucher *voucher, const unsigned char try_key[KEYSIZE], const uint8_t key_type) {
+    if (voucher->checksum != mobi_drmkey_checksum(try_key)) {
+        return MOBI_DRM_KEYNOTFOUND;
+    }
+    unsigned char cookie[COOKIESIZE];
+    MOBI_RET ret = mobi_pk1_decrypt(cookie, voucher->cookie, COOKIESIZE, try_key);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    ret = mobi_cookie_verify(voucher->verification, cookie, key_type);
+    if (ret == MOBI_SUCCESS) {
+        memcpy(key, &cookie[8], KEYSIZE);
+    }
+    return ret;
+}
+
 /**
  @brief Get key corresponding to encryption type 2
  
@@ -426,11 +491,9 @@ static MOBI_RET mobi_drmkey_get_v2(unsigned char key[KEYSIZE], const unsigned ch
     
     MOBI_RET ret;
     unsigned char *device_key = NULL;
-    unsigned char pidkey[KEYSIZE] = "\0";
+    unsigned char pidkey[KEYSIZE];
     if (pid) {
-        memcpy(pidkey, pid, PIDSIZE - 2);
-
-        ret = mobi_pk1_encrypt(pidkey, pidkey, KEYSIZE, INTERNAL_READER_KEY);
+        ret = mobi_drmpid_key(pidkey, pid);
         if (ret != MOBI_SUCCESS) {
             return ret;
         }
@@ -451,19 +514,9 @@ static MOBI_RET mobi_drmkey_get_v2(unsigned char key[KEYSIZE], const unsigned ch
             const unsigned char *try_key = (tries == 2) ? device_key : INTERNAL_READER_KEY;
             const uint8_t try_type = (tries == 2) ? 1 : 3;
             
-            if (try_key && drm[i]->checksum == mobi_drmkey_checksum(try_key)) {
-
-                unsigned char cookie[COOKIESIZE];
-                ret = mobi_pk1_decrypt(cookie, drm[i]->cookie, COOKIESIZE, try_key);
-                if (ret != MOBI_SUCCESS) {
-                    // fatal error
-                    mobi_free_vouchers(drm, drm_count);
-                    return ret;
-                }
-
-                ret = mobi_cookie_verify(drm[i]->verification, cookie, try_type);
+            if (try_key) {
+                ret = mobi_voucher_try(key, drm[i], try_key, try_type);
                 if (ret == MOBI_SUCCESS) {
-                    memcpy(key, &cookie[8], KEYSIZE);
                     mobi_free_vouchers(drm, drm_count);
                     if (tries == 2) {
                         debug_print("Cookie encrypted with pid key%s", "\n");
@@ -474,6 +527,10 @@ static MOBI_RET mobi_drmkey_get_v2(unsigned char key[KEYSIZE], const unsigned ch
                 }
                 if (ret == MOBI_DRM_EXPIRED) {
                     key_expired = true;
+                } else if (ret != MOBI_DRM_KEYNOTFOUND) {
+                    // fatal error
+                    mobi_free_vouchers(drm, drm_count);
+                    return ret;
                 }
             }
             tries--;
@@ -559,7 +616,7 @@ MOBI_RET mobi_buffer_decrypt(unsigned char *out, const unsigned char *in, const
     if (m == NULL || !mobi_has_drmkey(m)) {
         return MOBI_INIT_FAILED;
     }
-    MOBIDrm *drm = m->internals;
+    MOBIDrm *drm = mobi_drm_get(m);
     return mobi_pk1_decrypt(out, in, length, drm->key);
 }
 
@@ -577,7 +634,7 @@ static MOBI_RET mobi_buffer_encrypt(unsigned char *out, const unsigned char *in,
         return MOBI_INIT_FAILED;
     }
     
-    MOBIDrm *drm = m->internals;
+    MOBIDrm *drm = mobi_drm_get(m);
     return mobi_pk1_encrypt(out, in, length, drm->key);
 }
 
@@ -761,60 +818,62 @@ static void mobi_free_exthdrm(MOBIExthDrm **exth_drm) {
 }
 
 /**
- @brief Calculate SHA-1 hash for given message
+ @brief Get tamperproof message from EXTH records
  
- @param[in] message Message
- @param[in] message_length Message length
- @param[out] hash Hash
- */
-static void mobi_SHA1(unsigned char hash[SHA1_DIGEST_SIZE], size_t message_length, const unsigned char *message) {
-    SHA1_CTX ctx;
-    SHA1_Init(&ctx);
-    SHA1_Update(&ctx, message, message_length);
-    SHA1_Final(&ctx, hash);
-}
-
-/**
- @brief Calculate PID using device serial and values stored in EXTH records
-  
- @param[in] serial Device serial number
+ Message consists of EXTH_TAMPERKEYS record data followed by drm token.
+ Must be deallocated after use.
+ 
+ @param[out] message Message, NULL if empty
+ @param[out] message_size Message size
  @param[in] m MOBIData structure
- @param[out] pid Pid
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-static MOBI_RET mobi_drmpid_from_serial_exth(char pid[PIDSIZE + 1], const MOBIData *m, const char *serial) {
-    memset(pid, 0, PIDSIZE + 1);
-    
-    MOBI_RET ret = mobi_serial_verify(serial);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
-    }
-    
+static MOBI_RET mobi_exthdrm_message(unsigned char **message, size_t *message_size, const MOBIData *m) {
+    *message = NULL;
+    *message_size = 0;
     MOBIExthDrm *exth_drm = NULL;
-    ret = mobi_exthdrm_get(&exth_drm, m);
+    MOBI_RET ret = mobi_exthdrm_get(&exth_drm, m);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    const size_t serial_length = strlen(serial);
-    size_t message_length = serial_length + exth_drm->token_size + exth_drm->data_size;
-    
-    unsigned char *message = malloc(message_length);
-    if (message == NULL) {
-        mobi_free_exthdrm(&exth_drm);
-        return MOBI_MALLOC_FAILED;
-    }
-    memcpy(message, serial, serial_length);
-    if (exth_drm->data_size) {
-        memcpy(&message[serial_length], exth_drm->data, exth_drm->data_size);
-    }
-    if (exth_drm->token_size) {
-        memcpy(&message[serial_length + exth_drm->data_size], exth_drm->token, exth_drm->token_size);
+    const size_t size = exth_drm->data_size + exth_drm->token_size;
+    if (size) {
+        *message = malloc(size);
+        if (*message == NULL) {
+            mobi_free_exthdrm(&exth_drm);
+            return MOBI_MALLOC_FAILED;
+        }
+        if (exth_drm->data_size) {
+            memcpy(*message, exth_drm->data, exth_drm->data_size);
+        }
+        if (exth_drm->token_size) {
+            memcpy(*message + exth_drm->data_size, exth_drm->token, exth_drm->token_size);
+        }
+        *message_size = size;
     }
     mobi_free_exthdrm(&exth_drm);
+    return MOBI_SUCCESS;
+}
 
+/**
+ @brief Calculate PID using device serial and tamperproof message
+ 
+ @param[out] pid Pid
+ @param[in] serial Device serial number
+ @param[in] message Tamperproof message, NULL if empty
+ @param[in] message_size Message size
+ */
+static void mobi_drmpid_from_serial_message(char pid[PIDSIZE + 1], const char *serial, const unsigned char *message, const size_t message_size) {
+    memset(pid, 0, PIDSIZE + 1);
+    
+    SHA1_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, (const unsigned char *) serial, strlen(serial));
+    if (message_size) {
+        SHA1_Update(&ctx, message, message_size);
+    }
     unsigned char hash[SHA1_DIGEST_SIZE];
-    mobi_SHA1(hash, message_length, message);
-    free(message);
+    SHA1_Final(&ctx, hash);
 
     int bytes = 8;
     uint64_t val = 0;
@@ -831,6 +890,32 @@ static MOBI_RET mobi_drmpid_from_serial_exth(char pid[PIDSIZE + 1], const MOBIDa
     char checksum[2] = "\0";
     mobi_drmpid_checksum(checksum, (unsigned char *) pid);
     memcpy(&pid[PIDSIZE - 2], checksum, 2);
+}
+
+/**
+ @brief Calculate PID using device serial and values stored in EXTH records
+  
+ @param[in] serial Device serial number
+ @param[in] m MOBIData structure
+ @param[out] pid Pid
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_drmpid_from_serial_exth(char pid[PIDSIZE + 1], const MOBIData *m, const char *serial) {
+    memset(pid, 0, PIDSIZE + 1);
+    
+    MOBI_RET ret = mobi_serial_verify(serial);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    
+    unsigned char *message;
+    size_t message_size;
+    ret = mobi_exthdrm_message(&message, &message_size, m);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    mobi_drmpid_from_serial_message(pid, serial, message, message_size);
+    free(message);
     return MOBI_SUCCESS;
 }
 
@@ -881,10 +966,10 @@ static MOBI_RET mobi_cookie_add(MOBIData *m, const unsigned char *pid, const uin
     if (valid_from > valid_to) {
         return MOBI_PARAM_ERR;
     }
-    if (m->internals == NULL && (m->internals = mobi_drm_init()) == NULL) {
+    MOBIDrm *drm = mobi_drm_init(m);
+    if (drm == NULL) {
         return MOBI_MALLOC_FAILED;
     }
-    MOBIDrm *drm = m->internals;
     if (drm->cookies_count == VOUCHERS_COUNT_MAX) {
         debug_print("Maximum PID count reached (%d) %s", VOUCHERS_COUNT_MAX, "\n");
         return MOBI_PARAM_ERR;
@@ -1108,6 +1193,474 @@ MOBI_RET mobi_drmkey_delete(MOBIData *m) {
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief PID key stored in key ring
+ */
+typedef struct {
+    unsigned char pid[PIDSIZE]; /**< PID */
+    unsigned char key[KEYSIZE]; /**< PID key used to encrypt voucher cookie */
+    size_t next; /**< Index + 1 of next key with the same checksum, 0 if none */
+} MOBIRingKey;
+
+/**
+ @brief Book PID keys derived from all key ring serials for one tamperproof message
+ */
+typedef struct MOBIRingVariant {
+    unsigned char *message; /**< Tamperproof message, NULL if empty */
+    size_t message_size; /**< Message size */
+    uint32_t hash; /**< Message checksum */
+    MOBIRingKey *keys; /**< Book PID keys, one for each serial */
+    size_t keys_count; /**< Keys count */
+    struct MOBIRingVariant *next; /**< Next variant in the same hash bucket */
+} MOBIRingVariant;
+
+/**
+ @brief Device key ring
+ */
+struct MOBIKeyRing {
+    MOBIRingKey *keys; /**< Device PID keys in order of adding */
+    size_t keys_count; /**< Keys count */
+    size_t buckets[KEYRING_BUCKETS]; /**< Index + 1 of first key with given checksum, 0 if none */
+    char **serials; /**< Device serial numbers */
+    size_t serials_count; /**< Serials count */
+    MOBIRingVariant *variants[KEYRING_VARIANTS_BUCKETS]; /**< Cached book PID keys by message hash */
+    size_t variants_count; /**< Count of cached variants */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock; /**< Lock for variants cache */
+#endif
+};
+
+/**
+ @brief Free key ring variant
+ 
+ @param[in] variant Variant
+ */
+static void mobi_free_ring_variant(MOBIRingVariant *variant) {
+    free(variant->message);
+    free(variant->keys);
+    free(variant);
+}
+
+/**
+ @brief Free cached key ring variants
+ 
+ @param[in,out] ring Key ring
+ */
+static void mobi_keyring_variants_clear(MOBIKeyRing *ring) {
+    for (size_t i = 0; i < KEYRING_VARIANTS_BUCKETS; i++) {
+        MOBIRingVariant *curr = ring->variants[i];
+        while (curr) {
+            MOBIRingVariant *tmp = curr->next;
+            mobi_free_ring_variant(curr);
+            curr = tmp;
+        }
+        ring->variants[i] = NULL;
+    }
+    ring->variants_count = 0;
+}
+
+/**
+ @brief Create empty key ring
+ 
+ @return Key ring, NULL on failure
+ */
+MOBIKeyRing * mobi_keyring_new(void) {
+    MOBIKeyRing *ring = calloc(1, sizeof(MOBIKeyRing));
+    if (ring == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return NULL;
+    }
+#ifdef HAVE_PTHREAD
+    if (pthread_mutex_init(&ring->lock, NULL) != 0) {
+        debug_print("%s\n", "Mutex initialization failed");
+        free(ring);
+        return NULL;
+    }
+#endif
+    return ring;
+}
+
+/**
+ @brief Free key ring
+ 
+ @param[in] ring Key ring
+ */
+void mobi_keyring_delete(MOBIKeyRing *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    mobi_keyring_variants_clear(ring);
+    for (size_t i = 0; i < ring->serials_count; i++) {
+        free(ring->serials[i]);
+    }
+    free(ring->serials);
+    free(ring->keys);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&ring->lock);
+#endif
+    free(ring);
+}
+
+/**
+ @brief Add verified PID to key ring
+ 
+ Duplicate PIDs are skipped.
+ 
+ @param[in,out] ring Key ring
+ @param[in] pid PID
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_keyring_key_add(MOBIKeyRing *ring, const unsigned char *pid) {
+    unsigned char key[KEYSIZE];
+    MOBI_RET ret = mobi_drmpid_key(key, pid);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    const uint8_t checksum = mobi_drmkey_checksum(key);
+    size_t *last = &ring->buckets[checksum];
+    while (*last) {
+        if (memcmp(ring->keys[*last - 1].pid, pid, PIDSIZE) == 0) {
+            return MOBI_SUCCESS;
+        }
+        last = &ring->keys[*last - 1].next;
+    }
+    MOBIRingKey *keys = realloc(ring->keys, (ring->keys_count + 1) * sizeof(*ring->keys));
+    if (keys == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    ring->keys = keys;
+    MOBIRingKey *ring_key = &ring->keys[ring->keys_count];
+    memcpy(ring_key->pid, pid, PIDSIZE);
+    memcpy(ring_key->key, key, KEYSIZE);
+    ring_key->next = 0;
+    /* bucket pointer is recalculated, keys array might have moved */
+    last = &ring->buckets[checksum];
+    while (*last) {
+        last = &ring->keys[*last - 1].next;
+    }
+    *last = ++ring->keys_count;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Add PID to key ring
+ 
+ @param[in,out] ring Key ring
+ @param[in] pid PID
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_keyring_pid_add(MOBIKeyRing *ring, const char *pid) {
+    if (ring == NULL || pid == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    const size_t pid_length = strlen(pid);
+    if (pid_length != PIDSIZE) {
+        debug_print("PID size is wrong (%zu)\n", pid_length);
+        return MOBI_DRM_PIDINV;
+    }
+    MOBI_RET ret = mobi_drmpid_verify((const unsigned char *) pid);
+    if (ret != MOBI_SUCCESS) {
+        debug_print("PID is invalid%s", "\n");
+        return ret;
+    }
+    return mobi_keyring_key_add(ring, (const unsigned char *) pid);
+}
+
+/**
+ @brief Add device serial number to key ring
+ 
+ Device PID is calculated immediately, book PIDs are calculated
+ and cached when key ring is used with documents.
+ 
+ @param[in,out] ring Key ring
+ @param[in] serial Device serial number
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_keyring_serial_add(MOBIKeyRing *ring, const char *serial) {
+    if (ring == NULL || serial == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    char pid[PIDSIZE + 1];
+    MOBI_RET ret = mobi_drmpid_from_serial(pid, serial);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    debug_print("Device pid: %s\n", pid);
+    for (size_t i = 0; i < ring->serials_count; i++) {
+        if (strcmp(ring->serials[i], serial) == 0) {
+            return MOBI_SUCCESS;
+        }
+    }
+    char **serials = realloc(ring->serials, (ring->serials_count + 1) * sizeof(*ring->serials));
+    if (serials == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    ring->serials = serials;
+    const size_t serial_length = strlen(serial);
+    char *serial_copy = malloc(serial_length + 1);
+    if (serial_copy == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    memcpy(serial_copy, serial, serial_length + 1);
+    ret = mobi_keyring_key_add(ring, (unsigned char *) pid);
+    if (ret != MOBI_SUCCESS) {
+        free(serial_copy);
+        return ret;
+    }
+    ring->serials[ring->serials_count++] = serial_copy;
+    /* cached variants lack book PID of the new serial */
+    mobi_keyring_variants_clear(ring);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Calculate book PID keys for all key ring serials
+ 
+ @param[in] ring Key ring
+ @param[in] message Tamperproof message, NULL if empty, variant takes ownership
+ @param[in] message_size Message size
+ @param[in] hash Message checksum
+ @return Variant, NULL on failure
+ */
+static MOBIRingVariant * mobi_keyring_variant_new(const MOBIKeyRing *ring, unsigned char *message, const size_t message_size, const uint32_t hash) {
+    MOBIRingVariant *variant = calloc(1, sizeof(MOBIRingVariant));
+    if (variant == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        free(message);
+        return NULL;
+    }
+    variant->message = message;
+    variant->message_size = message_size;
+    variant->hash = hash;
+    variant->keys = malloc(ring->serials_count * sizeof(*variant->keys));
+    if (variant->keys == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        mobi_free_ring_variant(variant);
+        return NULL;
+    }
+    for (size_t i = 0; i < ring->serials_count; i++) {
+        char pid[PIDSIZE + 1];
+        mobi_drmpid_from_serial_message(pid, ring->serials[i], message, message_size);
+        debug_print("Book pid: %s\n", pid);
+        MOBIRingKey *ring_key = &variant->keys[variant->keys_count];
+        memcpy(ring_key->pid, pid, PIDSIZE);
+        if (mobi_drmpid_key(ring_key->key, ring_key->pid) != MOBI_SUCCESS) {
+            continue;
+        }
+        ring_key->next = 0;
+        variant->keys_count++;
+    }
+    return variant;
+}
+
+/**
+ @brief Get book PID keys of key ring serials for given document
+ 
+ Keys are looked up in cache by tamperproof message stored in EXTH records.
+ If cache is full, returned variant is not cached and must be freed by caller.
+ 
+ @param[out] variant Variant
+ @param[out] is_cached Set to false if variant must be freed by caller
+ @param[in,out] ring Key ring
+ @param[in] m MOBIData structure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_keyring_variant_get(MOBIRingVariant **variant, bool *is_cached, MOBIKeyRing *ring, const MOBIData *m) {
+    *variant = NULL;
+    *is_cached = true;
+    unsigned char *message;
+    size_t message_size;
+    MOBI_RET ret = mobi_exthdrm_message(&message, &message_size, m);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    const uint32_t hash = message_size ? (uint32_t) m_crc32(0, message, (unsigned int) message_size) : 0;
+    const size_t bucket = hash % KEYRING_VARIANTS_BUCKETS;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&ring->lock);
+#endif
+    MOBIRingVariant *curr = ring->variants[bucket];
+    while (curr) {
+        if (curr->hash == hash && curr->message_size == message_size
+            && (message_size == 0 || memcmp(curr->message, message, message_size) == 0)) {
+            break;
+        }
+        curr = curr->next;
+    }
+    if (curr == NULL) {
+        /* variants are never freed while ring is in use, new one is added under lock */
+        curr = mobi_keyring_variant_new(ring, message, message_size, hash);
+        message = NULL;
+        if (curr == NULL) {
+            ret = MOBI_MALLOC_FAILED;
+        } else if (ring->variants_count < KEYRING_VARIANTS_MAX) {
+            curr->next = ring->variants[bucket];
+            ring->variants[bucket] = curr;
+            ring->variants_count++;
+        } else {
+            *is_cached = false;
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&ring->lock);
+#endif
+    free(message);
+    *variant = curr;
+    return ret;
+}
+
+/**
+ @brief Find key ring PID key matching any of document vouchers
+ 
+ @param[out] key Main key
+ @param[out] pid PID of matching key
+ @param[in] vouchers Document vouchers
+ @param[in] vouchers_count Vouchers count
+ @param[in] keys Key ring keys
+ @param[in] keys_count Keys count
+ @param[in] buckets Index + 1 of first key with given checksum, NULL to compare checksums of all keys
+ @param[in,out] is_expired Set to true if matching voucher expired
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_keyring_match(unsigned char key[KEYSIZE], const unsigned char **pid,
+                                   MOBIVoucher **vouchers, const size_t vouchers_count,
+                                   const MOBIRingKey *keys, const size_t keys_count, const size_t *buckets, bool *is_expired) {
+    for (size_t i = 0; i < vouchers_count; i++) {
+        size_t index = buckets ? buckets[vouchers[i]->checksum] : (keys_count ? 1 : 0);
+        while (index) {
+            const MOBIRingKey *ring_key = &keys[index - 1];
+            const MOBI_RET ret = mobi_voucher_try(key, vouchers[i], ring_key->key, 1);
+            if (ret == MOBI_SUCCESS) {
+                *pid = ring_key->pid;
+                return MOBI_SUCCESS;
+            }
+            if (ret == MOBI_DRM_EXPIRED) {
+                *is_expired = true;
+            } else if (ret != MOBI_DRM_KEYNOTFOUND) {
+                return ret;
+            }
+            if (buckets) {
+                index = ring_key->next;
+            } else {
+                index = (index < keys_count) ? index + 1 : 0;
+            }
+        }
+    }
+    return MOBI_DRM_KEYNOTFOUND;
+}
+
+/**
+ @brief Find key for encryption type 2 document using key ring
+ 
+ Vouchers are first matched with device PID keys, then with book PID keys
+ derived from serials and EXTH records, finally with default key.
+ 
+ @param[out] key Main key
+ @param[out] pid PID of matching key
+ @param[out] has_pid Set to false if default key matched and pid is not set
+ @param[in,out] ring Key ring
+ @param[in] m MOBIData structure with raw data and metadata
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_drmkey_get_keyring(unsigned char key[KEYSIZE], unsigned char pid[PIDSIZE], bool *has_pid, MOBIKeyRing *ring, const MOBIData *m) {
+    *has_pid = false;
+    if (m->mh == NULL || m->mh->drm_count == NULL || *m->mh->drm_count == 0) {
+        return MOBI_DRM_KEYNOTFOUND;
+    }
+    MOBIVoucher **vouchers = malloc(*m->mh->drm_count * sizeof(*vouchers));
+    if (vouchers == NULL) {
+        debug_print("Memory allocation failed%s", "\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    const size_t vouchers_count = mobi_vouchers_get(vouchers, m);
+    bool is_expired = false;
+    const unsigned char *match = NULL;
+    MOBI_RET ret = mobi_keyring_match(key, &match, vouchers, vouchers_count,
+                                      ring->keys, ring->keys_count, ring->buckets, &is_expired);
+    if (ret == MOBI_DRM_KEYNOTFOUND && ring->serials_count && m->eh) {
+        MOBIRingVariant *variant;
+        bool is_cached;
+        ret = mobi_keyring_variant_get(&variant, &is_cached, ring, m);
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_keyring_match(key, &match, vouchers, vouchers_count,
+                                     variant->keys, variant->keys_count, NULL, &is_expired);
+            if (ret == MOBI_SUCCESS) {
+                debug_print("Cookie encrypted with book pid key%s", "\n");
+                memcpy(pid, match, PIDSIZE);
+                *has_pid = true;
+            }
+            if (!is_cached) {
+                mobi_free_ring_variant(variant);
+            }
+        }
+    } else if (ret == MOBI_SUCCESS) {
+        debug_print("Cookie encrypted with device pid key%s", "\n");
+        memcpy(pid, match, PIDSIZE);
+        *has_pid = true;
+    }
+    for (size_t i = 0; ret == MOBI_DRM_KEYNOTFOUND && i < vouchers_count; i++) {
+        ret = mobi_voucher_try(key, vouchers[i], INTERNAL_READER_KEY, 3);
+        if (ret == MOBI_SUCCESS) {
+            debug_print("Cookie encrypted with default key%s", "\n");
+        } else if (ret == MOBI_DRM_EXPIRED) {
+            is_expired = true;
+            ret = MOBI_DRM_KEYNOTFOUND;
+        }
+    }
+    mobi_free_vouchers(vouchers, vouchers_count);
+    if (ret == MOBI_DRM_KEYNOTFOUND && is_expired) {
+        ret = MOBI_DRM_EXPIRED;
+    }
+    return ret;
+}
+
+/**
+ @brief Store key for encryption in MOBIData stucture using key ring
+ 
+ In case of encrypted document key is extracted from document with first matching key ring PID.
+ In case of unencrypted document vouchers are added for all device PIDs stored in key ring.
+ 
+ @param[in,out] m MOBIData structure with raw data and metadata
+ @param[in,out] ring Key ring
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_drmkey_set_keyring(MOBIData *m, MOBIKeyRing *ring) {
+    if (m == NULL || m->rh == NULL || ring == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    MOBI_RET ret;
+    if (!mobi_is_encrypted(m)) {
+        debug_print("Document not encrypted, adding vouchers%s", "\n");
+        for (size_t i = 0; i < ring->keys_count; i++) {
+            ret = mobi_drmpid_add(m, ring->keys[i].pid);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+        }
+        return MOBI_SUCCESS;
+    }
+    if (m->rh->encryption_type == MOBI_ENCRYPTION_V1) {
+        /* PID not needed */
+        return mobi_drmkey_set(m, NULL);
+    }
+    unsigned char key[KEYSIZE];
+    unsigned char pid[PIDSIZE];
+    bool has_pid;
+    ret = mobi_drmkey_get_keyring(key, pid, &has_pid, ring, m);
+    if (ret != MOBI_SUCCESS) {
+        debug_print("Key not found%s", "\n");
+        return ret;
+    }
+    ret = mobi_drmkey_init(m, key);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    return mobi_drmpid_add(m, has_pid ? pid : NULL);
+}
+
 /**
  @brief Mark document as encrypted
  
@@ -1153,7 +1706,7 @@ static MOBI_RET mobi_drm_set(MOBIData *m, const uint16_t encryption_type) {
         }
         
         size_t drm_size = VOUCHERS_SIZE_MIN;
-        MOBIDrm *drm = m->internals;
+        MOBIDrm *drm = mobi_drm_get(m);
         if (drm->cookies_count * VOUCHERSIZE > VOUCHERS_SIZE_MIN) {
             drm_size = drm->cookies_count * VOUCHERSIZE;
         }
@@ -1193,9 +1746,170 @@ static void mobi_drm_unset(MOBIData *m) {
     mobi_drmkey_delete(m);
 }
 
+/**
+ @brief Prepare text record for decryption or encryption in place
+ 
+ Record data is made writable, size of encrypted part of the record is calculated.
+ 
+ @param[in,out] m MOBIData structure with raw data and metadata
+ @param[in,out] record Text record
+ @param[in] extra_flags Flags of trailing entries, which are not encrypted
+ @param[out] crypt_size Size of encrypted part of the record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_drm_record_prepare(MOBIData *m, MOBIPdbRecord *record, const uint16_t extra_flags, size_t *crypt_size) {
+    size_t extra_size = 0;
+    if (extra_flags) {
+        extra_size = mobi_get_record_extrasize(record, extra_flags);
+        if (extra_size == MOBI_NOTSET || extra_size >= record->size) {
+            return MOBI_DATA_CORRUPT;
+        }
+    }
+    *crypt_size = record->size - extra_size;
+    return mobi_recdata_writable(m, record);
+}
+
+/**
+ @brief Decrypt or encrypt text record in place
+ 
+ @param[in] m MOBIData structure with loaded key
+ @param[in,out] record Text record prepared with mobi_drm_record_prepare()
+ @param[in] crypt_size Size of encrypted part of the record
+ @param[in] is_decryption Should we decrypt or encrypt
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_drm_record_crypt(const MOBIData *m, MOBIPdbRecord *record, const size_t crypt_size, const bool is_decryption) {
+    if (is_decryption) {
+        return mobi_buffer_decrypt(record->data, record->data, crypt_size, m);
+    }
+    return mobi_buffer_encrypt(record->data, record->data, crypt_size, m);
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ @brief Range of text records processed by DRM worker
+ */
+typedef struct {
+    const MOBIData *m; /**< MOBIData structure with loaded key */
+    MOBIPdbRecord **records; /**< Text records, shared by all workers */
+    const size_t *sizes; /**< Sizes of encrypted part of each record */
+    size_t start; /**< First record of the range */
+    size_t end; /**< Record following the range */
+    bool is_decryption; /**< Should we decrypt or encrypt */
+    MOBI_RET ret; /**< Status of the range */
+} MOBIDrmJob;
+
+/**
+ @brief Parallel DRM worker
+ 
+ Decrypts or encrypts in place its own range of records.
+ 
+ @param[in,out] arg MOBIDrmJob structure
+ @return NULL
+ */
+static void * mobi_drm_worker(void *arg) {
+    MOBIDrmJob *job = arg;
+    job->ret = MOBI_SUCCESS;
+    for (size_t i = job->start; i < job->end && job->ret == MOBI_SUCCESS; i++) {
+        job->ret = mobi_drm_record_crypt(job->m, job->records[i], job->sizes[i], job->is_decryption);
+    }
+    return NULL;
+}
+
+/**
+ @brief Decrypt or encrypt records in parallel
+ 
+ Records are prepared sequentially, then split into disjoint ranges
+ which are decrypted or encrypted in place by worker threads.
+ 
+ @param[in,out] m MOBIData structure with raw data and metadata
+ @param[in] first First text record
+ @param[in] count Count of text records
+ @param[in] extra_flags Flags of trailing entries, which are not encrypted
+ @param[in] threads Number of worker threads
+ @param[in] is_decryption Should we decrypt or encrypt
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_drm_records_parallel(MOBIData *m, MOBIPdbRecord *first, const size_t count, const uint16_t extra_flags, size_t threads, const bool is_decryption) {
+    MOBIPdbRecord **records = malloc(count * sizeof(*records));
+    size_t *sizes = malloc(count * sizeof(*sizes));
+    MOBIDrmJob *jobs = malloc(threads * sizeof(*jobs));
+    pthread_t *workers = malloc(threads * sizeof(*workers));
+    bool *started = calloc(threads, sizeof(*started));
+    if (records == NULL || sizes == NULL || jobs == NULL || workers == NULL || started == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        free(records);
+        free(sizes);
+        free(jobs);
+        free(workers);
+        free(started);
+        return MOBI_MALLOC_FAILED;
+    }
+    /* records data is loaded and made writable here, workers only process prepared records */
+    MOBI_RET ret = MOBI_SUCCESS;
+    MOBIPdbRecord *curr = first;
+    size_t loaded = 0;
+    while (loaded < count && curr) {
+        ret = mobi_drm_record_prepare(m, curr, extra_flags, &sizes[loaded]);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        records[loaded++] = curr;
+        curr = mobi_get_record_next(m, curr);
+    }
+    if (threads > loaded) {
+        threads = loaded;
+    }
+    if (ret == MOBI_SUCCESS && loaded) {
+        const size_t range = (loaded + threads - 1) / threads;
+        size_t ranges = 0;
+        for (size_t start = 0; start < loaded; start += range) {
+            jobs[ranges].m = m;
+            jobs[ranges].records = records;
+            jobs[ranges].sizes = sizes;
+            jobs[ranges].start = start;
+            jobs[ranges].end = (loaded - start > range) ? start + range : loaded;
+            jobs[ranges].is_decryption = is_decryption;
+            jobs[ranges].ret = MOBI_SUCCESS;
+            ranges++;
+        }
+        /* calling thread processes first range and ranges of workers that failed to start */
+        for (size_t i = 1; i < ranges; i++) {
+            started[i] = (pthread_create(&workers[i], NULL, mobi_drm_worker, &jobs[i]) == 0);
+        }
+        for (size_t i = 0; i < ranges; i++) {
+            if (!started[i]) {
+                mobi_drm_worker(&jobs[i]);
+            }
+        }
+        for (size_t i = 1; i < ranges; i++) {
+            if (started[i]) {
+                pthread_join(workers[i], NULL);
+            }
+        }
+        /* report first failed range */
+        for (size_t i = 0; i < ranges; i++) {
+            if (jobs[i].ret != MOBI_SUCCESS) {
+                ret = jobs[i].ret;
+                break;
+            }
+        }
+    }
+    free(records);
+    free(sizes);
+    free(jobs);
+    free(workers);
+    free(started);
+    return ret;
+}
+#endif
+
 /**
  @brief Decrypt or encrypt records
  
+ Records are processed in place.
+ If more than one thread is set with mobi_set_threads(), records are processed in parallel.
+ 
  @param[in,out] m MOBIData structure with raw data and metadata
  @param[in] is_decryption Should we decrypt or encrypt
  @return MOBI_RET status code (on success MOBI_SUCCESS)
@@ -1225,37 +1939,25 @@ static MOBI_RET mobi_drm_records(MOBIData *m, const bool is_decryption) {
         extra_flags &= 0xfffe;
     }
     /* get first text record */
-    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, text_rec_index);
+    MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, text_rec_index);
+#ifdef HAVE_PTHREAD
+    const MOBIInternals *internals = m->internals;
+    const size_t threads = internals ? internals->threads : 0;
+    if (threads > 1 && text_rec_count > 1) {
+        return mobi_drm_records_parallel(m, curr, text_rec_count, extra_flags, threads, is_decryption);
+    }
+#endif
     
     while (text_rec_count-- && curr) {
-        size_t extra_size = 0;
-        if (extra_flags) {
-            extra_size = mobi_get_record_extrasize(curr, extra_flags);
-            if (extra_size == MOBI_NOTSET || extra_size >= curr->size) {
-                return MOBI_DATA_CORRUPT;
-            }
-        }
-        
-        size_t decrypt_size = curr->size - extra_size;;
-        unsigned char *decrypted = malloc(decrypt_size);
-        if (decrypted == NULL) {
-            debug_print("Memory allocation failed%s", "\n");
-            return MOBI_MALLOC_FAILED;
-        }
-        
-        MOBI_RET ret;
-        if (is_decryption) {
-            ret = mobi_buffer_decrypt(decrypted, curr->data, decrypt_size, m);
-        } else {
-            ret = mobi_buffer_encrypt(decrypted, curr->data, decrypt_size, m);
+        size_t crypt_size;
+        MOBI_RET ret = mobi_drm_record_prepare(m, curr, extra_flags, &crypt_size);
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_drm_record_crypt(m, curr, crypt_size, is_decryption);
         }
         if (ret != MOBI_SUCCESS) {
-            free(decrypted);
             return ret;
         }
-        memcpy(curr->data, decrypted, decrypt_size);
-        free(decrypted);
-        curr = curr->next;
+        curr = mobi_get_record_next(m, curr);
     }
     
     return MOBI_SUCCESS;
@@ -1267,6 +1969,7 @@ static MOBI_RET mobi_drm_records(MOBIData *m, const bool is_decryption) {
  It is not necessary to call this function in order to parse encrypted document.
  If pid is set document will be decrypted automatically during uncompression.
  The reason for this function is to load and resave decrypted document without parsing.
+ Records are decrypted in parallel if more than one thread is set with mobi_set_threads().
  
  @param[in,out] m MOBIData structure with raw data and metadata
  @return MOBI_RET status code (on success MOBI_SUCCESS)
@@ -1373,7 +2076,7 @@ static MOBI_RET mobi_voucher_serialize(MOBIBuffer *buf, const unsigned char *key
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
 MOBI_RET mobi_drm_serialize_v2(MOBIBuffer *buf, const MOBIData *m) {
-    if (!m || !m->mh || m->internals == NULL) {
+    if (!m || !m->mh || mobi_drm_get(m) == NULL) {
         return MOBI_INIT_FAILED;
     }
     
@@ -1381,7 +2084,7 @@ MOBI_RET mobi_drm_serialize_v2(MOBIBuffer *buf, const MOBIData *m) {
     
     mobi_buffer_setpos(buf, *m->mh->drm_offset);
     
-    MOBIDrm *drm = m->internals;
+    MOBIDrm *drm = mobi_drm_get(m);
     for (size_t i = 0; i < drm->cookies_count; i++) {
         MOBI_RET ret = mobi_voucher_serialize(buf, drm->key, drm->cookies[i]);
         if (ret != MOBI_SUCCESS) {
@@ -1427,7 +2130,7 @@ MOBI_RET mobi_drm_serialize_v1(MOBIBuffer *buf, const MOBIData *m) {
         mobi_buffer_setpos(buf, 14);
     }
     
-    MOBIDrm *drm = m->internals;
+    MOBIDrm *drm = mobi_drm_get(m);
     
     uint8_t key_type = 1; // 1 - simple, 2 - verification password, 4 - verification key
     unsigned char *key_offset = buf->data + buf->offset;
@@ -1477,7 +2180,8 @@ static MOBI_RET mobi_drm_generate_key(MOBIData *m) {
 /**
  @brief Encrypt document
  
- DRM vouchers must be added in order to use device serial number in encryption
+ DRM vouchers must be added in order to use device serial number in encryption.
+ Records are encrypted in parallel if more than one thread is set with mobi_set_threads().
  
  @param[in,out] m MOBIData structure with raw data and metadata
  @return MOBI_RET status code (on success MOBI_SUCCESS)
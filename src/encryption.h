@@ -27,19 +27,25 @@ typedef struct {
  @brief Drm data
  */
 
-typedef struct {
+typedef struct MOBIDrm {
     unsigned char *key; /**< key for decryption, NULL if not set */
     uint32_t cookies_count; /**< Cookies count */
     MOBICookie **cookies; /**< DRM cookie */
 } MOBIDrm;
 
 void mobi_free_drm(MOBIData *m);
+MOBIDrm * mobi_drm_get(const MOBIData *m);
 MOBI_RET mobi_buffer_decrypt(unsigned char *out, const unsigned char *in, const size_t length, const MOBIData *m);
 MOBI_RET mobi_drmkey_set(MOBIData *m, const char *pid);
 MOBI_RET mobi_drmkey_set_serial(MOBIData *m, const char *serial);
 MOBI_RET mobi_drmkey_delete(MOBIData *m);
 MOBI_RET mobi_voucher_add(MOBIData *m, const char *serial, const time_t valid_from, const time_t valid_to,
                           const MOBIExthTag *tamperkeys, const size_t tamperkeys_count);
+MOBIKeyRing * mobi_keyring_new(void);
+void mobi_keyring_delete(MOBIKeyRing *ring);
+MOBI_RET mobi_keyring_pid_add(MOBIKeyRing *ring, const char *pid);
+MOBI_RET mobi_keyring_serial_add(MOBIKeyRing *ring, const char *serial);
+MOBI_RET mobi_drmkey_set_keyring(MOBIData *m, MOBIKeyRing *ring);
 MOBI_RET mobi_drm_serialize_v1(MOBIBuffer *buf, const MOBIData *m);
 MOBI_RET mobi_drm_serialize_v2(MOBIBuffer *buf, const MOBIData *m);
 
@@ -327,17 +327,67 @@ size_t mobi_getstring_ordt(const MOBIOrdt *ordt, MOBIBuffer *buf, unsigned char
     return output_length;
 }
 
+/**
+ @brief Allocate memory for index entry data from index arena
+ 
+ Memory is released together with all index entries in mobi_free_index_entries()
+ 
+ @param[in,out] indx MOBIIndx structure created with mobi_init_indx(), which owns the arena
+ @param[in] size Size of requested memory
+ @return Pointer to allocated memory or NULL on failure
+ */
+static void * mobi_indx_alloc(MOBIIndx *indx, size_t size) {
+    const size_t align = sizeof(void *);
+    size = (size + align - 1) & ~(align - 1);
+    MOBIIndxPrivate *indx_private = (MOBIIndxPrivate *) indx;
+    MOBIIndxArena *block = indx_private->arena;
+    if (block && block->size - block->used >= size) {
+        void *ptr = block->data + block->used;
+        block->used += size;
+        return ptr;
+    }
+    const size_t block_size = (size > INDX_ARENA_BLOCKSIZE / 4) ? size : INDX_ARENA_BLOCKSIZE;
+    MOBIIndxArena *new_block = malloc(sizeof(MOBIIndxArena) + block_size);
+    if (new_block == NULL) {
+        debug_print("Memory allocation failed (%zu bytes)\n", block_size);
+        return NULL;
+    }
+    new_block->size = block_size;
+    new_block->used = size;
+    if (block && block_size == size) {
+        /* keep free space of current block for subsequent requests */
+        new_block->next = block->next;
+        block->next = new_block;
+    } else {
+        new_block->next = block;
+        indx_private->arena = new_block;
+    }
+    return new_block->data;
+}
+
+/**
+ @brief Parsed tag of index entry (for internal INDX parsing)
+ */
+typedef struct {
+    uint8_t tag; /**< Tag */
+    uint8_t tag_value_count; /**< Number of values per tag */
+    uint32_t value_count; /**< Number of values or MOBI_NOTSET */
+    uint32_t value_bytes; /**< Number of value bytes or MOBI_NOTSET */
+} MOBIPtagx;
+
 /**
  @brief Parser of INDX index entry
  
  @param[in,out] indx MOBIIndx structure, to be filled with parsed data
  @param[in] idxt MOBIIdxt structure with parsed IDXT index
  @param[in] tagx MOBITagx structure with parsed TAGX index
+ @param[in] ordt MOBIOrdt structure with parsed ORDT sections
+ @param[in,out] ptagx Working array of tagx->tags_count MOBIPtagx elements
  @param[in,out] buf MOBIBuffer structure with index data
  @param[in] curr_number Sequential number of an index entry for current record
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, const MOBITagx *tagx, const MOBIOrdt *ordt, MOBIBuffer *buf, const size_t curr_number) {
+static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, const MOBITagx *tagx, const MOBIOrdt *ordt, MOBIPtagx *ptagx, MOBIBuffer *buf, const size_t curr_number) {
     if (indx == NULL) {
         debug_print("%s", "INDX structure not initialized\n");
         return MOBI_INIT_FAILED;
@@ -373,7 +423,7 @@ static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, cons
             return MOBI_DATA_CORRUPT;
         }
     }
-    indx->entries[entry_number].label = malloc(label_length + 1);
+    indx->entries[entry_number].label = mobi_indx_alloc(indx, label_length + 1);
     if (indx->entries[entry_number].label == NULL) {
         debug_print("Memory allocation failed (%zu bytes)\n", label_length);
         return MOBI_MALLOC_FAILED;
@@ -386,19 +436,6 @@ static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, cons
     indx->entries[entry_number].tags_count = 0;
     indx->entries[entry_number].tags = NULL;
     if (tagx->tags_count > 0) {
-        typedef struct {
-            uint8_t tag;
-            uint8_t tag_value_count;
-            uint32_t value_count;
-            uint32_t value_bytes;
-        } MOBIPtagx;
-        MOBIPtagx *ptagx = malloc(tagx->tags_count * sizeof(MOBIPtagx));
-        if (ptagx == NULL) {
-            debug_print("Memory allocation failed (%zu bytes)\n", tagx->tags_count * sizeof(MOBIPtagx));
-            free(indx->entries[entry_number].label);
-            indx->entries[entry_number].label = NULL;
-            return MOBI_MALLOC_FAILED;
-        }
         uint32_t ptagx_count = 0;
         size_t len;
         size_t i = 0;
@@ -439,13 +476,12 @@ static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, cons
             }
             i++;
         }
-        indx->entries[entry_number].tags = malloc(tagx->tags_count * sizeof(MOBIIndexTag));
-        if (indx->entries[entry_number].tags == NULL) {
-            debug_print("Memory allocation failed (%zu bytes)\n", tagx->tags_count * sizeof(MOBIIndexTag));
-            free(indx->entries[entry_number].label);
-            indx->entries[entry_number].label = NULL;
-            free(ptagx);
-            return MOBI_MALLOC_FAILED;
+        if (ptagx_count > 0) {
+            indx->entries[entry_number].tags = mobi_indx_alloc(indx, ptagx_count * sizeof(MOBIIndexTag));
+            if (indx->entries[entry_number].tags == NULL) {
+                debug_print("Memory allocation failed (%zu bytes)\n", ptagx_count * sizeof(MOBIIndexTag));
+                return MOBI_MALLOC_FAILED;
+            }
         }
         i = 0;
         while (i < ptagx_count) {
@@ -471,17 +507,9 @@ static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, cons
             }
             if (tagvalues_count) {
                 const size_t arr_size = tagvalues_count * sizeof(*indx->entries[entry_number].tags[i].tagvalues);
-                indx->entries[entry_number].tags[i].tagvalues = malloc(arr_size);
+                indx->entries[entry_number].tags[i].tagvalues = mobi_indx_alloc(indx, arr_size);
                 if (indx->entries[entry_number].tags[i].tagvalues == NULL) {
                     debug_print("Memory allocation failed (%zu bytes)\n", arr_size);
-                    free(indx->entries[entry_number].label);
-                    indx->entries[entry_number].label = NULL;
-                    for (size_t j = 0; j < i; j++) {
-                        free(indx->entries[entry_number].tags[j].tagvalues);
-                    }
-                    free(indx->entries[entry_number].tags);
-                    indx->entries[entry_number].tags = NULL;
-                    free(ptagx);
                     return MOBI_MALLOC_FAILED;
                 }
                 memcpy(indx->entries[entry_number].tags[i].tagvalues, tagvalues, arr_size);
@@ -493,7 +521,6 @@ static MOBI_RET mobi_parse_index_entry(MOBIIndx *indx, const MOBIIdxt idxt, cons
             indx->entries[entry_number].tags_count++;
             i++;
         }
-        free(ptagx);
     }
     /* restore buffer maxlen */
     buf->maxlen = buf_maxlen;
@@ -677,17 +704,29 @@ MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBIT
                     return MOBI_MALLOC_FAILED;
                 }
             }
+            MOBIPtagx *ptagx = NULL;
+            if (tagx->tags_count > 0) {
+                ptagx = malloc(tagx->tags_count * sizeof(MOBIPtagx));
+                if (ptagx == NULL) {
+                    mobi_buffer_free_null(buf);
+                    free(offsets);
+                    debug_print("%s\n", "Memory allocation failed");
+                    return MOBI_MALLOC_FAILED;
+                }
+            }
             size_t i = 0;
             while (i < entries_count) {
-                ret = mobi_parse_index_entry(indx, idxt, tagx, ordt, buf, i);
+                ret = mobi_parse_index_entry(indx, idxt, tagx, ordt, ptagx, buf, i);
                 if (ret != MOBI_SUCCESS) {
                     indx->entries_count += i;
                     mobi_buffer_free_null(buf);
                     free(offsets);
+                    free(ptagx);
                     return ret;
                 }
                 i++;
             }
+            free(ptagx);
             indx->entries_count += entries_count;
         }
         free(offsets);
@@ -734,7 +773,7 @@ MOBI_RET mobi_parse_index(const MOBIData *m, MOBIIndx *indx, const size_t indx_r
     size_t count = indx->entries_count;
     indx->entries_count = 0;
     while (count--) {
-        record = record->next;
+        record = mobi_get_record_next(m, record);
         ret = mobi_parse_indx(record, indx, tagx, ordt);
         if (ret != MOBI_SUCCESS) {
             mobi_free_indx(indx);
@@ -752,7 +791,7 @@ MOBI_RET mobi_parse_index(const MOBIData *m, MOBIIndx *indx, const size_t indx_r
     }
     /* copy pointer to first cncx record if present and set info from first record */
     if (indx->cncx_records_count) {
-        indx->cncx_record = record->next;
+        indx->cncx_record = mobi_get_record_next(m, record);
     }
     mobi_free_tagx(tagx);
     mobi_free_ordt(ordt);
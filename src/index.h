@@ -113,6 +113,32 @@ typedef struct {
     size_t offsets_count; /**< Offsets count */
 } MOBIOrdt;
 
+#define INDX_ARENA_BLOCKSIZE 0x10000 /**< Size of index arena block */
+
+/**
+ @brief Block of memory holding index entries labels and tags (for internal INDX parsing)
+ 
+ Blocks are chained, data is allocated by bumping the used counter.
+ All blocks are freed at once together with index entries.
+ */
+typedef struct MOBIIndxArena {
+    struct MOBIIndxArena *next; /**< Next block */
+    size_t size; /**< Size of data */
+    size_t used; /**< Used bytes of data */
+    unsigned char data[]; /**< Block data */
+} MOBIIndxArena;
+
+/**
+ @brief Index with its arena (for internal INDX parsing)
+ 
+ Allocated by mobi_init_indx() in place of MOBIIndx,
+ so that public MOBIIndx structure keeps its layout.
+ */
+typedef struct {
+    MOBIIndx indx; /**< Public index structure, must be the first member */
+    MOBIIndxArena *arena; /**< Blocks of entries labels and tags */
+} MOBIIndxPrivate;
+
 MOBI_RET mobi_parse_index(const MOBIData *m, MOBIIndx *indx, const size_t indx_record_number);
 MOBI_RET mobi_parse_indx(const MOBIPdbRecord *indx_record, MOBIIndx *indx, MOBITagx *tagx, MOBIOrdt *ordt);
 MOBI_RET mobi_get_indxentry_tagvalue(uint32_t *tagvalue, const MOBIIndexEntry *entry, const unsigned tag_arr[]);
@@ -10,9 +10,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 #include "debug.h"
 #include "util.h"
+#ifdef USE_ENCRYPTION
+#include "encryption.h"
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
 
 /**
  @brief Initializer for MOBIData structure
@@ -127,11 +134,17 @@ void mobi_free_rec(MOBIData *m) {
     while (curr != NULL) {
         tmp = curr;
         curr = curr->next;
-        free(tmp->data);
-        free(tmp);
+        mobi_free_record(m, tmp);
         tmp = NULL;
     }
     m->rec = NULL;
+    MOBIInternals *internals = m->internals;
+    if (internals) {
+        free(internals->records_block);
+        internals->records_block = NULL;
+        internals->records_block_count = 0;
+    }
+    mobi_free_recdir(m);
 }
 
 /**
@@ -189,6 +202,335 @@ void mobi_free(MOBIData *m) {
     m = NULL;
 }
 
+/**
+ @brief Get internals structure attached to MOBIData, initialize if not set
+ 
+ In case of hybrid file structure is shared by both parts.
+ 
+ @param[in,out] m MOBIData structure
+ @return MOBIInternals on success, NULL otherwise
+ */
+MOBIInternals * mobi_init_internals(MOBIData *m) {
+    if (m == NULL) {
+        return NULL;
+    }
+    if (m->internals == NULL) {
+        MOBIInternals *internals = calloc(1, sizeof(MOBIInternals));
+        if (internals == NULL) {
+            debug_print("%s", "Memory allocation for internals structure failed\n");
+            return NULL;
+        }
+#ifdef HAVE_PTHREAD
+        if (pthread_mutex_init(&internals->lock, NULL) != 0) {
+            debug_print("%s", "Initialization of internals lock failed\n");
+            free(internals);
+            return NULL;
+        }
+#endif
+        m->internals = internals;
+        if (m->next) {
+            m->next->internals = m->internals;
+        }
+    }
+    return m->internals;
+}
+
+/**
+ @brief Free internals
+ 
+ Releases DRM data, unmaps file image if it was mapped
+ and closes reader of records loaded on demand
+ 
+ @param[in,out] m MOBIData structure with raw data and metadata
+ */
+void mobi_free_internals(MOBIData *m) {
+    MOBIInternals *internals = m->internals;
+    if (internals == NULL) {
+        return;
+    }
+#ifdef USE_ENCRYPTION
+    mobi_free_drm(m);
+#endif
+    if (internals->image && internals->image_mapped) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+        munmap((void *) internals->image, internals->image_size);
+#endif
+    }
+    if (internals->source) {
+        if (internals->source->close) {
+            internals->source->close(internals->source->handle);
+        }
+        free(internals->source);
+    }
+    mobi_free_recdir(m);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&internals->lock);
+#endif
+    free(internals);
+    m->internals = NULL;
+    if (m->next) {
+        m->next->internals = NULL;
+    }
+}
+
+/**
+ @brief Check whether record data points into shared file image
+ 
+ Such data is not owned by the record and must not be freed or modified.
+ 
+ @param[in] m MOBIData structure
+ @param[in] rec Record
+ @return True if data is shared, false otherwise
+ */
+bool mobi_recdata_is_shared(const MOBIData *m, const MOBIPdbRecord *rec) {
+    if (m == NULL || rec == NULL || rec->data == NULL) {
+        return false;
+    }
+    const MOBIInternals *internals = m->internals;
+    if (internals == NULL || internals->image == NULL) {
+        return false;
+    }
+    return rec->data >= internals->image && rec->data < internals->image + internals->image_size;
+}
+
+/**
+ @brief Make record data writable
+ 
+ If data points into shared file image, it is copied to a private buffer.
+ 
+ @param[in] m MOBIData structure
+ @param[in,out] rec Record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_recdata_writable(const MOBIData *m, MOBIPdbRecord *rec) {
+    if (!mobi_recdata_is_shared(m, rec)) {
+        return MOBI_SUCCESS;
+    }
+    unsigned char *data = malloc(rec->size > 0 ? rec->size : 1);
+    if (data == NULL) {
+        debug_print("%s", "Memory allocation for record data failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    memcpy(data, rec->data, rec->size);
+    rec->data = data;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free record data unless it points into shared file image
+ 
+ @param[in] m MOBIData structure
+ @param[in,out] rec Record
+ */
+void mobi_free_recdata(const MOBIData *m, MOBIPdbRecord *rec) {
+    if (rec == NULL) {
+        return;
+    }
+    if (!mobi_recdata_is_shared(m, rec)) {
+        free(rec->data);
+    }
+    rec->data = NULL;
+}
+
+/**
+ @brief Free record and its data
+ 
+ Records allocated by loader in a contiguous block are released together with the block
+ in mobi_free_rec(), only their data is freed here.
+ 
+ @param[in] m MOBIData structure
+ @param[in,out] rec Record
+ */
+void mobi_free_record(const MOBIData *m, MOBIPdbRecord *rec) {
+    if (rec == NULL) {
+        return;
+    }
+    mobi_free_recdata(m, rec);
+    const MOBIInternals *internals = m ? m->internals : NULL;
+    if (internals && internals->records_block
+        && rec >= internals->records_block
+        && rec < internals->records_block + internals->records_block_count) {
+        return;
+    }
+    free(rec);
+}
+
+/**
+ @brief Hash record uid into records directory uids table
+ 
+ @param[in] uid Record uid
+ @param[in] size Table size (power of 2)
+ @return Start slot
+ */
+size_t mobi_recdir_hash(const size_t uid, const size_t size) {
+    return (size_t) (((uint32_t) uid * 2654435761U) & (size - 1));
+}
+
+/**
+ @brief Fill empty uids hash table with indices of directory records
+ 
+ @param[in,out] internals MOBIInternals structure with records array
+ */
+static void mobi_fill_recdir_uids(MOBIInternals *internals) {
+    const size_t mask = internals->uids_size - 1;
+    for (size_t i = 0; i < internals->records_count; i++) {
+        const size_t uid = internals->records[i]->uid;
+        size_t slot = mobi_recdir_hash(uid, internals->uids_size);
+        while (internals->uids[slot] && internals->records[internals->uids[slot] - 1]->uid != uid) {
+            slot = (slot + 1) & mask;
+        }
+        /* in case of duplicate uids keep the first record */
+        if (internals->uids[slot] == 0) {
+            internals->uids[slot] = (uint32_t) i + 1;
+        }
+    }
+}
+
+/**
+ @brief Build records directory for fast records lookup
+ 
+ Directory holds array of records pointers indexed by sequential number
+ and hash table of records uids. It must be rebuilt whenever records list changes.
+ If MOBIData internals are not initialized, or on failure,
+ directory is not built and records lookups fall back to walking the list.
+ 
+ @param[in] m MOBIData structure with loaded records list
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_init_recdir(const MOBIData *m) {
+    MOBIInternals *internals = m->internals;
+    if (internals == NULL) {
+        return MOBI_SUCCESS;
+    }
+    mobi_free_recdir(m);
+    size_t count = 0;
+    const MOBIPdbRecord *curr = m->rec;
+    while (curr) {
+        count++;
+        curr = curr->next;
+    }
+    if (count == 0 || count >= UINT32_MAX) {
+        return MOBI_SUCCESS;
+    }
+    size_t uids_size = 16;
+    while (uids_size < 2 * count) {
+        uids_size <<= 1;
+    }
+    internals->records = malloc(count * sizeof(*internals->records));
+    internals->uids = calloc(uids_size, sizeof(*internals->uids));
+    if (internals->records == NULL || internals->uids == NULL) {
+        debug_print("%s", "Memory allocation for records directory failed\n");
+        mobi_free_recdir(m);
+        return MOBI_MALLOC_FAILED;
+    }
+    internals->records_count = count;
+    internals->uids_size = uids_size;
+    size_t i = 0;
+    curr = m->rec;
+    while (curr) {
+        internals->records[i++] = (MOBIPdbRecord *) curr;
+        curr = curr->next;
+    }
+    mobi_fill_recdir_uids(internals);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Rebuild uids hash table of records directory
+ 
+ To be used when records uids were changed, but records list was not.
+ Existing table is reused, so rebuilding can not fail.
+ If directory is not built, nothing is done.
+ 
+ @param[in] m MOBIData structure with loaded records list
+ */
+void mobi_rebuild_recdir_uids(const MOBIData *m) {
+    MOBIInternals *internals = m->internals;
+    if (internals == NULL || internals->uids == NULL) {
+        return;
+    }
+    memset(internals->uids, 0, internals->uids_size * sizeof(*internals->uids));
+    mobi_fill_recdir_uids(internals);
+}
+
+/**
+ @brief Free records directory
+ 
+ Text data cached in internals depends on records list, it is freed too.
+ 
+ @param[in] m MOBIData structure
+ */
+void mobi_free_recdir(const MOBIData *m) {
+    MOBIInternals *internals = m->internals;
+    if (internals == NULL) {
+        return;
+    }
+    free(internals->records);
+    internals->records = NULL;
+    internals->records_count = 0;
+    free(internals->uids);
+    internals->uids = NULL;
+    internals->uids_size = 0;
+    mobi_free_textcache(m);
+}
+
+/**
+ @brief Free text data cached in internals
+ 
+ Frees text records offsets map and parsed huff/cdic tables.
+ 
+ @param[in] m MOBIData structure
+ */
+void mobi_free_textcache(const MOBIData *m) {
+    MOBIInternals *internals = m->internals;
+    if (internals == NULL) {
+        return;
+    }
+    free(internals->text_offsets);
+    internals->text_offsets = NULL;
+    internals->text_offsets_count = 0;
+    for (size_t i = 0; i < MOBI_HUFFCDIC_CACHE_SIZE; i++) {
+        mobi_free_huffcdic(internals->huffcdic[i]);
+        internals->huffcdic[i] = NULL;
+        internals->huffcdic_record[i] = 0;
+    }
+}
+
+/**
+ @brief Lock text data cached in internals
+ 
+ Offsets map and huff/cdic tables slots may be accessed by concurrent
+ readers of the same document only while holding the lock.
+ 
+ @param[in] m MOBIData structure
+ */
+void mobi_lock_textcache(const MOBIData *m) {
+#ifdef HAVE_PTHREAD
+    MOBIInternals *internals = m->internals;
+    if (internals) {
+        pthread_mutex_lock(&internals->lock);
+    }
+#else
+    UNUSED(m);
+#endif
+}
+
+/**
+ @brief Unlock text data cached in internals
+ 
+ @param[in] m MOBIData structure
+ */
+void mobi_unlock_textcache(const MOBIData *m) {
+#ifdef HAVE_PTHREAD
+    MOBIInternals *internals = m->internals;
+    if (internals) {
+        pthread_mutex_unlock(&internals->lock);
+    }
+#else
+    UNUSED(m);
+#endif
+}
+
 /**
  @brief Initialize and return MOBIHuffCdic structure.
  
@@ -219,10 +561,32 @@ void mobi_free_huffcdic(MOBIHuffCdic *huffcdic) {
     }
     free(huffcdic->symbol_offsets);
     free(huffcdic->symbols);
+    mobi_free_huffcdic_cache(huffcdic);
     free(huffcdic);
     huffcdic = NULL;
 }
 
+/**
+ @brief Free cache of decompressed symbols in MOBIHuffCdic structure
+ 
+ Structure may be reused, cache will be rebuilt on demand.
+ 
+ @param[in,out] huffcdic MOBIHuffCdic structure
+ */
+void mobi_free_huffcdic_cache(MOBIHuffCdic *huffcdic) {
+    if (huffcdic == NULL) {
+        return;
+    }
+    free(huffcdic->cache_offsets);
+    free(huffcdic->cache_lengths);
+    free(huffcdic->cache_data);
+    huffcdic->cache_offsets = NULL;
+    huffcdic->cache_lengths = NULL;
+    huffcdic->cache_data = NULL;
+    huffcdic->cache_size = 0;
+    huffcdic->cache_maxlen = 0;
+}
+
 /**
  @brief Initialize and return MOBIRawml structure.
  
@@ -274,16 +638,20 @@ void mobi_free_fdst(MOBIFdst *fdst) {
  @brief Initialize and return MOBIIndx structure.
  
  MOBIIndx structure holds INDX index record entries.
+ It is the first member of MOBIIndxPrivate structure, which also holds
+ memory arena of the entries.
  Must be freed with mobi_free_indx()
  
  @return MOBIIndx on success, NULL otherwise
  */
 MOBIIndx * mobi_init_indx(void) {
-    MOBIIndx *indx = calloc(1, sizeof(MOBIIndx));
-    if (indx == NULL) {
+    MOBIIndxPrivate *indx_private = calloc(1, sizeof(MOBIIndxPrivate));
+    if (indx_private == NULL) {
         debug_print("%s", "Memory allocation failed for indx structure\n");
         return NULL;
     }
+    indx_private->arena = NULL;
+    MOBIIndx *indx = &indx_private->indx;
     indx->entries = NULL;
     indx->cncx_record = NULL;
     indx->orth_index_name = NULL;
@@ -296,21 +664,17 @@ MOBIIndx * mobi_init_indx(void) {
  @param[in] indx MOBIIndx structure that holds indx->entries
  */
 void mobi_free_index_entries(MOBIIndx *indx) {
-    if (indx == NULL || indx->entries == NULL) {
+    if (indx == NULL) {
         return;
     }
-    size_t i = 0;
-    while (i < indx->entries_count) {
-        free(indx->entries[i].label);
-        if (indx->entries[i].tags != NULL) {
-            size_t j = 0;
-            while (j < indx->entries[i].tags_count) {
-                free(indx->entries[i].tags[j++].tagvalues);
-            }
-            free(indx->entries[i].tags);
-        }
-        i++;
+    MOBIIndxPrivate *indx_private = (MOBIIndxPrivate *) indx;
+    MOBIIndxArena *block = indx_private->arena;
+    while (block) {
+        MOBIIndxArena *next = block->next;
+        free(block);
+        block = next;
     }
+    indx_private->arena = NULL;
     free(indx->entries);
     indx->entries = NULL;
 }
@@ -328,6 +692,7 @@ void mobi_free_indx(MOBIIndx *indx) {
     if (indx->orth_index_name) {
         free(indx->orth_index_name);
     }
+    /* frees enclosing MOBIIndxPrivate structure */
     free(indx);
     indx = NULL;
 }
@@ -15,6 +15,54 @@
 #include "index.h"
 #include "compression.h"
 #include "mobi.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define MOBI_HUFFCDIC_CACHE_SIZE 2 /**< Number of cached huff/cdic tables, one for each part of hybrid file */
+
+/**
+ @brief Library internal data attached to MOBIData structure
+ 
+ In case of hybrid file both parts share the same structure.
+ */
+typedef struct {
+    struct MOBIDrm *drm; /**< DRM data, NULL if not set */
+    const unsigned char *image; /**< File image that records data may point to, NULL if records own their data */
+    size_t image_size; /**< Size of the file image */
+    bool image_mapped; /**< True if file image is a memory mapping that must be unmapped */
+    MOBIReader *source; /**< Reader for records loaded on demand, NULL if all records are loaded */
+    MOBIPdbRecord *records_block; /**< Contiguous block of records list nodes allocated by loader, NULL if not allocated */
+    size_t records_block_count; /**< Count of nodes in records block */
+    MOBIPdbRecord **records; /**< Records directory indexed by sequential number, NULL if not built */
+    size_t records_count; /**< Count of records in directory */
+    uint32_t *uids; /**< Hash table mapping record uid to its sequential number plus one, zero for empty slot */
+    size_t uids_size; /**< Size of uids hash table (power of 2) */
+    size_t threads; /**< Number of worker threads for text decompression and DRM, 0 or 1 for sequential processing */
+    size_t *text_offsets; /**< Rawml offsets of text records (count plus one entries, last is rawml length), NULL if not built */
+    size_t text_offsets_count; /**< Count of text records in offsets map */
+    size_t text_offsets_record; /**< Sequential number of first text record in offsets map */
+    bool text_offsets_exact; /**< True if offsets map was built from decompressed records sizes, false if from declared record size */
+    MOBIHuffCdic *huffcdic[MOBI_HUFFCDIC_CACHE_SIZE]; /**< Parsed huff/cdic tables used for text decompression, one slot for each part of hybrid file, NULL if not parsed */
+    size_t huffcdic_record[MOBI_HUFFCDIC_CACHE_SIZE]; /**< Sequential number of HUFF record of parsed tables in each slot */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock; /**< Lock for text data cache: offsets map and huff/cdic tables slots */
+#endif
+} MOBIInternals;
+
+MOBIInternals * mobi_init_internals(MOBIData *m);
+void mobi_free_internals(MOBIData *m);
+bool mobi_recdata_is_shared(const MOBIData *m, const MOBIPdbRecord *rec);
+MOBI_RET mobi_recdata_writable(const MOBIData *m, MOBIPdbRecord *rec);
+void mobi_free_recdata(const MOBIData *m, MOBIPdbRecord *rec);
+void mobi_free_record(const MOBIData *m, MOBIPdbRecord *rec);
+MOBI_RET mobi_init_recdir(const MOBIData *m);
+void mobi_rebuild_recdir_uids(const MOBIData *m);
+size_t mobi_recdir_hash(const size_t uid, const size_t size);
+void mobi_free_recdir(const MOBIData *m);
+void mobi_free_textcache(const MOBIData *m);
+void mobi_lock_textcache(const MOBIData *m);
+void mobi_unlock_textcache(const MOBIData *m);
 
 void mobi_free_mh(MOBIMobiHeader *mh);
 void mobi_free_rec(MOBIData *m);
@@ -23,6 +71,7 @@ void mobi_free_next(MOBIData *m);
 
 MOBIHuffCdic * mobi_init_huffcdic(void);
 void mobi_free_huffcdic(MOBIHuffCdic *huffcdic);
+void mobi_free_huffcdic_cache(MOBIHuffCdic *huffcdic);
 
 MOBIIndx * mobi_init_indx(void);
 void mobi_free_indx(MOBIIndx *indx);
@@ -217,6 +217,29 @@ extern "C"
         MOBI_UTF8 = 65001, /**< utf-8 encoding */
         MOBI_UTF16 = 65002, /**< utf-16 encoding */
     } MOBIEncoding;
+    
+    /**
+     @brief Flags for loading document from memory buffer
+     */
+    typedef enum {
+        MOBI_LOAD_COPY = 0, /**< Records data is copied from the buffer */
+        MOBI_LOAD_BORROW = 1, /**< Records data points into the buffer, which must stay valid until mobi_free() */
+        MOBI_LOAD_LAZY = 2, /**< Records data is read on first access, reader must stay valid until mobi_free() */
+        MOBI_LOAD_PROBE = 4, /**< Only records 0 data is read, other records data is not available */
+        MOBI_LOAD_PART = 8 /**< Only records of hybrid file part selected by use_kf8 are read (with shared resources) */
+    } MOBILoadFlags;
+    
+    /**
+     @brief Reader interface for loading document from custom source
+     */
+    typedef struct {
+        void *handle; /**< Source handle passed to callbacks */
+        size_t (*read)(void *handle, unsigned char *buffer, size_t length); /**< Read at current position, returns number of bytes read */
+        size_t (*pread)(void *handle, unsigned char *buffer, size_t length, size_t offset); /**< Read at given offset, returns number of bytes read, NULL for sequential source */
+        size_t (*size)(void *handle); /**< Returns source size, MOBI_NOTSET if unknown, may be NULL */
+        void (*close)(void *handle); /**< Optional, releases source when MOBIData keeping the reader is freed, NULL if not needed */
+        const unsigned char *data; /**< Optional, whole source contiguous data, NULL if not available */
+    } MOBIReader;
 
     /** @} */
     
@@ -475,6 +498,28 @@ extern "C"
         MOBIPart *resources; /**< Linked list of reconstructed resources files or NULL if not present */
     } MOBIRawml;
 
+    /**
+     @brief Iterator over decompressed text records, opaque structure
+     
+     Created with mobi_init_rawml_iter(), must be freed with mobi_free_rawml_iter().
+     */
+    typedef struct MOBIRawmlIter MOBIRawmlIter;
+
+    /**
+     @brief View of rawml text stored inside text record, returned by mobi_get_rawml_views()
+     */
+    typedef struct {
+        const unsigned char *data; /**< Pointer to text data inside record, not null terminated */
+        size_t size; /**< Size of text data */
+    } MOBIRawmlView;
+
+    /**
+     @brief Device key ring for decryption of many documents, opaque structure
+     
+     Created with mobi_init_keyring(), must be freed with mobi_free_keyring().
+     */
+    typedef struct MOBIKeyRing MOBIKeyRing;
+
     /** @} */ // end of parsed_structs group
     
     /** 
@@ -483,7 +528,15 @@ extern "C"
      */
     MOBI_EXPORT const char * mobi_version(void);
     MOBI_EXPORT MOBI_RET mobi_load_file(MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_load_file_part(MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_load_stream(MOBIData *m, FILE *file);
     MOBI_EXPORT MOBI_RET mobi_load_filename(MOBIData *m, const char *path);
+    MOBI_EXPORT MOBI_RET mobi_load_filename_mmap(MOBIData *m, const char *path);
+    MOBI_EXPORT MOBI_RET mobi_load_filename_lazy(MOBIData *m, const char *path);
+    MOBI_EXPORT MOBI_RET mobi_load_reader(MOBIData *m, const MOBIReader *reader, const MOBILoadFlags flags);
+    MOBI_EXPORT MOBI_RET mobi_probe(MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_probe_filename(MOBIData *m, const char *path);
+    MOBI_EXPORT MOBI_RET mobi_load_buffer(MOBIData *m, const unsigned char *data, const size_t size, const MOBILoadFlags flags);
     
     MOBI_EXPORT MOBIData * mobi_init(void);
     MOBI_EXPORT void mobi_free(MOBIData *m);
@@ -496,6 +549,15 @@ extern "C"
 
     MOBI_EXPORT MOBI_RET mobi_get_rawml(const MOBIData *m, char *text, size_t *len);
     MOBI_EXPORT MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_set_threads(MOBIData *m, const size_t threads);
+    MOBI_EXPORT MOBI_RET mobi_get_text_record(const MOBIData *m, const size_t number, char *out, size_t *len);
+    MOBI_EXPORT MOBI_RET mobi_get_text_record_number(const MOBIData *m, const size_t offset, size_t *number, size_t *start);
+    MOBI_EXPORT MOBI_RET mobi_get_rawml_range(const MOBIData *m, const size_t start, const size_t end, char *out);
+    MOBI_EXPORT MOBIRawmlIter * mobi_init_rawml_iter(const MOBIData *m);
+    MOBI_EXPORT MOBI_RET mobi_rawml_iter_next(MOBIRawmlIter *it, const char **data, size_t *len);
+    MOBI_EXPORT void mobi_free_rawml_iter(MOBIRawmlIter *it);
+    MOBI_EXPORT MOBI_RET mobi_get_rawml_views(const MOBIData *m, MOBIRawmlView **views, size_t *count);
+    MOBI_EXPORT void mobi_free_rawml_views(MOBIRawmlView *views);
     MOBI_EXPORT MOBI_RET mobi_decode_font_resource(unsigned char **decoded_font, size_t *decoded_size, MOBIPart *part);
     MOBI_EXPORT MOBI_RET mobi_decode_audio_resource(unsigned char **decoded_resource, size_t *decoded_size, MOBIPart *part);
     MOBI_EXPORT MOBI_RET mobi_decode_video_resource(unsigned char **decoded_resource, size_t *decoded_size, MOBIPart *part);
@@ -609,7 +671,12 @@ extern "C"
     MOBI_EXPORT MOBI_RET mobi_drm_setkey_serial(MOBIData *m, const char *serial);
     MOBI_EXPORT MOBI_RET mobi_drm_addvoucher(MOBIData *m, const char *serial, const time_t valid_from, const time_t valid_to,
                                              const MOBIExthTag *tamperkeys, const size_t tamperkeys_count);
+    MOBI_EXPORT MOBI_RET mobi_drm_setkey_keyring(MOBIData *m, MOBIKeyRing *ring);
     MOBI_EXPORT MOBI_RET mobi_drm_delkey(MOBIData *m);
+    MOBI_EXPORT MOBIKeyRing * mobi_init_keyring(void);
+    MOBI_EXPORT MOBI_RET mobi_keyring_addpid(MOBIKeyRing *ring, const char *pid);
+    MOBI_EXPORT MOBI_RET mobi_keyring_addserial(MOBIKeyRing *ring, const char *serial);
+    MOBI_EXPORT void mobi_free_keyring(MOBIKeyRing *ring);
     MOBI_EXPORT MOBI_RET mobi_drm_decrypt(MOBIData *m);
     MOBI_EXPORT MOBI_RET mobi_drm_encrypt(MOBIData *m);
 
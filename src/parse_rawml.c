@@ -585,7 +585,7 @@ MOBI_RET mobi_reconstruct_resources(const MOBIData *m, MOBIRawml *rawml) {
     while (curr_record != NULL) {
         const MOBIFiletype filetype = mobi_determine_resource_type(curr_record);
         if (filetype == T_UNKNOWN) {
-            curr_record = curr_record->next;
+            curr_record = mobi_get_record_next(m, curr_record);
             i++;
             continue;
         }
@@ -623,7 +623,7 @@ MOBI_RET mobi_reconstruct_resources(const MOBIData *m, MOBIRawml *rawml) {
             curr_part->type = filetype;
         }
         
-        curr_record = curr_record->next;
+        curr_record = mobi_get_record_next(m, curr_record);
         
         if (ret != MOBI_SUCCESS) {
             free(curr_part);
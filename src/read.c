@@ -13,80 +13,248 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "read.h"
 #include "util.h"
 #include "index.h"
 #include "debug.h"
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
-size_t mread(void* buffer, int block_size, long length, MEMORY_FILE* file)
-{
-    long size = length;
-    if (size + file->current_file_position > file->file_length)
-    {
+/**
+ @brief Read callback of memory reader
+ 
+ @param[in,out] handle MEMORY_FILE handle
+ @param[out] buffer Output buffer
+ @param[in] length Number of bytes to read
+ @return Number of bytes read
+ */
+static size_t mobi_memory_read(void *handle, unsigned char *buffer, const size_t length) {
+    MEMORY_FILE *file = handle;
+    if (file->current_file_position >= file->file_length) {
+        return 0;
+    }
+    size_t size = length;
+    if (size > file->file_length - file->current_file_position) {
         size = file->file_length - file->current_file_position;
     }
-    memcpy(buffer, &file->file_buffer[file->current_file_position], size);
+    memcpy(buffer, file->file_buffer + file->current_file_position, size);
     file->current_file_position += size;
     return size;
 }
 
-int mseek(MEMORY_FILE* _Stream, long _Offset, int _Origin)
-{
-    if (_Origin == SEEK_SET)
-    {
-        if ((_Offset >= 0) && (_Offset <= _Stream->file_length))
-        {
-            _Stream->current_file_position = _Offset;
-            return 0;
-        }
+/**
+ @brief Positioned read callback of memory reader
+ 
+ @param[in] handle MEMORY_FILE handle
+ @param[out] buffer Output buffer
+ @param[in] length Number of bytes to read
+ @param[in] offset Offset to read from
+ @return Number of bytes read
+ */
+static size_t mobi_memory_pread(void *handle, unsigned char *buffer, const size_t length, const size_t offset) {
+    const MEMORY_FILE *file = handle;
+    if (offset >= file->file_length) {
+        return 0;
+    }
+    size_t size = length;
+    if (size > file->file_length - offset) {
+        size = file->file_length - offset;
     }
-    else if (_Origin == SEEK_CUR)
-    {
-        if ((_Offset+_Stream->current_file_position >= 0) && (_Offset + _Stream->current_file_position <= _Stream->file_length))
-        {
-            _Stream->current_file_position = _Offset+_Stream->current_file_position;
+    memcpy(buffer, file->file_buffer + offset, size);
+    return size;
+}
+
+/**
+ @brief Size callback of memory reader
+ 
+ @param[in] handle MEMORY_FILE handle
+ @return Buffer size
+ */
+static size_t mobi_memory_size(void *handle) {
+    const MEMORY_FILE *file = handle;
+    return file->file_length;
+}
+
+/**
+ @brief Initialize reader for memory buffer
+ 
+ @param[out] reader Reader to be initialized
+ @param[in,out] file MEMORY_FILE handle with buffer data, must outlive the reader
+ */
+void mobi_reader_init_memory(MOBIReader *reader, MEMORY_FILE *file) {
+    memset(reader, 0, sizeof(MOBIReader));
+    reader->handle = file;
+    reader->read = mobi_memory_read;
+    reader->pread = mobi_memory_pread;
+    reader->size = mobi_memory_size;
+    reader->data = file->file_buffer;
+}
+
+/**
+ @brief Read callback of file reader
+ 
+ @param[in,out] handle FILE handle
+ @param[out] buffer Output buffer
+ @param[in] length Number of bytes to read
+ @return Number of bytes read
+ */
+static size_t mobi_file_read(void *handle, unsigned char *buffer, const size_t length) {
+    return fread(buffer, 1, length, (FILE *) handle);
+}
+
+/**
+ @brief Positioned read callback of file reader
+ 
+ @param[in,out] handle FILE handle
+ @param[out] buffer Output buffer
+ @param[in] length Number of bytes to read
+ @param[in] offset Offset to read from
+ @return Number of bytes read
+ */
+static size_t mobi_file_pread(void *handle, unsigned char *buffer, const size_t length, const size_t offset) {
+    FILE *file = handle;
+    if (offset > LONG_MAX || fseek(file, (long) offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return fread(buffer, 1, length, file);
+}
+
+/**
+ @brief Size callback of file reader
+ 
+ @param[in,out] handle FILE handle
+ @return File size, MOBI_NOTSET if unknown
+ */
+static size_t mobi_file_size(void *handle) {
+    FILE *file = handle;
+    const long position = ftell(file);
+    if (position < 0 || fseek(file, 0, SEEK_END) != 0) {
+        return MOBI_NOTSET;
+    }
+    const long size = ftell(file);
+    fseek(file, position, SEEK_SET);
+    if (size < 0) {
+        return MOBI_NOTSET;
+    }
+    return (size_t) size;
+}
+
+/**
+ @brief Close callback of file reader
+ 
+ @param[in,out] handle FILE handle
+ */
+static void mobi_file_close(void *handle) {
+    fclose((FILE *) handle);
+}
+
+/**
+ @brief Initialize reader for file
+ 
+ @param[out] reader Reader to be initialized
+ @param[in] file File descriptor
+ @param[in] owned If true file will be closed with reader
+ */
+void mobi_reader_init_file(MOBIReader *reader, FILE *file, const bool owned) {
+    memset(reader, 0, sizeof(MOBIReader));
+    reader->handle = file;
+    reader->read = mobi_file_read;
+    reader->pread = mobi_file_pread;
+    reader->size = mobi_file_size;
+    if (owned) {
+        reader->close = mobi_file_close;
+    }
+}
+
+/**
+ @brief Forward only stream handle wrapping sequential reader
+ */
+typedef struct {
+    const MOBIReader *reader; /**< Sequential reader */
+    size_t position; /**< Number of bytes consumed from reader */
+} MOBIStream;
+
+/**
+ @brief Positioned read callback of stream reader
+ 
+ Emulates positioned reads on top of sequential read callback.
+ Bytes preceding offset are skipped, offsets behind current position can not be read.
+ 
+ @param[in,out] handle MOBIStream handle
+ @param[out] buffer Output buffer
+ @param[in] length Number of bytes to read
+ @param[in] offset Offset to read from
+ @return Number of bytes read
+ */
+static size_t mobi_stream_pread(void *handle, unsigned char *buffer, const size_t length, const size_t offset) {
+    MOBIStream *stream = handle;
+    const MOBIReader *reader = stream->reader;
+    if (offset < stream->position) {
+        debug_print("Can't read stream backwards (%zu < %zu)\n", offset, stream->position);
+        return 0;
+    }
+    while (stream->position < offset) {
+        unsigned char skip[4096];
+        size_t len = offset - stream->position;
+        if (len > sizeof(skip)) {
+            len = sizeof(skip);
+        }
+        const size_t read = reader->read(reader->handle, skip, len);
+        if (read == 0) {
             return 0;
         }
+        stream->position += read;
     }
-    else if (_Origin == SEEK_END)
-    {
-        if ((_Offset >= 0) && (_Offset <= _Stream->file_length))
-        {
-            _Stream->current_file_position = +_Stream->file_length - _Offset;
-            return 0;
+    size_t total = 0;
+    while (total < length) {
+        const size_t read = reader->read(reader->handle, buffer + total, length - total);
+        if (read == 0) {
+            break;
         }
+        total += read;
     }
-    return 1;
+    stream->position += total;
+    return total;
 }
 
-long mtell(MEMORY_FILE* _Stream)
-{
-    return _Stream->current_file_position;
+/**
+ @brief Initialize reader for non-seekable file (eg. pipe)
+ 
+ Only read callback is set, document is loaded from such reader in a single pass.
+ 
+ @param[out] reader Reader to be initialized
+ @param[in] file File descriptor
+ */
+void mobi_reader_init_stream(MOBIReader *reader, FILE *file) {
+    memset(reader, 0, sizeof(MOBIReader));
+    reader->handle = file;
+    reader->read = mobi_file_read;
 }
 
-
 /**
- @brief Read palm database header from file into MOBIData structure (MOBIPdbHeader)
+ @brief Read palm database header from reader into MOBIData structure (MOBIPdbHeader)
  
  @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
+ @param[in] reader Reader
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file) {
+MOBI_RET mobi_load_pdbheader(MOBIData *m, const MOBIReader *reader) {
     if (m == NULL) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
-    if (!file) {
-        return MOBI_FILE_NOT_FOUND;
-    }
     MOBIBuffer *buf = mobi_buffer_init(PALMDB_HEADER_LEN);
     if (buf == NULL) {
         debug_print("%s\n", "Memory allocation failed");
         return MOBI_MALLOC_FAILED;
     }
-    const size_t len = fread(buf->data, 1, PALMDB_HEADER_LEN, file);
+    const size_t len = reader->pread(reader->handle, buf->data, PALMDB_HEADER_LEN, 0);
     if (len != PALMDB_HEADER_LEN) {
         mobi_buffer_free(buf);
         return MOBI_DATA_CORRUPT;
@@ -117,304 +285,209 @@ MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file) {
 }
 
 /**
- @brief Read palm database header from file into MOBIData structure (MOBIPdbHeader)
-
+ @brief Read list of database records from reader into MOBIData structure (MOBIPdbRecord)
+ 
  @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
+ @param[in] reader Reader
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_pdbheader_memory(MOBIData* m, MEMORY_FILE* file) {
+MOBI_RET mobi_load_reclist(MOBIData *m, const MOBIReader *reader) {
     if (m == NULL) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
-    if (!file) {
-        return MOBI_FILE_NOT_FOUND;
-    }
-    MOBIBuffer* buf = mobi_buffer_init(PALMDB_HEADER_LEN);
+    const size_t list_size = (size_t) m->ph->rec_count * PALMDB_RECORD_INFO_SIZE;
+    MOBIBuffer *buf = mobi_buffer_init(list_size);
     if (buf == NULL) {
         debug_print("%s\n", "Memory allocation failed");
         return MOBI_MALLOC_FAILED;
     }
-    const size_t len = mread(buf->data, 1, PALMDB_HEADER_LEN, file);
-    if (len != PALMDB_HEADER_LEN) {
+    const size_t len = reader->pread(reader->handle, buf->data, list_size, PALMDB_HEADER_LEN);
+    if (len != list_size) {
         mobi_buffer_free(buf);
         return MOBI_DATA_CORRUPT;
     }
-    m->ph = calloc(1, sizeof(MOBIPdbHeader));
-    if (m->ph == NULL) {
-        debug_print("%s", "Memory allocation for pdb header failed\n");
+    MOBIInternals *internals = mobi_init_internals(m);
+    if (internals == NULL) {
         mobi_buffer_free(buf);
         return MOBI_MALLOC_FAILED;
     }
-    /* parse header */
-    mobi_buffer_getstring(m->ph->name, buf, PALMDB_NAME_SIZE_MAX);
-    m->ph->attributes = mobi_buffer_get16(buf);
-    m->ph->version = mobi_buffer_get16(buf);
-    m->ph->ctime = mobi_buffer_get32(buf);
-    m->ph->mtime = mobi_buffer_get32(buf);
-    m->ph->btime = mobi_buffer_get32(buf);
-    m->ph->mod_num = mobi_buffer_get32(buf);
-    m->ph->appinfo_offset = mobi_buffer_get32(buf);
-    m->ph->sortinfo_offset = mobi_buffer_get32(buf);
-    mobi_buffer_getstring(m->ph->type, buf, 4);
-    mobi_buffer_getstring(m->ph->creator, buf, 4);
-    m->ph->uid = mobi_buffer_get32(buf);
-    m->ph->next_rec = mobi_buffer_get32(buf);
-    m->ph->rec_count = mobi_buffer_get16(buf);
-    mobi_buffer_free(buf);
-    return MOBI_SUCCESS;
-}
-
-
-
-/**
- @brief Read list of database records from file into MOBIData structure (MOBIPdbRecord)
- 
- @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
- @return MOBI_RET status code (on success MOBI_SUCCESS)
- */
-MOBI_RET mobi_load_reclist(MOBIData *m, FILE *file) {
-    if (m == NULL) {
-        debug_print("%s", "Mobi structure not initialized\n");
-        return MOBI_INIT_FAILED;
-    }
-    if (!file) {
-        debug_print("%s", "File not ready\n");
-        return MOBI_FILE_NOT_FOUND;
-    }
-    m->rec = calloc(1, sizeof(MOBIPdbRecord));
-    if (m->rec == NULL) {
+    /* list nodes are allocated in one block and linked in order */
+    MOBIPdbRecord *records = calloc(m->ph->rec_count, sizeof(MOBIPdbRecord));
+    if (records == NULL) {
         debug_print("%s", "Memory allocation for pdb record failed\n");
+        mobi_buffer_free(buf);
         return MOBI_MALLOC_FAILED;
     }
-    MOBIPdbRecord *curr = m->rec;
-    for (int i = 0; i < m->ph->rec_count; i++) {
-        MOBIBuffer *buf = mobi_buffer_init(PALMDB_RECORD_INFO_SIZE);
-        if (buf == NULL) {
-            debug_print("%s\n", "Memory allocation failed");
-            return MOBI_MALLOC_FAILED;
-        }
-        const size_t len = fread(buf->data, 1, PALMDB_RECORD_INFO_SIZE, file);
-        if (len != PALMDB_RECORD_INFO_SIZE) {
-            mobi_buffer_free(buf);
-            return MOBI_DATA_CORRUPT;
-        }
-        if (i > 0) {
-            curr->next = calloc(1, sizeof(MOBIPdbRecord));
-            if (curr->next == NULL) {
-                debug_print("%s", "Memory allocation for pdb record failed\n");
-                mobi_buffer_free(buf);
-                return MOBI_MALLOC_FAILED;
-            }
-            curr = curr->next;
-        }
+    internals->records_block = records;
+    internals->records_block_count = m->ph->rec_count;
+    m->rec = records;
+    for (size_t i = 0; i < m->ph->rec_count; i++) {
+        MOBIPdbRecord *curr = &records[i];
         curr->offset = mobi_buffer_get32(buf);
         curr->attributes = mobi_buffer_get8(buf);
         const uint8_t h = mobi_buffer_get8(buf);
         const uint16_t l = mobi_buffer_get16(buf);
         curr->uid =  (uint32_t) h << 16 | l;
-        curr->next = NULL;
-        mobi_buffer_free(buf);
+        curr->next = (i + 1 < m->ph->rec_count) ? &records[i + 1] : NULL;
     }
-    return MOBI_SUCCESS;
+    mobi_buffer_free(buf);
+    return mobi_init_recdir(m);
 }
 
-
 /**
- @brief Read list of database records from file into MOBIData structure (MOBIPdbRecord)
-
- @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
+ @brief Read record data from reader into MOBIPdbRecord structure
+ 
+ @param[in,out] rec MOBIPdbRecord structure to be filled with read data
+ @param[in] reader Reader
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_reclist_memory(MOBIData* m, MEMORY_FILE* file) {
-    if (m == NULL) {
-        debug_print("%s", "Mobi structure not initialized\n");
-        return MOBI_INIT_FAILED;
-    }
-    if (!file) {
-        debug_print("%s", "File not ready\n");
-        return MOBI_FILE_NOT_FOUND;
-    }
-    m->rec = calloc(1, sizeof(MOBIPdbRecord));
-    if (m->rec == NULL) {
-        debug_print("%s", "Memory allocation for pdb record failed\n");
+MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, const MOBIReader *reader) {
+    rec->data = malloc(rec->size);
+    if (rec->data == NULL) {
+        debug_print("%s", "Memory allocation for pdb record data failed\n");
         return MOBI_MALLOC_FAILED;
     }
-    MOBIPdbRecord* curr = m->rec;
-    for (int i = 0; i < m->ph->rec_count; i++) {
-        MOBIBuffer* buf = mobi_buffer_init(PALMDB_RECORD_INFO_SIZE);
-        if (buf == NULL) {
-            debug_print("%s\n", "Memory allocation failed");
-            return MOBI_MALLOC_FAILED;
-        }
-        const size_t len = mread(buf->data, 1, PALMDB_RECORD_INFO_SIZE, file);
-        if (len != PALMDB_RECORD_INFO_SIZE) {
-            mobi_buffer_free(buf);
-            return MOBI_DATA_CORRUPT;
-        }
-        if (i > 0) {
-            curr->next = calloc(1, sizeof(MOBIPdbRecord));
-            if (curr->next == NULL) {
-                debug_print("%s", "Memory allocation for pdb record failed\n");
-                mobi_buffer_free(buf);
-                return MOBI_MALLOC_FAILED;
-            }
-            curr = curr->next;
-        }
-        curr->offset = mobi_buffer_get32(buf);
-        curr->attributes = mobi_buffer_get8(buf);
-        const uint8_t h = mobi_buffer_get8(buf);
-        const uint16_t l = mobi_buffer_get16(buf);
-        curr->uid = (uint32_t)h << 16 | l;
-        curr->next = NULL;
-        mobi_buffer_free(buf);
+    const size_t len = reader->pread(reader->handle, rec->data, rec->size, rec->offset);
+    if (len < rec->size) {
+        debug_print("Truncated data in record %i\n", rec->uid);
+        return MOBI_DATA_CORRUPT;
     }
     return MOBI_SUCCESS;
 }
 
-
 /**
- @brief Read record data and size from file into MOBIData structure (MOBIPdbRecord)
+ @brief Read data of the last record until end of source
  
- @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
+ Used when source size is unknown.
+ 
+ @param[in,out] rec MOBIPdbRecord structure to be filled with read data
+ @param[in] reader Reader
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_rec(MOBIData *m, FILE *file) {
-    MOBI_RET ret;
-    if (m == NULL) {
-        debug_print("%s", "Mobi structure not initialized\n");
-        return MOBI_INIT_FAILED;
-    }
-    MOBIPdbRecord *curr = m->rec;
-    while (curr != NULL) {
-        MOBIPdbRecord *next;
-        size_t size;
-        if (curr->next != NULL) {
-            next = curr->next;
-            size = next->offset - curr->offset;
-        } else {
-            fseek(file, 0, SEEK_END);
-            long diff = ftell(file) - curr->offset;
-            if (diff <= 0) {
-                debug_print("Wrong record size: %li\n", diff);
-                return MOBI_DATA_CORRUPT;
-            }
-            size = (size_t) diff;
-            next = NULL;
+static MOBI_RET mobi_load_recdata_tail(MOBIPdbRecord *rec, const MOBIReader *reader) {
+    size_t size = 4096;
+    size_t len = 0;
+    rec->data = NULL;
+    while (true) {
+        unsigned char *data = realloc(rec->data, size);
+        if (data == NULL) {
+            debug_print("%s", "Memory allocation for pdb record data failed\n");
+            return MOBI_MALLOC_FAILED;
         }
-
-        curr->size = size;
-        ret = mobi_load_recdata(curr, file);
-        if (ret  != MOBI_SUCCESS) {
-            debug_print("Error loading record uid %i data\n", curr->uid);
-            mobi_free_rec(m);
-            return ret;
+        rec->data = data;
+        const size_t read = reader->pread(reader->handle, rec->data + len, size - len, rec->offset + len);
+        len += read;
+        if (len < size) {
+            break;
         }
-        curr = next;
+        size *= 2;
+    }
+    rec->size = len;
+    if (len == 0) {
+        debug_print("Wrong record size: %zu\n", len);
+        return MOBI_DATA_CORRUPT;
+    }
+    unsigned char *data = realloc(rec->data, len);
+    if (data) {
+        rec->data = data;
     }
     return MOBI_SUCCESS;
 }
 
-
 /**
- @brief Read record data and size from file into MOBIData structure (MOBIPdbRecord)
-
- @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file Filedescriptor to read from
+ @brief Read records size and data from reader into MOBIData structure (MOBIPdbRecord)
+ 
+ If reader holds contiguous data and records are borrowed, records data points into it.
+ If records are loaded lazily, probed or partially, records data is left unset until first access
+ with mobi_load_recdata_lazy().
+ Otherwise records data is copied.
+ If reader has no size callback, last record is read until the end of source.
+ 
+ @param[in,out] m MOBIData structure with loaded records list
+ @param[in] reader Reader
+ @param[in] flags Loading flags
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_rec_memory(MOBIData* m, MEMORY_FILE* file) {
-    MOBI_RET ret;
+MOBI_RET mobi_load_rec(MOBIData *m, const MOBIReader *reader, const MOBILoadFlags flags) {
     if (m == NULL) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
-    MOBIPdbRecord* curr = m->rec;
+    const size_t file_size = reader->size ? reader->size(reader->handle) : MOBI_NOTSET;
+    if (file_size == MOBI_NOTSET && reader->size) {
+        debug_print("%s", "Can't get file size\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    const bool borrow = (flags & MOBI_LOAD_BORROW) && reader->data && reader->size;
+    MOBIPdbRecord *curr = m->rec;
     while (curr != NULL) {
-        MOBIPdbRecord* next;
-        size_t size;
+        if (curr->next == NULL && file_size == MOBI_NOTSET) {
+            if ((flags & MOBI_LOAD_PROBE) && curr != m->rec) {
+                /* size of the last record remains unknown, its data is not needed */
+                break;
+            }
+            const MOBI_RET ret = mobi_load_recdata_tail(curr, reader);
+            if (ret != MOBI_SUCCESS) {
+                debug_print("Error loading record uid %i data\n", curr->uid);
+                mobi_free_rec(m);
+                return ret;
+            }
+            break;
+        }
+        size_t end;
         if (curr->next != NULL) {
-            next = curr->next;
-            size = next->offset - curr->offset;
+            end = curr->next->offset;
+        } else {
+            end = file_size;
         }
-        else {
-            mseek(file, 0, SEEK_END);
-            long diff = mtell(file) - curr->offset;
-            if (diff <= 0) {
-                debug_print("Wrong record size: %li\n", diff);
-                return MOBI_DATA_CORRUPT;
-            }
-            size = (size_t)diff;
-            next = NULL;
+        if (curr->offset > end || end > file_size
+            || (curr->next == NULL && curr->offset == end)) {
+            debug_print("Wrong record size: %li\n", (long) end - (long) curr->offset);
+            return MOBI_DATA_CORRUPT;
         }
-
-        curr->size = size;
-        ret = mobi_load_recdata_memory(curr, file);
-        if (ret != MOBI_SUCCESS) {
-            debug_print("Error loading record uid %i data\n", curr->uid);
-            mobi_free_rec(m);
-            return ret;
+        curr->size = end - curr->offset;
+        if (borrow) {
+            curr->data = (unsigned char *) reader->data + curr->offset;
+        } else if (flags & (MOBI_LOAD_LAZY | MOBI_LOAD_PROBE | MOBI_LOAD_PART)) {
+            curr->data = NULL;
+        } else {
+            const MOBI_RET ret = mobi_load_recdata(curr, reader);
+            if (ret != MOBI_SUCCESS) {
+                debug_print("Error loading record uid %i data\n", curr->uid);
+                mobi_free_rec(m);
+                return ret;
+            }
         }
-        curr = next;
+        curr = curr->next;
     }
     return MOBI_SUCCESS;
 }
 
 /**
- @brief Read record data from file into MOBIPdbRecord structure
+ @brief Load data of record that was skipped by on demand loader
  
+ Does nothing if record data is already loaded.
+ 
+ @param[in] m MOBIData structure
  @param[in,out] rec MOBIPdbRecord structure to be filled with read data
- @param[in] file Filedescriptor to read from
- @return MOBI_RET status code (on success MOBI_SUCCESS)
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_DATA_CORRUPT if data is not available (probed document)
  */
-MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, FILE *file) {
-    const int ret = fseek(file, rec->offset, SEEK_SET);
-    if (ret != 0) {
-        debug_print("Record %i not found\n", rec->uid);
-        return MOBI_DATA_CORRUPT;
-    }
-    rec->data = malloc(rec->size);
-    if (rec->data == NULL) {
-        debug_print("%s", "Memory allocation for pdb record data failed\n");
-        return MOBI_MALLOC_FAILED;
+MOBI_RET mobi_load_recdata_lazy(const MOBIData *m, MOBIPdbRecord *rec) {
+    if (m == NULL || rec == NULL || rec->data != NULL || rec->size == 0) {
+        return MOBI_SUCCESS;
     }
-    const size_t len = fread(rec->data, 1, rec->size, file);
-    if (len < rec->size) {
-        debug_print("Truncated data in record %i\n", rec->uid);
-        return MOBI_DATA_CORRUPT;
-    }
-    return MOBI_SUCCESS;
-}
-
-
-/**
- @brief Read record data from file into MOBIPdbRecord structure
-
- @param[in,out] rec MOBIPdbRecord structure to be filled with read data
- @param[in] file Filedescriptor to read from
- @return MOBI_RET status code (on success MOBI_SUCCESS)
- */
-MOBI_RET mobi_load_recdata_memory(MOBIPdbRecord* rec, MEMORY_FILE* file) {
-    const int ret = mseek(file, rec->offset, SEEK_SET);
-    if (ret != 0) {
-        debug_print("Record %i not found\n", rec->uid);
+    const MOBIInternals *internals = m->internals;
+    if (internals == NULL || internals->source == NULL) {
+        debug_print("Data of record %i not loaded\n", rec->uid);
         return MOBI_DATA_CORRUPT;
     }
-    rec->data = malloc(rec->size);
-    if (rec->data == NULL) {
-        debug_print("%s", "Memory allocation for pdb record data failed\n");
-        return MOBI_MALLOC_FAILED;
-    }
-    const size_t len = mread(rec->data, 1, rec->size, file);
-    if (len < rec->size) {
-        debug_print("Truncated data in record %i\n", rec->uid);
-        return MOBI_DATA_CORRUPT;
+    const MOBI_RET ret = mobi_load_recdata(rec, internals->source);
+    if (ret != MOBI_SUCCESS) {
+        free(rec->data);
+        rec->data = NULL;
     }
-    return MOBI_SUCCESS;
+    return ret;
 }
 
 /**
@@ -707,11 +780,9 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
  */
 size_t mobi_get_record_extrasize(const MOBIPdbRecord *record, const uint16_t flags) {
     size_t extra_size = 0;
-    MOBIBuffer *buf = mobi_buffer_init_null(record->data, record->size);
-    if (buf == NULL) {
-        debug_print("%s", "Buffer init in extrasize failed\n");
-        return MOBI_NOTSET;
-    }
+    /* called for every text record, buffer structure is not allocated */
+    MOBIBuffer record_buf = { .offset = 0, .maxlen = record->size, .data = record->data, .error = MOBI_SUCCESS };
+    MOBIBuffer *buf = &record_buf;
     /* set pointer at the end of the record data */
     mobi_buffer_setpos(buf, buf->maxlen - 1);
     for (int bit = 15; bit > 0; bit--) {
@@ -732,7 +803,6 @@ size_t mobi_get_record_extrasize(const MOBIPdbRecord *record, const uint16_t fla
             /* two first bits hold size */
             extra_size += (b & 0x3) + 1;
     }
-    mobi_buffer_free_null(buf);
     return extra_size;
 }
 
@@ -746,11 +816,8 @@ size_t mobi_get_record_extrasize(const MOBIPdbRecord *record, const uint16_t fla
 size_t mobi_get_record_mb_extrasize(const MOBIPdbRecord *record, const uint16_t flags) {
     size_t extra_size = 0;
     if (flags & 1) {
-        MOBIBuffer *buf = mobi_buffer_init_null(record->data, record->size);
-        if (buf == NULL) {
-            debug_print("%s", "Buffer init in extrasize failed\n");
-            return MOBI_NOTSET;
-        }
+        MOBIBuffer record_buf = { .offset = 0, .maxlen = record->size, .data = record->data, .error = MOBI_SUCCESS };
+        MOBIBuffer *buf = &record_buf;
         /* set pointer at the end of the record data */
         mobi_buffer_setpos(buf, buf->maxlen - 1);
         for (int bit = 15; bit > 0; bit--) {
@@ -768,7 +835,6 @@ size_t mobi_get_record_mb_extrasize(const MOBIPdbRecord *record, const uint16_t
         const uint8_t b = mobi_buffer_get8(buf);
         /* two first bits hold size */
         extra_size += (b & 0x3) + 1;
-        mobi_buffer_free_null(buf);
     }
     return extra_size;
 }
@@ -823,6 +889,7 @@ MOBI_RET mobi_parse_huff(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record) {
         huffcdic->maxcode_table[i] =  ((maxcode + 1) << (32 - i)) - 1;
     }
     mobi_buffer_free_null(buf);
+    mobi_init_huffman_lookup(huffcdic);
     return MOBI_SUCCESS;
 }
 
@@ -958,7 +1025,7 @@ MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *huffcdic) {
         debug_print("%s", "HUFF parsing failed\n");
         return ret;
     }
-    curr = curr->next;
+    curr = mobi_get_record_next(m, curr);
     /* allocate memory for symbols data in each CDIC record */
     huffcdic->symbols = malloc((huff_rec_count - 1) * sizeof(*huffcdic->symbols));
     if (huffcdic->symbols == NULL) {
@@ -977,7 +1044,7 @@ MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *huffcdic) {
             debug_print("%s", "CDIC parsing failed\n");
             return ret;
         }
-        curr = curr->next;
+        curr = mobi_get_record_next(m, curr);
     }
     if (huffcdic->index_count != huffcdic->index_read) {
         debug_print("CDIC: wrong read index count: %zu, total: %zu\n", huffcdic->index_read, huffcdic->index_count);
@@ -1064,38 +1131,16 @@ MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml) {
 }
 
 /**
- @brief Read MOBI document from file into MOBIData structure
+ @brief Parse loaded records 0 into MOBIData structure
  
- @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file File descriptor to read from
+ Sets DRM key for encryption type 1 and, for hybrid KF7/KF8 file,
+ initializes linked KF8 part.
+ 
+ @param[in,out] m MOBIData structure with loaded records
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_file(MOBIData *m, FILE *file) {
+static MOBI_RET mobi_load_records_parse(MOBIData *m) {
     MOBI_RET ret;
-    if (m == NULL) {
-        debug_print("%s", "Mobi structure not initialized\n");
-        return MOBI_INIT_FAILED;
-    }
-    ret = mobi_load_pdbheader(m, file);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
-    }
-    if (strcmp(m->ph->type, "BOOK") != 0 && strcmp(m->ph->type, "TEXt") != 0) {
-        debug_print("Unsupported file type: %s\n", m->ph->type);
-        return MOBI_FILE_UNSUPPORTED;
-    }
-    if (m->ph->rec_count == 0) {
-        debug_print("%s", "No records found\n");
-        return MOBI_DATA_CORRUPT;
-    }
-    ret = mobi_load_reclist(m, file);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
-    }
-    ret = mobi_load_rec(m, file);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
-    }
     ret = mobi_parse_record0(m, 0);
     if (ret != MOBI_SUCCESS) {
         return ret;
@@ -1112,6 +1157,10 @@ MOBI_RET mobi_load_file(MOBIData *m, FILE *file) {
             /* it is a hybrid KF7/KF8 file */
             m->kf8_boundary_offset = (uint32_t) boundary_rec_number;
             m->next = mobi_init();
+            if (m->next == NULL) {
+                debug_print("%s", "Memory allocation for KF8 part failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
             /* link pdb header and records data to KF8data structure */
             m->next->ph = m->ph;
             m->next->rec = m->rec;
@@ -1132,21 +1181,134 @@ MOBI_RET mobi_load_file(MOBIData *m, FILE *file) {
     return MOBI_SUCCESS;
 }
 
-
 /**
- @brief Read MOBI document from file into MOBIData structure
+ @brief Load data of records belonging to selected part of the document
+ 
+ For hybrid KF7/KF8 document with use_kf8 flag set these are KF8 records
+ (from boundary record to the end) and KF7 resource records, which are shared by both parts.
+ Without use_kf8 flag these are KF7 records up to boundary record.
+ For other documents all records are loaded.
+ 
+ @param[in,out] m MOBIData structure with parsed records 0
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_load_part(MOBIData *m) {
+    size_t first = 0;
+    size_t last = mobi_get_records_count(m);
+    size_t shared_first = MOBI_NOTSET;
+    size_t shared_last = MOBI_NOTSET;
+    if (mobi_is_hybrid(m)) {
+        const size_t boundary = m->kf8_boundary_offset;
+        if (m->use_kf8) {
+            first = boundary;
+            /* KF7 headers are linked in m->next after swap */
+            const MOBIData *kf7 = m->next;
+            if (kf7 && kf7->mh && kf7->mh->image_index && *kf7->mh->image_index < boundary) {
+                shared_first = *kf7->mh->image_index;
+                shared_last = boundary;
+                const MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(kf7, EXTH_COUNTRESOURCES);
+                if (exth) {
+                    const size_t count = mobi_decode_exthvalue(exth->data, exth->size);
+                    if (shared_first + count < shared_last) {
+                        shared_last = shared_first + count;
+                    }
+                }
+            }
+        } else {
+            last = boundary + 1;
+        }
+    }
+    debug_print("Loading records %zu-%zu\n", first, last);
+    MOBIPdbRecord *curr = m->rec;
+    size_t i = 0;
+    while (curr != NULL && i < last) {
+        if (i >= first || (i >= shared_first && i < shared_last)) {
+            const MOBI_RET ret = mobi_load_recdata_lazy(m, curr);
+            if (ret != MOBI_SUCCESS) {
+                debug_print("Error loading record uid %i data\n", curr->uid);
+                return ret;
+            }
+        }
+        curr = curr->next;
+        i++;
+    }
+    return MOBI_SUCCESS;
+}
 
+/**
+ @brief Read MOBI document from reader into MOBIData structure
+ 
+ Reader should provide pread and size callbacks.
+ Reader without pread callback is read sequentially in a single pass (eg. pipe or socket),
+ records are read as they arrive. MOBI_LOAD_LAZY and MOBI_LOAD_PART flags are not supported in this case.
+ Without size callback the last record is read until the end of source.
+ With MOBI_LOAD_BORROW flag, if reader holds contiguous data, records data points into it.
+ The data must stay valid and unchanged until mobi_free() is called.
+ With MOBI_LOAD_PROBE flag only palm database header, records list and records 0 are read,
+ other records data is not available.
+ With MOBI_LOAD_LAZY flag only palm database header, records list and records 0 are read on load.
+ Data of remaining records is read on first access through records accessors
+ (eg. mobi_get_record_by_seqnumber()). Reader is kept by MOBIData structure,
+ its handle must stay valid until mobi_free() is called, which calls reader's close callback (if set).
+ Records data loaded this way must not be accessed concurrently from many threads.
+ With MOBI_LOAD_PART flag only records of the part of hybrid KF7/KF8 document selected
+ by use_kf8 flag are read (together with resources shared by both parts).
+ Data of the other part is not available, unless MOBI_LOAD_LAZY flag is also set.
+ 
  @param[in,out] m MOBIData structure to be filled with read data
- @param[in] file File descriptor to read from
+ @param[in] reader Reader
+ @param[in] flags Loading flags, MOBI_LOAD_COPY or combination of MOBI_LOAD_BORROW, MOBI_LOAD_LAZY, MOBI_LOAD_PROBE, MOBI_LOAD_PART
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_load_file_memory(MOBIData* m, MEMORY_FILE* file) {
-    MOBI_RET ret;
+MOBI_RET mobi_load_reader(MOBIData *m, const MOBIReader *reader, const MOBILoadFlags flags) {
     if (m == NULL) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
-    ret = mobi_load_pdbheader_memory(m, file);
+    if (reader == NULL || (reader->pread == NULL && reader->read == NULL)) {
+        debug_print("%s", "Reader not initialized\n");
+        return MOBI_PARAM_ERR;
+    }
+    /* sequential reader is consumed in a single pass */
+    MOBIStream stream;
+    MOBIReader stream_reader;
+    if (reader->pread == NULL) {
+        if (flags & (MOBI_LOAD_LAZY | MOBI_LOAD_PART)) {
+            debug_print("%s", "Sequential reader does not support on demand loading\n");
+            return MOBI_PARAM_ERR;
+        }
+        stream.reader = reader;
+        stream.position = 0;
+        memset(&stream_reader, 0, sizeof(MOBIReader));
+        stream_reader.handle = &stream;
+        stream_reader.pread = mobi_stream_pread;
+        reader = &stream_reader;
+    }
+    MOBIInternals *internals = mobi_init_internals(m);
+    if (internals == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    const bool borrow = (flags & MOBI_LOAD_BORROW) && reader->data && reader->size;
+    if (borrow && internals->image == NULL) {
+        internals->image = reader->data;
+        internals->image_size = reader->size(reader->handle);
+        internals->image_mapped = false;
+    }
+    /* probed or partially loaded document keeps reader only until loading is finished */
+    const bool transient = (flags & (MOBI_LOAD_PROBE | MOBI_LOAD_PART)) && !(flags & MOBI_LOAD_LAZY);
+    if ((flags & (MOBI_LOAD_LAZY | MOBI_LOAD_PROBE | MOBI_LOAD_PART)) && !borrow) {
+        internals->source = malloc(sizeof(MOBIReader));
+        if (internals->source == NULL) {
+            debug_print("%s", "Memory allocation for reader failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        *internals->source = *reader;
+        if (transient) {
+            internals->source->close = NULL;
+        }
+        reader = internals->source;
+    }
+    MOBI_RET ret = mobi_load_pdbheader(m, reader);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
@@ -1158,51 +1320,123 @@ MOBI_RET mobi_load_file_memory(MOBIData* m, MEMORY_FILE* file) {
         debug_print("%s", "No records found\n");
         return MOBI_DATA_CORRUPT;
     }
-    ret = mobi_load_reclist_memory(m, file);
+    ret = mobi_load_reclist(m, reader);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    ret = mobi_load_rec_memory(m, file);
+    ret = mobi_load_rec(m, reader, flags);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    ret = mobi_parse_record0(m, 0);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
+    ret = mobi_load_records_parse(m);
+    if (ret == MOBI_SUCCESS && (flags & MOBI_LOAD_PART) && !(flags & MOBI_LOAD_PROBE) && !borrow) {
+        ret = mobi_load_part(m);
     }
-    if (m->rh && m->rh->encryption_type == MOBI_ENCRYPTION_V1) {
-        /* try to set key for encryption type 1 */
-        debug_print("Trying to set key for encryption type 1%s", "\n");
-        mobi_drm_setkey(m, NULL);
+    if (transient && internals->source) {
+        free(internals->source);
+        internals->source = NULL;
     }
-    /* if EXTH is loaded parse KF8 record0 for hybrid KF7/KF8 file */
-    if (m->eh) {
-        const size_t boundary_rec_number = mobi_get_kf8boundary_seqnumber(m);
-        if (boundary_rec_number != MOBI_NOTSET && boundary_rec_number < UINT32_MAX) {
-            /* it is a hybrid KF7/KF8 file */
-            m->kf8_boundary_offset = (uint32_t)boundary_rec_number;
-            m->next = mobi_init();
-            /* link pdb header and records data to KF8data structure */
-            m->next->ph = m->ph;
-            m->next->rec = m->rec;
-            m->next->drm_key = m->drm_key;
-            m->next->internals = m->internals;
-            /* close next loop */
-            m->next->next = m;
-            ret = mobi_parse_record0(m->next, boundary_rec_number + 1);
-            if (ret != MOBI_SUCCESS) {
-                return ret;
-            }
-            /* swap to kf8 part if use_kf8 flag is set */
-            if (m->use_kf8) {
-                mobi_swap_mobidata(m);
-            }
-        }
+    return ret;
+}
+
+/**
+ @brief Read MOBI document from file into MOBIData structure
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] file File descriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_file(MOBIData *m, FILE *file) {
+    if (file == NULL) {
+        debug_print("%s", "File not ready\n");
+        return MOBI_FILE_NOT_FOUND;
     }
-    return MOBI_SUCCESS;
+    MOBIReader reader;
+    mobi_reader_init_file(&reader, file, false);
+    return mobi_load_reader(m, &reader, MOBI_LOAD_COPY);
 }
 
+/**
+ @brief Read one part of hybrid KF7/KF8 MOBI document from file into MOBIData structure
+ 
+ Only records of the part selected by use_kf8 flag of MOBIData structure are read,
+ together with resources shared by both parts. By default KF8 part is read,
+ set use_kf8 to false before loading to read KF7 part.
+ Records of the other part are not available. Other documents are read entirely.
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] file File descriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_file_part(MOBIData *m, FILE *file) {
+    if (file == NULL) {
+        debug_print("%s", "File not ready\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    MOBIReader reader;
+    mobi_reader_init_file(&reader, file, false);
+    return mobi_load_reader(m, &reader, MOBI_LOAD_PART);
+}
 
+/**
+ @brief Read MOBI document from non-seekable file (eg. pipe or socket) into MOBIData structure
+ 
+ File is read sequentially in a single pass, records are parsed as they arrive.
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] file File descriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_stream(MOBIData *m, FILE *file) {
+    if (file == NULL) {
+        debug_print("%s", "File not ready\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    MOBIReader reader;
+    mobi_reader_init_stream(&reader, file);
+    return mobi_load_reader(m, &reader, MOBI_LOAD_COPY);
+}
+
+/**
+ @brief Read headers of MOBI document from file into MOBIData structure
+ 
+ Only palm database header, records list and records 0 (with MOBI header and EXTH) are read.
+ This is enough to get document metadata. Data of other records is not available,
+ records accessors return NULL for them.
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] file File descriptor to read from
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_probe(MOBIData *m, FILE *file) {
+    if (file == NULL) {
+        debug_print("%s", "File not ready\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    MOBIReader reader;
+    mobi_reader_init_file(&reader, file, false);
+    return mobi_load_reader(m, &reader, MOBI_LOAD_PROBE);
+}
+
+/**
+ @brief Read headers of MOBI document from a path into MOBIData structure
+ 
+ See mobi_probe().
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] path Path to a MOBI document on disk (eg. /home/me/test.mobi)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_probe_filename(MOBIData *m, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        debug_print("%s", "File not found\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    const MOBI_RET ret = mobi_probe(m, file);
+    fclose(file);
+    return ret;
+}
 
 /**
  @brief Read MOBI document from a path into MOBIData structure
@@ -1221,3 +1455,115 @@ MOBI_RET mobi_load_filename(MOBIData *m, const char *path) {
     fclose(file);
     return ret;
 }
+
+/**
+ @brief Read MOBI document from memory buffer into MOBIData structure
+ 
+ With MOBI_LOAD_BORROW flag records data is not copied, it points directly into the buffer.
+ In such case the buffer must stay valid and unchanged until mobi_free() is called.
+ Records are copied on write, eg. when document is decrypted.
+ With MOBI_LOAD_COPY flag records data is copied and buffer may be released after loading.
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] data Buffer with MOBI document
+ @param[in] size Buffer size
+ @param[in] flags MOBI_LOAD_COPY or MOBI_LOAD_BORROW
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_buffer(MOBIData *m, const unsigned char *data, const size_t size, const MOBILoadFlags flags) {
+    if (data == NULL || size == 0) {
+        return MOBI_PARAM_ERR;
+    }
+    MEMORY_FILE file = { data, size, 0 };
+    MOBIReader reader;
+    mobi_reader_init_memory(&reader, &file);
+    /* memory reader is not kept, lazy loading makes no sense here */
+    return mobi_load_reader(m, &reader, flags & MOBI_LOAD_BORROW);
+}
+
+/**
+ @brief Read MOBI document from a path into MOBIData structure loading records on demand
+ 
+ Only palm database header, records list and records 0 are read on load.
+ Data of remaining records is read from the file on first access
+ through records accessors (eg. mobi_get_record_by_seqnumber()).
+ File is kept open until mobi_free() is called.
+ Records data loaded this way must not be accessed concurrently from many threads.
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] path Path to a MOBI document on disk (eg. /home/me/test.mobi)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_filename_lazy(MOBIData *m, const char *path) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        debug_print("%s", "File not found\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    MOBIReader reader;
+    mobi_reader_init_file(&reader, file, true);
+    const MOBI_RET ret = mobi_load_reader(m, &reader, MOBI_LOAD_LAZY);
+    const MOBIInternals *internals = m->internals;
+    if (internals == NULL || internals->source == NULL) {
+        /* reader was not stored */
+        fclose(file);
+    }
+    return ret;
+}
+
+/**
+ @brief Read MOBI document from a path into MOBIData structure using memory mapping
+ 
+ File is mapped read-only and records data points directly into the mapping,
+ so no record data is copied on load. Mapping is released by mobi_free().
+ Records are copied on write, eg. when document is decrypted.
+ If memory mapping is not available, it falls back to mobi_load_filename().
+ 
+ @param[in,out] m MOBIData structure to be filled with read data
+ @param[in] path Path to a MOBI document on disk (eg. /home/me/test.mobi)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_filename_mmap(MOBIData *m, const char *path) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        debug_print("%s", "File not found\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        debug_print("%s", "Can't get file size\n");
+        close(fd);
+        return MOBI_DATA_CORRUPT;
+    }
+    const size_t size = (size_t) st.st_size;
+    void *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        debug_print("%s", "File mapping failed\n");
+        return mobi_load_filename(m, path);
+    }
+    MOBIInternals *internals = mobi_init_internals(m);
+    if (internals == NULL) {
+        munmap(image, size);
+        return MOBI_MALLOC_FAILED;
+    }
+    internals->image = image;
+    internals->image_size = size;
+    internals->image_mapped = true;
+    MEMORY_FILE file = { image, size, 0 };
+    MOBIReader reader;
+    mobi_reader_init_memory(&reader, &file);
+    return mobi_load_reader(m, &reader, MOBI_LOAD_BORROW);
+#else
+    return mobi_load_filename(m, path);
+#endif
+}
@@ -18,18 +18,25 @@
 
 #define MOBI_EXTH_MAXCNT 1024
 
+/**
+ @brief Memory buffer handle of memory reader
+ */
 typedef struct MEMORY_FILE
 {
-    unsigned char* file_buffer;
-    long file_length;
-    long current_file_position;
+    const unsigned char *file_buffer; /**< Buffer data */
+    size_t file_length; /**< Buffer size */
+    size_t current_file_position; /**< Current read position */
 } MEMORY_FILE;
 
+void mobi_reader_init_memory(MOBIReader *reader, MEMORY_FILE *file);
+void mobi_reader_init_file(MOBIReader *reader, FILE *file, const bool owned);
+void mobi_reader_init_stream(MOBIReader *reader, FILE *file);
 MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml);
 MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *cdic);
-MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file);
-MOBI_RET mobi_load_reclist(MOBIData *m, FILE *file);
-MOBI_RET mobi_load_rec(MOBIData *m, FILE *file);
-MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, FILE *file);
+MOBI_RET mobi_load_pdbheader(MOBIData *m, const MOBIReader *reader);
+MOBI_RET mobi_load_reclist(MOBIData *m, const MOBIReader *reader);
+MOBI_RET mobi_load_rec(MOBIData *m, const MOBIReader *reader, const MOBILoadFlags flags);
+MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, const MOBIReader *reader);
+MOBI_RET mobi_load_recdata_lazy(const MOBIData *m, MOBIPdbRecord *rec);
 
 #endif
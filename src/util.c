@@ -21,6 +21,9 @@
 #include "parse_rawml.h"
 #include "index.h"
 #include "debug.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef USE_ENCRYPTION
 #include "encryption.h"
@@ -856,14 +859,29 @@ MOBIPdbRecord * mobi_get_record_by_uid(const MOBIData *m, const size_t uid) {
     if (m->rec == NULL) {
         return NULL;
     }
-    MOBIPdbRecord *curr = m->rec;
-    while (curr != NULL) {
-        if (curr->uid == uid) {
-            return curr;
+    const MOBIInternals *internals = m->internals;
+    MOBIPdbRecord *curr = NULL;
+    if (internals && internals->uids) {
+        const size_t mask = internals->uids_size - 1;
+        size_t slot = mobi_recdir_hash(uid, internals->uids_size);
+        while (internals->uids[slot]) {
+            MOBIPdbRecord *record = internals->records[internals->uids[slot] - 1];
+            if (record->uid == uid) {
+                curr = record;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    } else {
+        curr = m->rec;
+        while (curr != NULL && curr->uid != uid) {
+            curr = curr->next;
         }
-        curr = curr->next;
     }
-    return NULL;
+    if (curr == NULL || mobi_load_recdata_lazy(m, curr) != MOBI_SUCCESS) {
+        return NULL;
+    }
+    return curr;
 }
 
 /**
@@ -1020,15 +1038,43 @@ MOBIPdbRecord * mobi_get_record_by_seqnumber(const MOBIData *m, const size_t num
     if (m->rec == NULL) {
         return NULL;
     }
-    MOBIPdbRecord *curr = m->rec;
-    size_t i = 0;
-    while (curr != NULL) {
-        if (i++ == num) {
-            return curr;
+    const MOBIInternals *internals = m->internals;
+    MOBIPdbRecord *curr = NULL;
+    if (internals && internals->records) {
+        if (num < internals->records_count) {
+            curr = internals->records[num];
+        }
+    } else {
+        curr = m->rec;
+        size_t i = 0;
+        while (curr != NULL && i++ < num) {
+            curr = curr->next;
         }
-        curr = curr->next;
     }
-    return NULL;
+    if (curr == NULL || mobi_load_recdata_lazy(m, curr) != MOBI_SUCCESS) {
+        return NULL;
+    }
+    return curr;
+}
+
+/**
+ @brief Get palm database record following given record
+ 
+ In case records are loaded on demand, record data is loaded.
+ 
+ @param[in] m MOBIData structure with loaded data
+ @param[in] record Current record
+ @return Pointer to next MOBIPdbRecord record structure, NULL if not found or on failure
+ */
+MOBIPdbRecord * mobi_get_record_next(const MOBIData *m, const MOBIPdbRecord *record) {
+    if (record == NULL) {
+        return NULL;
+    }
+    MOBIPdbRecord *next = record->next;
+    if (mobi_load_recdata_lazy(m, next) != MOBI_SUCCESS) {
+        return NULL;
+    }
+    return next;
 }
 
 /**
@@ -1046,6 +1092,9 @@ MOBIPdbRecord * mobi_get_record_by_magic(const MOBIData *m, const unsigned char
 
     MOBIPdbRecord *curr = m->rec;
     while (curr != NULL) {
+        if (mobi_load_recdata_lazy(m, curr) != MOBI_SUCCESS) {
+            return NULL;
+        }
         if (curr->size >= 4 && memcmp(curr->data, magic, 4) != 0) {
             return curr;
         }
@@ -1103,6 +1152,7 @@ MOBIPdbRecord * mobi_extract_records_by_seqnumber(MOBIData *m, const size_t num,
         root->next = prev->next;
     }
     prev->next = NULL;
+    mobi_init_recdir(m);
     
     *count = i;
     if (m->ph->rec_count >= i) {
@@ -1162,6 +1212,7 @@ MOBI_RET mobi_insert_records_by_seqnumber(MOBIData *m, MOBIPdbRecord *record, co
     }
     curr->next = next;
     m->ph->rec_count += count;
+    mobi_init_recdir(m);
 
     debug_print("Inserted %zu records at index = %zu\n", count, num);
         
@@ -1187,8 +1238,7 @@ MOBI_RET mobi_delete_records_by_seqnumber(MOBIData *m, const size_t num, size_t
     while (curr != NULL) {
         MOBIPdbRecord *tmp = curr;
         curr = curr->next;
-        free(tmp->data);
-        free(tmp);
+        mobi_free_record(m, tmp);
         tmp = NULL;
     }
     
@@ -1786,22 +1836,21 @@ int mobi_bitcount(const uint8_t byte) {
 }
 
 /**
- @brief Decompress text record (internal).
+ @brief Check that text of the document can be decompressed and load huff/cdic tables if needed
  
- Internal function for mobi_get_rawml and mobi_dump_rawml. 
- Decompressed output is stored either in a file or in a text string
+ Parsed huff/cdic tables are kept in internals and reused by following calls,
+ until records list changes. Tables are cached by HUFF record,
+ so both parts of hybrid file share them if they use the same record.
+ Caller gets its own structure sharing cached tables, it takes over cache of decompressed symbols,
+ so concurrent readers of the same document never modify the same symbols cache.
+ Tables must be released with mobi_release_text().
  
  @param[in] m MOBIData structure loaded with MOBI data
- @param[in,out] text Memory area to be filled with decompressed output
- @param[in,out] file If not NULL output is written to the file, otherwise to text string
- @param[in,out] len Length of the memory allocated for the text string, on return set to decompressed text length
+ @param[out] huffcdic On success set to parsed huff/cdic tables for huff/cdic compressed text, NULL otherwise
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-static MOBI_RET mobi_decompress_content(const MOBIData *m, char *text, FILE *file, size_t *len) {
-    int dump = false;
-    if (file != NULL) {
-        dump = true;
-    }
+static MOBI_RET mobi_init_text(const MOBIData *m, MOBIHuffCdic **huffcdic) {
+    *huffcdic = NULL;
     if (m == NULL) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
@@ -1810,257 +1859,1188 @@ static MOBI_RET mobi_decompress_content(const MOBIData *m, char *text, FILE *fil
         debug_print("%s", "Document is encrypted\n");
         return MOBI_FILE_ENCRYPTED;
     }
-    const size_t offset = mobi_get_kf8offset(m);
     if (m->rh == NULL || m->rh->text_record_count == 0) {
         debug_print("%s", "Text records not found in MOBI header\n");
         return MOBI_DATA_CORRUPT;
     }
-    const size_t text_rec_index = 1 + offset;
-    size_t text_rec_count = m->rh->text_record_count;
+    if (m->rh->compression_type == MOBI_COMPRESSION_HUFFCDIC) {
+        MOBIInternals *internals = m->internals;
+        size_t huff_record = MOBI_NOTSET;
+        if (m->mh && m->mh->huff_rec_index) {
+            huff_record = *m->mh->huff_rec_index + mobi_get_kf8offset(m);
+        }
+        mobi_lock_textcache(m);
+        MOBIHuffCdic *cached = NULL;
+        size_t slot = MOBI_HUFFCDIC_CACHE_SIZE;
+        for (size_t i = 0; internals && i < MOBI_HUFFCDIC_CACHE_SIZE; i++) {
+            if (internals->huffcdic[i] && internals->huffcdic_record[i] == huff_record) {
+                cached = internals->huffcdic[i];
+                break;
+            }
+            if (internals->huffcdic[i] == NULL && slot == MOBI_HUFFCDIC_CACHE_SIZE) {
+                slot = i;
+            }
+        }
+        if (cached == NULL) {
+            /* load huff/cdic tables */
+            MOBIHuffCdic *parsed = mobi_init_huffcdic();
+            if (parsed == NULL) {
+                mobi_unlock_textcache(m);
+                debug_print("%s\n", "Memory allocation failed");
+                return MOBI_MALLOC_FAILED;
+            }
+            const MOBI_RET ret = mobi_parse_huffdic(m, parsed);
+            if (ret != MOBI_SUCCESS) {
+                mobi_unlock_textcache(m);
+                mobi_free_huffcdic(parsed);
+                return ret;
+            }
+            if (slot == MOBI_HUFFCDIC_CACHE_SIZE) {
+                /* tables are not cached, caller owns them */
+                mobi_unlock_textcache(m);
+                *huffcdic = parsed;
+                return MOBI_SUCCESS;
+            }
+            internals->huffcdic[slot] = parsed;
+            internals->huffcdic_record[slot] = huff_record;
+            cached = parsed;
+        }
+        MOBIHuffCdic *copy = malloc(sizeof(MOBIHuffCdic));
+        if (copy == NULL) {
+            mobi_unlock_textcache(m);
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        /* tables are shared, symbols cache is moved to the copy */
+        *copy = *cached;
+        cached->cache_offsets = NULL;
+        cached->cache_lengths = NULL;
+        cached->cache_data = NULL;
+        cached->cache_size = 0;
+        cached->cache_maxlen = 0;
+        mobi_unlock_textcache(m);
+        *huffcdic = copy;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Release huff/cdic tables returned by mobi_init_text()
+ 
+ Tables cached in internals are kept and get back cache of decompressed symbols,
+ unless other reader has already returned its cache. Tables that are not cached are freed.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] huffcdic MOBIHuffCdic structure or NULL
+ */
+static void mobi_release_text(const MOBIData *m, MOBIHuffCdic *huffcdic) {
+    if (huffcdic == NULL) {
+        return;
+    }
+    const MOBIInternals *internals = m->internals;
+    mobi_lock_textcache(m);
+    for (size_t i = 0; internals && i < MOBI_HUFFCDIC_CACHE_SIZE; i++) {
+        MOBIHuffCdic *cached = internals->huffcdic[i];
+        if (cached && cached->symbols == huffcdic->symbols) {
+            if (cached->cache_offsets == NULL) {
+                mobi_free_huffcdic_cache(cached);
+                cached->cache_offsets = huffcdic->cache_offsets;
+                cached->cache_lengths = huffcdic->cache_lengths;
+                cached->cache_data = huffcdic->cache_data;
+                cached->cache_size = huffcdic->cache_size;
+                cached->cache_maxlen = huffcdic->cache_maxlen;
+            } else {
+                mobi_free_huffcdic_cache(huffcdic);
+            }
+            mobi_unlock_textcache(m);
+            free(huffcdic);
+            return;
+        }
+    }
+    mobi_unlock_textcache(m);
+    mobi_free_huffcdic(huffcdic);
+}
+
+/**
+ @brief Make sure buffer has at least given size
+ 
+ @param[in,out] buffer Buffer, reallocated if needed
+ @param[in,out] buffer_size Size of the buffer
+ @param[in] size Required size
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_text_buffer_reserve(unsigned char **buffer, size_t *buffer_size, const size_t size) {
+    if (*buffer != NULL && *buffer_size >= size) {
+        return MOBI_SUCCESS;
+    }
+    unsigned char *tmp = realloc(*buffer, size > 0 ? size : 1);
+    if (tmp == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    *buffer = tmp;
+    *buffer_size = size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Decrypt and decompress single text record into given memory area
+ 
+ Record data is not modified. Encrypted record is decrypted into scratch buffer
+ and decompressed from there.
+ If output memory area is NULL, record is decompressed into scratch buffer.
+ Scratch buffer may be reused between calls, it is enlarged if needed.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in,out] curr Text record
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed huff/cdic data, NULL for other compression types
+ @param[in,out] buffer Scratch buffer, may point to NULL, must be freed by caller
+ @param[in,out] buffer_size Size of the scratch buffer
+ @param[in,out] out Memory area for decompressed data or NULL
+ @param[in] out_size Size of the memory area, at least mobi_get_textrecord_maxsize() if it is not NULL
+ @param[out] decompressed_size On success set to decompressed data size, zero for empty record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decompress_record_to(const MOBIData *m, const MOBIPdbRecord *curr, MOBIHuffCdic *huffcdic, unsigned char **buffer, size_t *buffer_size, unsigned char *out, size_t out_size, size_t *decompressed_size) {
+    *decompressed_size = 0;
     const uint16_t compression_type = m->rh->compression_type;
     /* check for extra data at the end of text files */
     uint16_t extra_flags = 0;
     if (m->mh && m->mh->extra_flags) {
         extra_flags = *m->mh->extra_flags;
     }
-    /* get first text record */
-    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, text_rec_index);
-    MOBIHuffCdic *huffcdic = NULL;
-    if (compression_type == MOBI_COMPRESSION_HUFFCDIC) {
-        /* load huff/cdic tables */
-        huffcdic = mobi_init_huffcdic();
-        if (huffcdic == NULL) {
-            debug_print("%s\n", "Memory allocation failed");
-            return MOBI_MALLOC_FAILED;
+    size_t extra_size = 0;
+    if (extra_flags) {
+        extra_size = mobi_get_record_extrasize(curr, extra_flags);
+        if (extra_size == MOBI_NOTSET) {
+            return MOBI_DATA_CORRUPT;
+        }
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    const unsigned char *data = curr->data;
+#ifdef USE_ENCRYPTION
+    if (mobi_is_encrypted(m) && mobi_has_drmkey(m)) {
+        if (compression_type != MOBI_COMPRESSION_HUFFCDIC) {
+            /* decrypt also multibyte extra data */
+            extra_size = mobi_get_record_extrasize(curr, extra_flags & 0xfffe);
         }
-        MOBI_RET ret = mobi_parse_huffdic(m, huffcdic);
+        if (extra_size == MOBI_NOTSET || extra_size > curr->size) {
+            return MOBI_DATA_CORRUPT;
+        }
+        const size_t decrypt_size = curr->size - extra_size;
+        /* decrypted copy of record follows decompressed data if both are kept in scratch buffer */
+        const size_t offset = out ? 0 : mobi_get_textrecord_maxsize(m);
+        ret = mobi_text_buffer_reserve(buffer, buffer_size, offset + curr->size);
         if (ret != MOBI_SUCCESS) {
-            mobi_free_huffcdic(huffcdic);
             return ret;
         }
-    }
-    /* get following CDIC records */
-    size_t text_length = 0;
-    while (text_rec_count-- && curr) {
-        size_t extra_size = 0;
-        if (extra_flags) {
-            extra_size = mobi_get_record_extrasize(curr, extra_flags);
-            if (extra_size == MOBI_NOTSET) {
-                mobi_free_huffcdic(huffcdic);
-                return MOBI_DATA_CORRUPT;
+        unsigned char *decrypted = *buffer + offset;
+        if (decrypt_size) {
+            ret = mobi_buffer_decrypt(decrypted, curr->data, decrypt_size, m);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
             }
         }
-        size_t decompressed_size = mobi_get_textrecord_maxsize(m);
-        unsigned char *decompressed = malloc(decompressed_size);
-        if (decompressed == NULL) {
-            mobi_free_huffcdic(huffcdic);
-            debug_print("Memory allocation failed%s", "\n");
-            return MOBI_MALLOC_FAILED;
-        }
-        MOBI_RET ret = MOBI_SUCCESS;
-#ifdef USE_ENCRYPTION
-        if (mobi_is_encrypted(m) && mobi_has_drmkey(m)) {
-            if (compression_type != MOBI_COMPRESSION_HUFFCDIC) {
-                /* decrypt also multibyte extra data */
-                extra_size = mobi_get_record_extrasize(curr, extra_flags & 0xfffe);
-            }
-            if (extra_size == MOBI_NOTSET || extra_size > curr->size) {
-                mobi_free_huffcdic(huffcdic);
-                free(decompressed);
+        /* trailing entries are not encrypted */
+        memcpy(decrypted + decrypt_size, curr->data + decrypt_size, extra_size);
+        data = decrypted;
+        if (compression_type != MOBI_COMPRESSION_HUFFCDIC && (extra_flags & 1)) {
+            // update multibyte data size after decryption
+            MOBIPdbRecord decrypted_record = *curr;
+            decrypted_record.data = decrypted;
+            extra_size = mobi_get_record_extrasize(&decrypted_record, extra_flags);
+            if (extra_size == MOBI_NOTSET) {
                 return MOBI_DATA_CORRUPT;
             }
-            const size_t decrypt_size = curr->size - extra_size;
-            if (decrypt_size > decompressed_size) {
-                if (decrypt_size <= curr->size) {
-                    unsigned char *tmp = realloc(decompressed, decrypt_size);
-                    if (tmp == NULL) {
-                        debug_print("%s\n", "Memory allocation failed");
-                        mobi_free_huffcdic(huffcdic);
-                        free(decompressed);
-                        return MOBI_MALLOC_FAILED;
-                    }
-                    decompressed = tmp;
-                } else {
-                    debug_print("Record too large: %zu\n", decrypt_size);
-                    mobi_free_huffcdic(huffcdic);
-                    free(decompressed);
-                    return MOBI_DATA_CORRUPT;
-                }
-            }
-            if (decrypt_size) {
-                ret = mobi_buffer_decrypt(decompressed, curr->data, decrypt_size, m);
-                if (ret != MOBI_SUCCESS) {
-                    mobi_free_huffcdic(huffcdic);
-                    free(decompressed);
-                    return ret;
-                }
-                memcpy(curr->data, decompressed, decrypt_size);
-            }
-            if (compression_type != MOBI_COMPRESSION_HUFFCDIC && (extra_flags & 1)) {
-                // update multibyte data size after decryption
-                extra_size = mobi_get_record_extrasize(curr, extra_flags);
-                if (extra_size == MOBI_NOTSET) {
-                    free(decompressed);
-                    return MOBI_DATA_CORRUPT;
-                }
-            }
         }
+    }
 #endif
-        if (extra_size > curr->size) {
-            debug_print("Wrong record size: -%zu\n", extra_size - curr->size);
-            mobi_free_huffcdic(huffcdic);
-            free(decompressed);
-            return MOBI_DATA_CORRUPT;
-        }
-        if (extra_size == curr->size) {
-            debug_print("Skipping empty record%s", "\n");
-            free(decompressed);
-            curr = curr->next;
-            continue;
+    if (extra_size > curr->size) {
+        debug_print("Wrong record size: -%zu\n", extra_size - curr->size);
+        return MOBI_DATA_CORRUPT;
+    }
+    if (extra_size == curr->size) {
+        debug_print("Skipping empty record%s", "\n");
+        return MOBI_SUCCESS;
+    }
+    const size_t record_size = curr->size - extra_size;
+    if (out == NULL) {
+        out_size = mobi_get_textrecord_maxsize(m);
+        ret = mobi_text_buffer_reserve(buffer, buffer_size, out_size);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
         }
-        const size_t record_size = curr->size - extra_size;
-        switch (compression_type) {
-            case MOBI_COMPRESSION_NONE:
-                /* no compression */
-                if (record_size > decompressed_size) {
-                    debug_print("Record too large: %zu\n", record_size);
-                    free(decompressed);
-                    return MOBI_DATA_CORRUPT;
-                }
-                memcpy(decompressed, curr->data, record_size);
-                decompressed_size = record_size;
-                if (mobi_exists_mobiheader(m) && mobi_get_fileversion(m) <= 3) {
-                    /* workaround for some old files with null characters inside record */
-                    mobi_remove_zeros(decompressed, &decompressed_size);
-                }
-                break;
-            case MOBI_COMPRESSION_PALMDOC:
-                /* palmdoc lz77 compression */
-                ret = mobi_decompress_lz77(decompressed, curr->data, &decompressed_size, record_size);
-                if (ret != MOBI_SUCCESS) {
-                    free(decompressed);
-                    return ret;
-                }
-                break;
-            case MOBI_COMPRESSION_HUFFCDIC:
-                /* mobi huffman compression */
-                ret = mobi_decompress_huffman(decompressed, curr->data, &decompressed_size, record_size, huffcdic);
-                if (ret != MOBI_SUCCESS) {
-                    free(decompressed);
-                    mobi_free_huffcdic(huffcdic);
-                    return ret;
-                }
-                break;
-            default:
-                debug_print("%s", "Unknown compression type\n");
-                mobi_free_huffcdic(huffcdic);
-                free(decompressed);
+        out = *buffer;
+    }
+    switch (compression_type) {
+        case MOBI_COMPRESSION_NONE:
+            /* no compression */
+            if (record_size > out_size) {
+                debug_print("Record too large: %zu\n", record_size);
                 return MOBI_DATA_CORRUPT;
-        }
-        curr = curr->next;
-        if (dump) {
-            fwrite(decompressed, 1, decompressed_size, file);
-        } else {
-            if (text_length + decompressed_size > *len) {
-                debug_print("%s", "Text buffer too small\n");
-                /* free huff/cdic tables */
-                mobi_free_huffcdic(huffcdic);
-                free(decompressed);
-                return MOBI_PARAM_ERR;
             }
-            memcpy(text + text_length, decompressed, decompressed_size);
-            text_length += decompressed_size;
-            text[text_length] = '\0';
-        }
-        free(decompressed);
+            memcpy(out, data, record_size);
+            out_size = record_size;
+            if (mobi_exists_mobiheader(m) && mobi_get_fileversion(m) <= 3) {
+                /* workaround for some old files with null characters inside record */
+                mobi_remove_zeros(out, &out_size);
+            }
+            break;
+        case MOBI_COMPRESSION_PALMDOC:
+            /* palmdoc lz77 compression */
+            ret = mobi_decompress_lz77(out, data, &out_size, record_size);
+            break;
+        case MOBI_COMPRESSION_HUFFCDIC:
+            /* mobi huffman compression */
+            ret = mobi_decompress_huffman(out, data, &out_size, record_size, huffcdic);
+            break;
+        default:
+            debug_print("%s", "Unknown compression type\n");
+            ret = MOBI_DATA_CORRUPT;
     }
-    /* free huff/cdic tables */
-    mobi_free_huffcdic(huffcdic);
-    if (len) {
-        *len = text_length;
+    if (ret != MOBI_SUCCESS) {
+        return ret;
     }
+    *decompressed_size = out_size;
     return MOBI_SUCCESS;
 }
 
 /**
- @brief Decompress text to a text buffer.
+ @brief Decrypt and decompress single text record
+ 
+ Record data is not modified.
+ Buffer may be reused between calls, it is enlarged if needed.
  
  @param[in] m MOBIData structure loaded with MOBI data
- @param[in,out] text Memory area to be filled with decompressed output
- @param[in,out] len Length of the memory allocated for the text string, on return will be set to decompressed text length
+ @param[in,out] curr Text record
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed huff/cdic data, NULL for other compression types
+ @param[in,out] buffer Buffer for decompressed data, may point to NULL, must be freed by caller
+ @param[in,out] buffer_size Size of the buffer
+ @param[out] decompressed_size On success set to decompressed data size, zero for empty record
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_get_rawml(const MOBIData *m, char *text, size_t *len) {
-    if (text == NULL || len == NULL) {
-        debug_print("%s", "Parameter error: text or len is NULL\n");
-        return MOBI_PARAM_ERR;
-    }
-    if (m->rh->text_length > *len) {
-        debug_print("%s", "Text buffer smaller then text size declared in record0 header\n");
-        return MOBI_PARAM_ERR;
-    }
-    text[0] = '\0';
-    return mobi_decompress_content(m, text, NULL, len);
+static MOBI_RET mobi_decompress_record(const MOBIData *m, MOBIPdbRecord *curr, MOBIHuffCdic *huffcdic, unsigned char **buffer, size_t *buffer_size, size_t *decompressed_size) {
+    return mobi_decompress_record_to(m, curr, huffcdic, buffer, buffer_size, NULL, 0, decompressed_size);
 }
 
 /**
- @brief Decompress text record to an open file descriptor.
- 
- Internal function for mobi_get_rawml and mobi_dump_rawml.
- Decompressed output is stored either in a file or in a text string
+ @brief Append decompressed record data to output
  
- @param[in] m MOBIData structure loaded with MOBI data
- @param[in,out] file File descriptor
+ @param[in] data Decompressed data
+ @param[in] size Size of decompressed data
+ @param[in,out] text Memory area to be filled with decompressed output
+ @param[in,out] file If not NULL output is written to the file, otherwise to text string
+ @param[in,out] text_length Length of text already written to text string
+ @param[in] len Length of the memory allocated for the text string
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file) {
-    if (file == NULL) {
-        debug_print("%s", "File descriptor is NULL\n");
-        return MOBI_FILE_NOT_FOUND;
+static MOBI_RET mobi_decompress_output(const unsigned char *data, const size_t size, char *text, FILE *file, size_t *text_length, const size_t len) {
+    if (file != NULL) {
+        fwrite(data, 1, size, file);
+        return MOBI_SUCCESS;
     }
-    return mobi_decompress_content(m, NULL, file, NULL);
+    if (*text_length + size > len) {
+        debug_print("%s", "Text buffer too small\n");
+        return MOBI_PARAM_ERR;
+    }
+    memcpy(text + *text_length, data, size);
+    *text_length += size;
+    text[*text_length] = '\0';
+    return MOBI_SUCCESS;
 }
 
+#ifdef HAVE_PTHREAD
 /**
- @brief Check if MOBI header is loaded / present in the loaded file
- 
- @param[in] m MOBIData structure loaded with MOBI data
- @return true on success, false otherwise
+ @brief Text records shared by parallel decompression workers
  */
-bool mobi_exists_mobiheader(const MOBIData *m) {
-    if (m == NULL || m->mh == NULL) {
-        return false;
-    }
-    return true;
-}
+typedef struct {
+    const MOBIData *m; /**< MOBIData structure loaded with MOBI data */
+    const MOBIHuffCdic *huffcdic; /**< Parsed huff/cdic data, shared read-only, NULL for other compression types */
+    MOBIPdbRecord **records; /**< Text records */
+    unsigned char **data; /**< Slots for decompressed data of each record */
+    size_t *sizes; /**< Sizes of decompressed data of each record */
+    size_t count; /**< Count of text records */
+    size_t next; /**< Index of next record to be decompressed */
+    size_t error_index; /**< Index of first failed record */
+    MOBI_RET ret; /**< Status of first failed record */
+    pthread_mutex_t lock; /**< Lock for next, error_index and ret */
+} MOBIDecompressJob;
 
 /**
- @brief Check if skeleton INDX is present in the loaded file
+ @brief Parallel decompression worker
  
- @param[in] m MOBIData structure loaded with MOBI data
- @return true on success, false otherwise
+ Decompresses records until all are taken or any record fails.
+ Worker uses its own copy of huff/cdic structure, symbols cache is not shared.
+ 
+ @param[in,out] arg MOBIDecompressJob structure
+ @return NULL
  */
-bool mobi_exists_skel_indx(const MOBIData *m) {
-    if (!mobi_exists_mobiheader(m)) {
-        return false;
+static void * mobi_decompress_worker(void *arg) {
+    MOBIDecompressJob *job = arg;
+    MOBIHuffCdic *huffcdic = NULL;
+    if (job->huffcdic) {
+        huffcdic = malloc(sizeof(MOBIHuffCdic));
+        if (huffcdic == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            pthread_mutex_lock(&job->lock);
+            if (job->ret == MOBI_SUCCESS) {
+                job->ret = MOBI_MALLOC_FAILED;
+                job->error_index = 0;
+            }
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+        /* tables are shared, cache is private */
+        *huffcdic = *job->huffcdic;
+        huffcdic->cache_offsets = NULL;
+        huffcdic->cache_lengths = NULL;
+        huffcdic->cache_data = NULL;
+        huffcdic->cache_size = 0;
+        huffcdic->cache_maxlen = 0;
+    }
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        if (job->next >= job->count || job->ret != MOBI_SUCCESS) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        const size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        size_t buffer_size = 0;
+        const MOBI_RET ret = mobi_decompress_record(job->m, job->records[i], huffcdic, &job->data[i], &buffer_size, &job->sizes[i]);
+        if (ret != MOBI_SUCCESS) {
+            pthread_mutex_lock(&job->lock);
+            if (job->ret == MOBI_SUCCESS || i < job->error_index) {
+                job->ret = ret;
+                job->error_index = i;
+            }
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
     }
-    if (m->mh->skeleton_index == NULL || *m->mh->skeleton_index == MOBI_NOTSET) {
-        debug_print("%s", "SKEL INDX record not found\n");
-        return false;
+    if (huffcdic) {
+        mobi_free_huffcdic_cache(huffcdic);
+        free(huffcdic);
     }
-    return true;
+    return NULL;
 }
 
 /**
- @brief Check if FDST record is present in the loaded file
+ @brief Decompress text records in parallel
+ 
+ Records are decrypted and decompressed by worker threads into separate slots,
+ slots are then written to output in records order.
  
  @param[in] m MOBIData structure loaded with MOBI data
- @return true on success, false otherwise
+ @param[in] first First text record
+ @param[in] count Count of text records
+ @param[in] huffcdic MOBIHuffCdic structure with parsed huff/cdic data, NULL for other compression types
+ @param[in] threads Number of worker threads
+ @param[in,out] text Memory area to be filled with decompressed output
+ @param[in,out] file If not NULL output is written to the file, otherwise to text string
+ @param[in,out] len Length of the memory allocated for the text string, on return set to decompressed text length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-bool mobi_exists_fdst(const MOBIData *m) {
-    if (!mobi_exists_mobiheader(m) || mobi_get_fileversion(m) <= 3) {
-        return false;
-    }
+static MOBI_RET mobi_decompress_content_parallel(const MOBIData *m, MOBIPdbRecord *first, size_t count, const MOBIHuffCdic *huffcdic, size_t threads, char *text, FILE *file, size_t *len) {
+    MOBIDecompressJob job;
+    job.m = m;
+    job.huffcdic = huffcdic;
+    job.records = malloc(count * sizeof(*job.records));
+    job.data = calloc(count, sizeof(*job.data));
+    job.sizes = calloc(count, sizeof(*job.sizes));
+    pthread_t *workers = malloc(threads * sizeof(*workers));
+    if (job.records == NULL || job.data == NULL || job.sizes == NULL || workers == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        free(job.records);
+        free(job.data);
+        free(job.sizes);
+        free(workers);
+        return MOBI_MALLOC_FAILED;
+    }
+    /* records data is loaded here, workers only process loaded records */
+    MOBIPdbRecord *curr = first;
+    size_t loaded = 0;
+    while (loaded < count && curr) {
+        job.records[loaded++] = curr;
+        curr = mobi_get_record_next(m, curr);
+    }
+    job.count = loaded;
+    job.next = 0;
+    job.error_index = 0;
+    job.ret = MOBI_SUCCESS;
+    if (threads > loaded) {
+        threads = loaded;
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (pthread_mutex_init(&job.lock, NULL) != 0) {
+        debug_print("%s\n", "Mutex initialization failed");
+        ret = MOBI_INIT_FAILED;
+    } else {
+        /* calling thread is one of workers */
+        size_t started = 0;
+        while (started + 1 < threads && pthread_create(&workers[started], NULL, mobi_decompress_worker, &job) == 0) {
+            started++;
+        }
+        mobi_decompress_worker(&job);
+        for (size_t i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        pthread_mutex_destroy(&job.lock);
+        ret = job.ret;
+    }
+    size_t text_length = 0;
+    for (size_t i = 0; i < job.count; i++) {
+        if (ret == MOBI_SUCCESS && job.data[i]) {
+            ret = mobi_decompress_output(job.data[i], job.sizes[i], text, file, &text_length, len ? *len : 0);
+        }
+        free(job.data[i]);
+    }
+    free(job.records);
+    free(job.data);
+    free(job.sizes);
+    free(workers);
+    if (ret == MOBI_SUCCESS && len) {
+        *len = text_length;
+    }
+    return ret;
+}
+#endif
+
+/**
+ @brief Decompress text record (internal).
+ 
+ Internal function for mobi_get_rawml and mobi_dump_rawml. 
+ Decompressed output is stored either in a file or in a text string.
+ Records are decompressed directly into the text string while it has space for a whole record.
+ If more than one thread is set with mobi_set_threads(), records are decompressed in parallel.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in,out] text Memory area to be filled with decompressed output
+ @param[in,out] file If not NULL output is written to the file, otherwise to text string
+ @param[in,out] len Length of the memory allocated for the text string, on return set to decompressed text length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decompress_content(const MOBIData *m, char *text, FILE *file, size_t *len) {
+    MOBIHuffCdic *huffcdic;
+    MOBI_RET ret = mobi_init_text(m, &huffcdic);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    size_t text_rec_count = m->rh->text_record_count;
+    /* get first text record */
+    MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+#ifdef HAVE_PTHREAD
+    const MOBIInternals *internals = m->internals;
+    const size_t threads = internals ? internals->threads : 0;
+    if (threads > 1 && text_rec_count > 1) {
+        ret = mobi_decompress_content_parallel(m, curr, text_rec_count, huffcdic, threads, text, file, len);
+        mobi_release_text(m, huffcdic);
+        return ret;
+    }
+#endif
+    size_t text_length = 0;
+    const size_t record_maxsize = mobi_get_textrecord_maxsize(m);
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    while (text_rec_count-- && curr) {
+        size_t decompressed_size;
+        if (text && *len - text_length >= record_maxsize) {
+            /* enough space left, decompress directly into text */
+            ret = mobi_decompress_record_to(m, curr, huffcdic, &buffer, &buffer_size, (unsigned char *) text + text_length, record_maxsize, &decompressed_size);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+            text_length += decompressed_size;
+            text[text_length] = '\0';
+            curr = mobi_get_record_next(m, curr);
+            continue;
+        }
+        ret = mobi_decompress_record(m, curr, huffcdic, &buffer, &buffer_size, &decompressed_size);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        curr = mobi_get_record_next(m, curr);
+        if (decompressed_size == 0) {
+            continue;
+        }
+        ret = mobi_decompress_output(buffer, decompressed_size, text, file, &text_length, len ? *len : 0);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+    }
+    free(buffer);
+    /* free huff/cdic tables */
+    mobi_release_text(m, huffcdic);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    if (len) {
+        *len = text_length;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Set number of worker threads used for text decompression
+ 
+ With more than one thread text records are decrypted and decompressed in parallel
+ by mobi_get_rawml() and mobi_dump_rawml(), and decrypted or encrypted in parallel
+ by mobi_drm_decrypt() and mobi_drm_encrypt().
+ Setting is shared by both parts of hybrid file and kept when document is loaded.
+ If library is built without pthreads support text is always decompressed sequentially.
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] threads Number of threads, 0 or 1 for sequential decompression
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_set_threads(MOBIData *m, const size_t threads) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    MOBIInternals *internals = mobi_init_internals(m);
+    if (internals == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    internals->threads = threads;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Decompress text to a text buffer.
+ 
+ Text of the same document may be decompressed by several threads at once,
+ as long as the document is not modified meanwhile and its records are loaded
+ (not loaded on demand with mobi_load_filename_lazy() or mobi_load_file_part()).
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in,out] text Memory area to be filled with decompressed output
+ @param[in,out] len Length of the memory allocated for the text string, on return will be set to decompressed text length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_rawml(const MOBIData *m, char *text, size_t *len) {
+    if (text == NULL || len == NULL) {
+        debug_print("%s", "Parameter error: text or len is NULL\n");
+        return MOBI_PARAM_ERR;
+    }
+    if (m->rh->text_length > *len) {
+        debug_print("%s", "Text buffer smaller then text size declared in record0 header\n");
+        return MOBI_PARAM_ERR;
+    }
+    text[0] = '\0';
+    return mobi_decompress_content(m, text, NULL, len);
+}
+
+/**
+ @brief Decompress text record to an open file descriptor.
+ 
+ Internal function for mobi_get_rawml and mobi_dump_rawml.
+ Decompressed output is stored either in a file or in a text string.
+ Concurrent use is restricted as for mobi_get_rawml().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in,out] file File descriptor
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file) {
+    if (file == NULL) {
+        debug_print("%s", "File descriptor is NULL\n");
+        return MOBI_FILE_NOT_FOUND;
+    }
+    return mobi_decompress_content(m, NULL, file, NULL);
+}
+
+/**
+ @brief Decompress text record with given number
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] number Number of text record, starting from zero
+ @param[in] huffcdic MOBIHuffCdic structure with parsed huff/cdic data, NULL for other compression types
+ @param[in,out] buffer Buffer for decompressed data, may point to NULL, must be freed by caller
+ @param[in,out] buffer_size Size of the buffer
+ @param[out] decompressed_size On success set to decompressed data size
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decompress_text_record(const MOBIData *m, const size_t number, MOBIHuffCdic *huffcdic, unsigned char **buffer, size_t *buffer_size, size_t *decompressed_size) {
+    MOBIPdbRecord *record = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m) + number);
+    if (record == NULL) {
+        debug_print("Text record %zu not found\n", number);
+        return MOBI_DATA_CORRUPT;
+    }
+    return mobi_decompress_record(m, record, huffcdic, buffer, buffer_size, decompressed_size);
+}
+
+/**
+ @brief Check whether offsets map stored in internals can be used
+ 
+ Must be called with text cache lock held.
+ 
+ @param[in] internals MOBIInternals structure
+ @param[in] first Sequential number of first text record
+ @param[in] count Count of text records
+ @param[in] exact If true, only map of real records sizes is accepted
+ @return True if map can be used
+ */
+static bool mobi_text_offsets_match(const MOBIInternals *internals, const size_t first, const size_t count, const bool exact) {
+    return internals->text_offsets && internals->text_offsets_record == first && internals->text_offsets_count == count
+        && (internals->text_offsets_exact || !exact);
+}
+
+/**
+ @brief Get map of text records offsets in rawml
+ 
+ Map is built on first use and stored in internals.
+ For compressed documents with consistent header it is calculated from declared text record size,
+ every text record but the last one decompresses to exactly this size.
+ Uncompressed records may be shrunk (old files with null characters inside records),
+ so for uncompressed or inconsistent documents all records are copied or decompressed
+ to find their real sizes.
+ Map is built without holding text cache lock, the lock is taken only to install it.
+ If other reader installed matching map in the meantime, that map is used.
+ Function must be called without text cache lock, it returns with the lock held (also on failure).
+ Map may be replaced by following calls, caller must keep the lock as long as it uses returned offsets
+ and then release it with mobi_unlock_textcache().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] huffcdic MOBIHuffCdic structure with parsed huff/cdic data, NULL for other compression types
+ @param[in] exact If true, map calculated from declared size is replaced with map of real sizes
+ @param[out] offsets On success set to array of text records count plus one offsets, last offset is rawml length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_get_text_offsets(const MOBIData *m, MOBIHuffCdic *huffcdic, const bool exact, const size_t **offsets) {
+    mobi_lock_textcache(m);
+    MOBIInternals *internals = m->internals;
+    if (internals == NULL) {
+        debug_print("%s", "Document not loaded\n");
+        return MOBI_INIT_FAILED;
+    }
+    const size_t first = 1 + mobi_get_kf8offset(m);
+    const size_t count = m->rh->text_record_count;
+    if (mobi_text_offsets_match(internals, first, count, exact)) {
+        *offsets = internals->text_offsets;
+        return MOBI_SUCCESS;
+    }
+    mobi_unlock_textcache(m);
+    size_t *map = malloc((count + 1) * sizeof(*map));
+    if (map == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        mobi_lock_textcache(m);
+        return MOBI_MALLOC_FAILED;
+    }
+    const size_t record_size = m->rh->text_record_size;
+    const size_t text_length = m->rh->text_length;
+    bool map_exact = exact;
+    if (!map_exact && m->rh->compression_type == MOBI_COMPRESSION_NONE) {
+        /* declared size is not reliable, getting real sizes requires only copying records */
+        map_exact = true;
+    }
+    if (!map_exact && (record_size == 0 || text_length > record_size * count || text_length <= record_size * (count - 1))) {
+        debug_print("%s", "Text length inconsistent with declared record size\n");
+        map_exact = true;
+    }
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    map[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t size;
+        if (map_exact) {
+            const MOBI_RET ret = mobi_decompress_text_record(m, i, huffcdic, &buffer, &buffer_size, &size);
+            if (ret != MOBI_SUCCESS) {
+                free(buffer);
+                free(map);
+                mobi_lock_textcache(m);
+                return ret;
+            }
+        } else {
+            size = (i + 1 < count) ? record_size : text_length - map[i];
+        }
+        map[i + 1] = map[i] + size;
+    }
+    free(buffer);
+    mobi_lock_textcache(m);
+    if (mobi_text_offsets_match(internals, first, count, map_exact)) {
+        /* other reader installed map in the meantime */
+        free(map);
+        *offsets = internals->text_offsets;
+        return MOBI_SUCCESS;
+    }
+    free(internals->text_offsets);
+    internals->text_offsets = map;
+    internals->text_offsets_count = count;
+    internals->text_offsets_record = first;
+    internals->text_offsets_exact = map_exact;
+    *offsets = map;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Find text record containing given rawml offset
+ 
+ @param[in] offsets Map of text records offsets
+ @param[in] count Count of text records
+ @param[in] offset Offset in rawml, must be less than rawml length
+ @return Number of text record, starting from zero
+ */
+static size_t mobi_find_text_record(const size_t *offsets, const size_t count, const size_t offset) {
+    size_t low = 0;
+    size_t high = count;
+    /* find last record starting at or before offset */
+    while (high - low > 1) {
+        const size_t mid = low + (high - low) / 2;
+        if (offsets[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    /* skip empty records */
+    while (low + 1 < count && offsets[low + 1] <= offset) {
+        low++;
+    }
+    return low;
+}
+
+/**
+ @brief Decompress single text record
+ 
+ Only the requested record is decompressed.
+ Concurrent use is restricted as for mobi_get_rawml().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] number Number of text record, starting from zero
+ @param[in,out] out Memory area to be filled with decompressed record, at least mobi_get_textrecord_maxsize() bytes
+ @param[in,out] len Length of the memory area, on return set to decompressed record length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_text_record(const MOBIData *m, const size_t number, char *out, size_t *len) {
+    if (out == NULL || len == NULL) {
+        debug_print("%s", "Parameter error: out or len is NULL\n");
+        return MOBI_PARAM_ERR;
+    }
+    MOBIHuffCdic *huffcdic;
+    MOBI_RET ret = mobi_init_text(m, &huffcdic);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    if (number >= m->rh->text_record_count) {
+        debug_print("Text record %zu out of range\n", number);
+        mobi_release_text(m, huffcdic);
+        return MOBI_PARAM_ERR;
+    }
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    size_t decompressed_size;
+    ret = mobi_decompress_text_record(m, number, huffcdic, &buffer, &buffer_size, &decompressed_size);
+    mobi_release_text(m, huffcdic);
+    if (ret == MOBI_SUCCESS) {
+        if (decompressed_size > *len) {
+            debug_print("%s", "Text buffer too small\n");
+            ret = MOBI_PARAM_ERR;
+        } else {
+            memcpy(out, buffer, decompressed_size);
+            *len = decompressed_size;
+        }
+    }
+    free(buffer);
+    return ret;
+}
+
+/**
+ @brief Find text record containing given rawml offset
+ 
+ Offsets map is built on first use from declared text record size,
+ or from real records sizes for uncompressed documents and if header values are inconsistent.
+ Concurrent use is restricted as for mobi_get_rawml().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] offset Offset in rawml
+ @param[out] number Number of text record, starting from zero
+ @param[out] start Rawml offset of the record start, may be NULL
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_PARAM_ERR if offset is beyond rawml
+ */
+MOBI_RET mobi_get_text_record_number(const MOBIData *m, const size_t offset, size_t *number, size_t *start) {
+    if (number == NULL) {
+        debug_print("%s", "Parameter error: number is NULL\n");
+        return MOBI_PARAM_ERR;
+    }
+    MOBIHuffCdic *huffcdic;
+    MOBI_RET ret = mobi_init_text(m, &huffcdic);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    const size_t *offsets;
+    ret = mobi_get_text_offsets(m, huffcdic, false, &offsets);
+    if (ret == MOBI_SUCCESS) {
+        const size_t count = m->rh->text_record_count;
+        if (offset >= offsets[count]) {
+            debug_print("Offset %zu beyond text length %zu\n", offset, offsets[count]);
+            ret = MOBI_PARAM_ERR;
+        } else {
+            *number = mobi_find_text_record(offsets, count, offset);
+            if (start) {
+                *start = offsets[*number];
+            }
+        }
+    }
+    mobi_unlock_textcache(m);
+    mobi_release_text(m, huffcdic);
+    return ret;
+}
+
+/**
+ @brief Decompress range of rawml text
+ 
+ Only text records covering the range are decompressed.
+ If decompressed record size does not match offsets map built from header,
+ map is rebuilt from real records sizes.
+ Concurrent use is restricted as for mobi_get_rawml().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] start Offset of the range start in rawml
+ @param[in] end Offset of the range end in rawml (exclusive)
+ @param[in,out] out Memory area to be filled with decompressed text, at least (end - start) bytes, not null terminated
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_PARAM_ERR if range is beyond rawml
+ */
+MOBI_RET mobi_get_rawml_range(const MOBIData *m, const size_t start, const size_t end, char *out) {
+    if (out == NULL || start > end) {
+        debug_print("%s", "Parameter error: out is NULL or wrong range\n");
+        return MOBI_PARAM_ERR;
+    }
+    MOBIHuffCdic *huffcdic;
+    MOBI_RET ret = mobi_init_text(m, &huffcdic);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    const size_t count = m->rh->text_record_count;
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    size_t *range_offsets = NULL;
+    bool exact = false;
+    bool retry = true;
+    while (retry) {
+        retry = false;
+        /* copy offsets of records in range, shared map may be replaced by other readers */
+        const size_t *offsets;
+        size_t first = 0;
+        size_t range_count = 0;
+        ret = mobi_get_text_offsets(m, huffcdic, exact, &offsets);
+        if (ret == MOBI_SUCCESS && end > offsets[count]) {
+            debug_print("Range end %zu beyond text length %zu\n", end, offsets[count]);
+            ret = MOBI_PARAM_ERR;
+        }
+        if (ret == MOBI_SUCCESS && start < end) {
+            first = mobi_find_text_record(offsets, count, start);
+            while (first + range_count < count && offsets[first + range_count] < end) {
+                range_count++;
+            }
+            free(range_offsets);
+            range_offsets = malloc((range_count + 1) * sizeof(*range_offsets));
+            if (range_offsets == NULL) {
+                debug_print("%s\n", "Memory allocation failed");
+                ret = MOBI_MALLOC_FAILED;
+            } else {
+                memcpy(range_offsets, offsets + first, (range_count + 1) * sizeof(*range_offsets));
+            }
+        }
+        mobi_unlock_textcache(m);
+        if (ret != MOBI_SUCCESS || start == end) {
+            break;
+        }
+        for (size_t i = 0; i < range_count; i++) {
+            size_t decompressed_size;
+            ret = mobi_decompress_text_record(m, first + i, huffcdic, &buffer, &buffer_size, &decompressed_size);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+            if (decompressed_size != range_offsets[i + 1] - range_offsets[i]) {
+                if (exact) {
+                    debug_print("Wrong size of text record %zu: %zu\n", first + i, decompressed_size);
+                    ret = MOBI_DATA_CORRUPT;
+                } else {
+                    debug_print("Text record %zu size differs from declared, rebuilding offsets map\n", first + i);
+                    exact = true;
+                    retry = true;
+                }
+                break;
+            }
+            const size_t copy_start = max(range_offsets[i], start);
+            const size_t copy_end = min(range_offsets[i + 1], end);
+            if (copy_end > copy_start) {
+                memcpy(out + (copy_start - start), buffer + (copy_start - range_offsets[i]), copy_end - copy_start);
+            }
+        }
+    }
+    free(range_offsets);
+    free(buffer);
+    mobi_release_text(m, huffcdic);
+    return ret;
+}
+
+/**
+ @brief Initialize iterator over decompressed text records
+ 
+ Iterator yields rawml text record by record, decompressed data of all records
+ is stored in a single reusable buffer.
+ Document must not be modified or freed while iterator is in use.
+ Several iterators may read the same document from different threads,
+ concurrent use is restricted as for mobi_get_rawml().
+ It must be freed with mobi_free_rawml_iter().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return MOBIRawmlIter on success, NULL otherwise
+ */
+MOBIRawmlIter * mobi_init_rawml_iter(const MOBIData *m) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return NULL;
+    }
+    MOBIRawmlIter *it = calloc(1, sizeof(MOBIRawmlIter));
+    if (it == NULL) {
+        debug_print("%s", "Memory allocation for rawml iterator failed\n");
+        return NULL;
+    }
+    it->m = m;
+    it->ret = MOBI_SUCCESS;
+    return it;
+}
+
+/**
+ @brief Get decompressed data of next text record
+ 
+ Returned data is valid until next call or until iterator is freed. It is not null terminated.
+ Empty records are skipped. After last record data is set to NULL and length to zero.
+ On failure the same error is returned by all further calls.
+ 
+ @param[in,out] it MOBIRawmlIter iterator
+ @param[out] data Decompressed record data, NULL after last record
+ @param[out] len Length of decompressed record data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_rawml_iter_next(MOBIRawmlIter *it, const char **data, size_t *len) {
+    if (it == NULL || data == NULL || len == NULL) {
+        debug_print("%s", "Parameter error: it, data or len is NULL\n");
+        return MOBI_PARAM_ERR;
+    }
+    *data = NULL;
+    *len = 0;
+    if (it->ret != MOBI_SUCCESS) {
+        return it->ret;
+    }
+    if (!it->initialized) {
+        it->ret = mobi_init_text(it->m, &it->huffcdic);
+        if (it->ret != MOBI_SUCCESS) {
+            return it->ret;
+        }
+        it->count = it->m->rh->text_record_count;
+        it->initialized = true;
+    }
+    const size_t first = 1 + mobi_get_kf8offset(it->m);
+    while (it->next < it->count) {
+        MOBIPdbRecord *record = mobi_get_record_by_seqnumber(it->m, first + it->next);
+        if (record == NULL) {
+            /* same as whole text decompression, stop at missing record */
+            it->next = it->count;
+            break;
+        }
+        it->next++;
+        size_t size;
+        it->ret = mobi_decompress_record(it->m, record, it->huffcdic, &it->buffer, &it->buffer_size, &size);
+        if (it->ret != MOBI_SUCCESS) {
+            return it->ret;
+        }
+        if (size > 0) {
+            *data = (const char *) it->buffer;
+            *len = size;
+            break;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free MOBIRawmlIter iterator
+ 
+ @param[in] it MOBIRawmlIter iterator
+ */
+void mobi_free_rawml_iter(MOBIRawmlIter *it) {
+    if (it == NULL) {
+        return;
+    }
+    mobi_release_text(it->m, it->huffcdic);
+    free(it->buffer);
+    free(it);
+}
+
+/**
+ @brief Append view of text data to views array
+ 
+ @param[in,out] views Array of views, reallocated if needed
+ @param[in,out] count Count of views in array
+ @param[in,out] allocated Count of allocated array elements
+ @param[in] data Text data
+ @param[in] size Size of text data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_add_rawml_view(MOBIRawmlView **views, size_t *count, size_t *allocated, const unsigned char *data, const size_t size) {
+    if (size == 0) {
+        return MOBI_SUCCESS;
+    }
+    if (*count == *allocated) {
+        const size_t new_allocated = *allocated ? 2 * *allocated : 16;
+        MOBIRawmlView *tmp = realloc(*views, new_allocated * sizeof(MOBIRawmlView));
+        if (tmp == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        *views = tmp;
+        *allocated = new_allocated;
+    }
+    (*views)[*count].data = data;
+    (*views)[*count].size = size;
+    (*count)++;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get rawml text of uncompressed document as a list of views into records data
+ 
+ Nothing is copied, views point to text data inside records, with trailing entries trimmed.
+ Concatenated views are equal to text returned by mobi_get_rawml().
+ Empty records are skipped, null characters inside records of old documents
+ (file version 3 and lower) are skipped by splitting record into several views.
+ Only unencrypted documents without compression are supported.
+ Views are valid until the document is modified or freed.
+ Array of views must be freed with mobi_free_rawml_views().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] views On success set to array of views, NULL if text is empty
+ @param[out] count On success set to count of views
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_FILE_UNSUPPORTED for compressed documents
+ */
+MOBI_RET mobi_get_rawml_views(const MOBIData *m, MOBIRawmlView **views, size_t *count) {
+    if (views == NULL || count == NULL) {
+        debug_print("%s", "Parameter error: views or count is NULL\n");
+        return MOBI_PARAM_ERR;
+    }
+    *views = NULL;
+    *count = 0;
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (mobi_is_encrypted(m)) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    if (m->rh->compression_type != MOBI_COMPRESSION_NONE) {
+        debug_print("%s", "Views are supported only for uncompressed text\n");
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    uint16_t extra_flags = 0;
+    if (m->mh && m->mh->extra_flags) {
+        extra_flags = *m->mh->extra_flags;
+    }
+    const bool skip_zeros = mobi_exists_mobiheader(m) && mobi_get_fileversion(m) <= 3;
+    const size_t max_size = mobi_get_textrecord_maxsize(m);
+    size_t text_rec_count = m->rh->text_record_count;
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    size_t allocated = 0;
+    MOBI_RET ret = MOBI_SUCCESS;
+    while (text_rec_count-- && curr) {
+        size_t extra_size = 0;
+        if (extra_flags) {
+            extra_size = mobi_get_record_extrasize(curr, extra_flags);
+        }
+        if (extra_size == MOBI_NOTSET || extra_size > curr->size) {
+            debug_print("%s", "Wrong record size\n");
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        const size_t record_size = curr->size - extra_size;
+        if (record_size > max_size) {
+            debug_print("Record too large: %zu\n", record_size);
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        const unsigned char *data = curr->data;
+        const unsigned char *end = data + record_size;
+        if (skip_zeros) {
+            /* workaround for some old files with null characters inside record */
+            const unsigned char *zero;
+            while (ret == MOBI_SUCCESS && (zero = memchr(data, 0, (size_t) (end - data))) != NULL) {
+                ret = mobi_add_rawml_view(views, count, &allocated, data, (size_t) (zero - data));
+                data = zero + 1;
+            }
+        }
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_add_rawml_view(views, count, &allocated, data, (size_t) (end - data));
+        }
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        curr = mobi_get_record_next(m, curr);
+    }
+    if (ret != MOBI_SUCCESS) {
+        free(*views);
+        *views = NULL;
+        *count = 0;
+    }
+    return ret;
+}
+
+/**
+ @brief Free array of views returned by mobi_get_rawml_views()
+ 
+ @param[in] views Array of views
+ */
+void mobi_free_rawml_views(MOBIRawmlView *views) {
+    free(views);
+}
+
+/**
+ @brief Check if MOBI header is loaded / present in the loaded file
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return true on success, false otherwise
+ */
+bool mobi_exists_mobiheader(const MOBIData *m) {
+    if (m == NULL || m->mh == NULL) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ @brief Check if skeleton INDX is present in the loaded file
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return true on success, false otherwise
+ */
+bool mobi_exists_skel_indx(const MOBIData *m) {
+    if (!mobi_exists_mobiheader(m)) {
+        return false;
+    }
+    if (m->mh->skeleton_index == NULL || *m->mh->skeleton_index == MOBI_NOTSET) {
+        debug_print("%s", "SKEL INDX record not found\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ @brief Check if FDST record is present in the loaded file
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return true on success, false otherwise
+ */
+bool mobi_exists_fdst(const MOBIData *m) {
+    if (!mobi_exists_mobiheader(m) || mobi_get_fileversion(m) <= 3) {
+        return false;
+    }
     if (mobi_get_fileversion(m) >= 8) {
         if (m->mh->fdst_index && *m->mh->fdst_index != MOBI_NOTSET) {
             return true;
@@ -2750,7 +3730,7 @@ bool mobi_has_drmkey(const MOBIData *m) {
         debug_print("%s", "Mobi structure not initialized\n");
         return false;
     }
-    MOBIDrm *drm = m->internals;
+    const MOBIDrm *drm = mobi_drm_get(m);
     return drm != NULL && drm->key != NULL;
 #else
     UNUSED(m);
@@ -2770,7 +3750,7 @@ bool mobi_has_drmcookies(const MOBIData *m) {
         debug_print("%s", "Mobi structure not initialized\n");
         return false;
     }
-    MOBIDrm *drm = m->internals;
+    const MOBIDrm *drm = mobi_drm_get(m);
     return drm != NULL && drm->cookies_count > 0;
 #else
     UNUSED(m);
@@ -2790,7 +3770,7 @@ bool mobi_is_replica(const MOBIData *m) {
         return false;
     }
     if (m->rec && m->rh && m->rh->compression_type == MOBI_COMPRESSION_NONE) {
-        MOBIPdbRecord *rec = m->rec->next;
+        const MOBIPdbRecord *rec = mobi_get_record_by_seqnumber(m, 1);
         if (rec && rec->size >= sizeof(REPLICA_MAGIC)) {
             return memcmp(rec->data, REPLICA_MAGIC, sizeof(REPLICA_MAGIC) - 1) == 0;
         }
@@ -3344,6 +4324,12 @@ MOBI_RET mobi_remove_part_kf8(MOBIData *m) {
             if (curr->data && curr->size > 4 &&
                 (memcmp(curr->data, FONT_MAGIC, 4) == 0 ||
                  memcmp(curr->data, RESC_MAGIC, 4) == 0)) {
+                if (mobi_recdata_is_shared(m, curr)) {
+                    /* data in file image, just truncate */
+                    curr->size = 4;
+                    curr = mobi_get_record_next(m, curr);
+                    continue;
+                }
                 unsigned char *tmp = realloc(curr->data, 4);
                 if (tmp == NULL) {
                     debug_print("%s\n", "Memory allocation failed");
@@ -3352,7 +4338,7 @@ MOBI_RET mobi_remove_part_kf8(MOBIData *m) {
                 curr->data = tmp;
                 curr->size = 4;
             }
-            curr = curr->next;
+            curr = mobi_get_record_next(m, curr);
         }
     }
     
@@ -3504,31 +4490,110 @@ MOBI_RET mobi_drm_setkey(MOBIData *m, const char *pid) {
 }
 
 /**
- @brief Remove PID stored for encryption from MOBIData structure
+ @brief Store key for encryption in MOBIData stucture using device key ring
+ 
+ In case of encrypted document its vouchers are matched with key ring PIDs.
+ Device PIDs are looked up by key checksum, book PIDs derived from key ring serials
+ and document EXTH records are calculated once and cached in key ring.
+ In case of unencrypted document vouchers are added for all device PIDs in key ring.
+ Key ring may be used with many documents, also from many threads,
+ but must not be modified meanwhile.
  
  @param[in,out] m MOBIData structure with raw data and metadata
+ @param[in,out] ring Key ring
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_drm_delkey(MOBIData *m) {
+MOBI_RET mobi_drm_setkey_keyring(MOBIData *m, MOBIKeyRing *ring) {
 #ifdef USE_ENCRYPTION
-    return mobi_drmkey_delete(m);
+    return mobi_drmkey_set_keyring(m, ring);
 #else
     UNUSED(m);
+    UNUSED(ring);
     debug_print("Libmobi compiled without encryption support%s", "\n");
     return MOBI_DRM_UNSUPPORTED;
 #endif
 }
 
 /**
- @brief Free internals
+ @brief Initialize empty device key ring
+ 
+ Key ring is filled with mobi_keyring_addpid() and mobi_keyring_addserial()
+ and used with mobi_drm_setkey_keyring().
+ Must be freed with mobi_free_keyring().
+ 
+ @return Key ring, NULL on failure or if libmobi was compiled without encryption support
+ */
+MOBIKeyRing * mobi_init_keyring(void) {
+#ifdef USE_ENCRYPTION
+    return mobi_keyring_new();
+#else
+    debug_print("Libmobi compiled without encryption support%s", "\n");
+    return NULL;
+#endif
+}
 
+/**
+ @brief Add PID to device key ring
+ 
+ @param[in,out] ring Key ring
+ @param[in] pid PID
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_keyring_addpid(MOBIKeyRing *ring, const char *pid) {
+#ifdef USE_ENCRYPTION
+    return mobi_keyring_pid_add(ring, pid);
+#else
+    UNUSED(ring);
+    UNUSED(pid);
+    debug_print("Libmobi compiled without encryption support%s", "\n");
+    return MOBI_DRM_UNSUPPORTED;
+#endif
+}
+
+/**
+ @brief Add device serial number to device key ring
+ 
+ @param[in,out] ring Key ring
+ @param[in] serial Device serial number
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_keyring_addserial(MOBIKeyRing *ring, const char *serial) {
+#ifdef USE_ENCRYPTION
+    return mobi_keyring_serial_add(ring, serial);
+#else
+    UNUSED(ring);
+    UNUSED(serial);
+    debug_print("Libmobi compiled without encryption support%s", "\n");
+    return MOBI_DRM_UNSUPPORTED;
+#endif
+}
+
+/**
+ @brief Free device key ring
+ 
+ @param[in] ring Key ring
+ */
+void mobi_free_keyring(MOBIKeyRing *ring) {
+#ifdef USE_ENCRYPTION
+    mobi_keyring_delete(ring);
+#else
+    UNUSED(ring);
+#endif
+}
+
+/**
+ @brief Remove PID stored for encryption from MOBIData structure
+ 
  @param[in,out] m MOBIData structure with raw data and metadata
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-void mobi_free_internals(MOBIData *m) {
+MOBI_RET mobi_drm_delkey(MOBIData *m) {
 #ifdef USE_ENCRYPTION
-    mobi_free_drm(m);
+    return mobi_drmkey_delete(m);
 #else
     UNUSED(m);
+    debug_print("Libmobi compiled without encryption support%s", "\n");
+    return MOBI_DRM_UNSUPPORTED;
 #endif
 }
 
@@ -127,6 +127,20 @@
 
 #define MOBI_TITLE_SIZEMAX 1024
 
+/**
+ @brief Iterator over decompressed text records
+ */
+struct MOBIRawmlIter {
+    const MOBIData *m; /**< MOBIData structure loaded with MOBI data */
+    MOBIHuffCdic *huffcdic; /**< Parsed huff/cdic data, NULL for other compression types */
+    unsigned char *buffer; /**< Scratch buffer holding data of current record */
+    size_t buffer_size; /**< Size of scratch buffer */
+    size_t next; /**< Number of next text record, starting from zero */
+    size_t count; /**< Count of text records */
+    bool initialized; /**< True after text was checked and huff/cdic tables were loaded */
+    MOBI_RET ret; /**< Status of failed iteration, further calls return it */
+};
+
 int mobi_bitcount(const uint8_t byte);
 MOBI_RET mobi_delete_record_by_seqnumber(MOBIData *m, const size_t num);
 MOBI_RET mobi_swap_mobidata(MOBIData *m);
@@ -149,9 +163,9 @@ void mobi_remove_zeros(unsigned char *buffer, size_t *len);
 MOBI_RET mobi_add_audio_resource(MOBIPart *part);
 MOBI_RET mobi_add_video_resource(MOBIPart *part);
 MOBI_RET mobi_add_font_resource(MOBIPart *part);
+MOBIPdbRecord * mobi_get_record_next(const MOBIData *m, const MOBIPdbRecord *record);
 MOBI_RET mobi_set_fullname(MOBIData *m, const char *fullname);
 MOBI_RET mobi_set_pdbname(MOBIData *m, const char *name);
-void mobi_free_internals(MOBIData *m);
 uint32_t mobi_get32be(const unsigned char buf[4]);
 uint32_t mobi_get32le(const unsigned char buf[4]);
 #endif
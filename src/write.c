@@ -421,9 +421,7 @@ MOBI_RET mobi_update_record0(MOBIData *m, const size_t seqnumber) {
     memcpy(data, buf->data, buf->offset);
     record0->size = buf->offset;
     mobi_buffer_free(buf);
-    if (record0->data) {
-        free(record0->data);
-    }
+    mobi_free_recdata(m, record0);
     record0->data = data;
     return MOBI_SUCCESS;
 }
@@ -450,8 +448,15 @@ MOBI_RET mobi_write_records(FILE *file, const MOBIData *m) {
     uint32_t offset = (uint32_t) pos;
     /* 8 bytes per record meta plus 2 bytes padding */
     offset += 8 * m->ph->rec_count + 2;
+    /* uids are rewritten before any record info is written */
     MOBIPdbRecord *curr = m->rec;
     uint32_t i = 0;
+    while (curr) {
+        curr->uid = 2 * i++;
+        curr = curr->next;
+    }
+    mobi_rebuild_recdir_uids(m);
+    curr = m->rec;
     while (curr) {
         if (offset > UINT32_MAX) {
             return MOBI_DATA_CORRUPT;
@@ -463,7 +468,6 @@ MOBI_RET mobi_write_records(FILE *file, const MOBIData *m) {
         mobi_buffer_add32(buf, (uint32_t) offset);
         offset += curr->size;
         mobi_buffer_add8(buf, curr->attributes);
-        curr->uid = 2 * i++;
         const uint8_t h = (uint8_t) ((curr->uid & 0xff0000U) >> 16);
         const uint16_t l = (uint16_t) (curr->uid & 0xffffU);
         mobi_buffer_add8(buf, h);
@@ -488,6 +492,10 @@ MOBI_RET mobi_write_records(FILE *file, const MOBIData *m) {
     
     curr = m->rec;
     while (curr) {
+        MOBI_RET ret = mobi_load_recdata_lazy(m, curr);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
         written = fwrite(curr->data, 1, curr->size, file);
         if (written != curr->size) {
             debug_print("Writing failed (%s)\n", strerror(errno));
@@ -0,0 +1,445 @@
+/** @file drm_keyring.c
+ *
+ * @brief Test of device key ring
+ *
+ * Sets decryption keys with mobi_drm_setkey_keyring() for documents
+ * encrypted with device PID, book PID derived from device serial
+ * and tamperproof EXTH records, and default key. Checks that unknown keys
+ * are not matched and that matching still works when more documents
+ * with distinct tamperproof records are used than key ring caches.
+ *
+ * Book PIDs are calculated here independently of the library,
+ * so the test is built with sha1.c from library sources.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mobi.h"
+#include "sha1.h"
+
+#define SKIP 77
+
+#ifdef USE_ENCRYPTION
+
+#define SAMPLE_V2 TEST_SAMPLES "/sample-drm_pidLTKULBB^5V-v2.mobi"
+#define SAMPLE_V2_PID "LTKULBB*5V"
+#define SAMPLE_PLAIN TEST_SAMPLES "/sample-obfuscated-fonts.mobi"
+#define PIDSIZE 10
+/* serials used for encryption */
+#define SERIAL "B001XXXXXXXXXXXX"
+#define SERIAL_OTHER "B002XXXXXXXXXXXX"
+/* serial never used for encryption */
+#define SERIAL_UNKNOWN "B003XXXXXXXXXXXX"
+/* valid PID never used for encryption */
+#define PID_UNKNOWN "TESTPID12U"
+/* must match number of book PID variants cached by key ring in encryption.c */
+#define KEYRING_VARIANTS_MAX 1024
+
+/**
+ @brief Byte array
+ */
+typedef struct {
+    unsigned char *data; /**< Data */
+    size_t size; /**< Size of data */
+} TestBytes;
+
+/**
+ @brief CRC-32 as used in PID checksum
+
+ @param[in] data Data
+ @param[in] size Data size
+ @return Checksum
+ */
+static uint32_t pid_crc32(const unsigned char *data, const size_t size) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (size_t j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
+
+/**
+ @brief Calculate book PID from device serial and tamperproof message
+
+ @param[out] pid Book PID
+ @param[in] serial Device serial
+ @param[in] message Tamperproof message
+ @param[in] message_size Message size
+ */
+static void book_pid(char pid[PIDSIZE + 1], const char *serial, const unsigned char *message, const size_t message_size) {
+    SHA1_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, (const uint8_t *) serial, strlen(serial));
+    if (message_size) {
+        SHA1_Update(&ctx, message, message_size);
+    }
+    uint8_t hash[SHA1_DIGEST_SIZE];
+    SHA1_Final(&ctx, hash);
+    uint64_t val = 0;
+    for (size_t i = 0; i < 8; i++) {
+        val = (val << 8) | hash[i];
+    }
+    const char map[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < PIDSIZE - 2; i++) {
+        pid[i] = map[val >> 58];
+        val <<= 6;
+    }
+    const char checksum_map[] = "ABCDEFGHIJKLMNPQRSTUVWXYZ123456789";
+    const uint8_t checksum_map_length = sizeof(checksum_map) - 1;
+    uint32_t crc = pid_crc32((const unsigned char *) pid, PIDSIZE - 2);
+    crc ^= (crc >> 16);
+    for (size_t i = 0; i < 2; i++) {
+        const uint8_t b = crc & 0xff;
+        const uint8_t pos = (b / checksum_map_length) ^ (b % checksum_map_length);
+        pid[PIDSIZE - 2 + i] = checksum_map[pos % checksum_map_length];
+        crc >>= 8;
+    }
+    pid[PIDSIZE] = '\0';
+}
+
+/**
+ @brief Get tamperproof message from EXTH records
+
+ Message is EXTH_TAMPERKEYS record followed by data of records it lists,
+ it is empty if document has no such record.
+
+ @param[out] message Message, data must be freed by caller
+ @param[in] m MOBIData structure
+ @return 0 on success, 1 on failure
+ */
+static int tamperproof_message(TestBytes *message, const MOBIData *m) {
+    message->data = NULL;
+    message->size = 0;
+    const MOBIExthHeader *keys = mobi_get_exthrecord_by_tag(m, EXTH_TAMPERKEYS);
+    if (keys == NULL) {
+        return 0;
+    }
+    if (keys->size % 5) {
+        return 1;
+    }
+    size_t size = keys->size;
+    for (size_t i = 0; i < keys->size; i += 5) {
+        const unsigned char *p = (const unsigned char *) keys->data + i + 1;
+        const uint32_t tag = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+        const MOBIExthHeader *record = mobi_get_exthrecord_by_tag(m, (MOBIExthTag) tag);
+        if (record) {
+            size += record->size;
+        }
+    }
+    message->data = malloc(size);
+    if (message->data == NULL) {
+        return 1;
+    }
+    memcpy(message->data, keys->data, keys->size);
+    message->size = keys->size;
+    for (size_t i = 0; i < keys->size; i += 5) {
+        const unsigned char *p = (const unsigned char *) keys->data + i + 1;
+        const uint32_t tag = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+        const MOBIExthHeader *record = mobi_get_exthrecord_by_tag(m, (MOBIExthTag) tag);
+        if (record) {
+            memcpy(message->data + message->size, record->data, record->size);
+            message->size += record->size;
+        }
+    }
+    return 0;
+}
+
+/**
+ @brief Write document and load it again
+
+ @param[in,out] m MOBIData structure
+ @return Reloaded document, NULL on failure
+ */
+static MOBIData * reload(MOBIData *m) {
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        return NULL;
+    }
+    MOBIData *reloaded = mobi_init();
+    if (reloaded == NULL || mobi_write_file(file, m) != MOBI_SUCCESS
+        || fseek(file, 0, SEEK_SET) != 0 || mobi_load_file(reloaded, file) != MOBI_SUCCESS) {
+        mobi_free(reloaded);
+        reloaded = NULL;
+    }
+    fclose(file);
+    return reloaded;
+}
+
+/**
+ @brief Load document from byte array
+
+ @param[in] bytes Document data
+ @return Document, NULL on failure
+ */
+static MOBIData * load_bytes(const TestBytes *bytes) {
+    MOBIData *m = mobi_init();
+    if (m && mobi_load_buffer(m, bytes->data, bytes->size, MOBI_LOAD_COPY) != MOBI_SUCCESS) {
+        mobi_free(m);
+        m = NULL;
+    }
+    return m;
+}
+
+/**
+ @brief Read file into byte array
+
+ @param[out] bytes File data, must be freed by caller
+ @param[in] path File path
+ @return 0 on success, 1 on failure
+ */
+static int read_bytes(TestBytes *bytes, const char *path) {
+    bytes->data = NULL;
+    bytes->size = 0;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 1;
+    }
+    int result = 1;
+    long size;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        bytes->size = (size_t) size;
+        bytes->data = malloc(bytes->size);
+        if (bytes->data && fread(bytes->data, 1, bytes->size, file) == bytes->size) {
+            result = 0;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+/**
+ @brief Encrypt copy of unencrypted document
+
+ If watermark is set, it is added to EXTH records and secured with tamperproof keys.
+ Document is encrypted with voucher for book PID of serial if it is set,
+ with voucher for device serial if it is set, and with default key if none is set.
+
+ @param[in] plain Unencrypted document data
+ @param[in] watermark Watermark or NULL
+ @param[in] serial Serial for device PID voucher or NULL
+ @param[in] book_serial Serial for book PID voucher or NULL
+ @return Encrypted document reloaded from written data, NULL on failure
+ */
+static MOBIData * encrypt_copy(const TestBytes *plain, const char *watermark, const char *serial, const char *book_serial) {
+    MOBIData *m = load_bytes(plain);
+    if (m == NULL) {
+        return NULL;
+    }
+    MOBIData *encrypted = NULL;
+    TestBytes message = { NULL, 0 };
+    MOBIExthTag tags[] = { EXTH_WATERMARK };
+    const size_t tags_count = watermark ? 1 : 0;
+    if (watermark && mobi_add_exthrecord(m, EXTH_WATERMARK, (uint32_t) strlen(watermark), watermark) != MOBI_SUCCESS) {
+        goto cleanup;
+    }
+    if ((serial || !book_serial) && mobi_drm_addvoucher(m, serial, -1, -1, tags, tags_count) != MOBI_SUCCESS) {
+        goto cleanup;
+    }
+    if (book_serial) {
+        /* voucher for other serial only adds tamperproof keys */
+        if (serial == NULL && mobi_drm_addvoucher(m, SERIAL_OTHER, -1, -1, tags, tags_count) != MOBI_SUCCESS) {
+            goto cleanup;
+        }
+        char pid[PIDSIZE + 1];
+        if (tamperproof_message(&message, m) != 0) {
+            goto cleanup;
+        }
+        book_pid(pid, book_serial, message.data, message.size);
+        if (mobi_drm_setkey(m, pid) != MOBI_SUCCESS) {
+            goto cleanup;
+        }
+    }
+    if (mobi_drm_encrypt(m) == MOBI_SUCCESS) {
+        encrypted = reload(m);
+    }
+cleanup:
+    free(message.data);
+    mobi_free(m);
+    return encrypted;
+}
+
+/**
+ @brief Set key with key ring and decrypt
+
+ @param[in,out] m Encrypted document
+ @param[in] ring Key ring
+ @return MOBI_RET status code of setting key, or of decryption if key was set
+ */
+static MOBI_RET keyring_decrypt(MOBIData *m, MOBIKeyRing *ring) {
+    MOBI_RET ret = mobi_drm_setkey_keyring(m, ring);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_drm_decrypt(m);
+    }
+    if (ret == MOBI_SUCCESS && mobi_is_encrypted(m)) {
+        ret = MOBI_DRM_KEYNOTFOUND;
+    }
+    return ret;
+}
+
+/**
+ @brief Create key ring with given PIDs and serials
+
+ @param[in] pids PIDs, NULL terminated
+ @param[in] serials Serials, NULL terminated
+ @return Key ring, NULL on failure
+ */
+static MOBIKeyRing * keyring_create(const char **pids, const char **serials) {
+    MOBIKeyRing *ring = mobi_init_keyring();
+    if (ring == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; pids && pids[i]; i++) {
+        if (mobi_keyring_addpid(ring, pids[i]) != MOBI_SUCCESS) {
+            mobi_free_keyring(ring);
+            return NULL;
+        }
+    }
+    for (size_t i = 0; serials && serials[i]; i++) {
+        if (mobi_keyring_addserial(ring, serials[i]) != MOBI_SUCCESS) {
+            mobi_free_keyring(ring);
+            return NULL;
+        }
+    }
+    return ring;
+}
+
+/**
+ @brief Check key ring match on document
+
+ @param[in] name Test name
+ @param[in] m Encrypted document, freed on return
+ @param[in] pids Key ring PIDs, NULL terminated
+ @param[in] serials Key ring serials, NULL terminated
+ @param[in] expected Expected status code
+ @return 0 on success, 1 on failure
+ */
+static int check_match(const char *name, MOBIData *m, const char **pids, const char **serials, const MOBI_RET expected) {
+    int result = 1;
+    MOBIKeyRing *ring = keyring_create(pids, serials);
+    if (m == NULL || ring == NULL) {
+        printf("%s: initialization failed\n", name);
+    } else {
+        const MOBI_RET ret = keyring_decrypt(m, ring);
+        if (ret != expected) {
+            printf("%s: unexpected result %i (expected %i)\n", name, ret, expected);
+        } else {
+            printf("%s: ok\n", name);
+            result = 0;
+        }
+    }
+    mobi_free_keyring(ring);
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Check matching book PIDs of more documents than key ring caches
+
+ Every document has distinct tamperproof message, so each of them needs
+ its own book PID variant. Documents beyond cache limit must still match,
+ documents cached earlier must match again.
+
+ @param[in] plain Unencrypted document data
+ @return 0 on success, 1 on failure
+ */
+static int check_variants_max(const TestBytes *plain) {
+    const size_t count = KEYRING_VARIANTS_MAX + 4;
+    const char *serials[] = { SERIAL_UNKNOWN, SERIAL, NULL };
+    MOBIKeyRing *ring = keyring_create(NULL, serials);
+    if (ring == NULL) {
+        return 1;
+    }
+    int result = 0;
+    for (size_t i = 0; result == 0 && i < count + 2; i++) {
+        /* last two documents repeat first and last watermarks */
+        const size_t n = i < count ? i : (i == count ? 0 : count - 1);
+        char watermark[32];
+        snprintf(watermark, sizeof(watermark), "watermark-%zu", n);
+        MOBIData *m = encrypt_copy(plain, watermark, NULL, SERIAL);
+        if (m == NULL) {
+            printf("Variants: encryption of document %zu failed\n", n);
+            result = 1;
+            break;
+        }
+        /* decrypting is slow, key is enough for most documents */
+        const bool decrypt = (n == 0 || n >= KEYRING_VARIANTS_MAX - 1);
+        const MOBI_RET ret = decrypt ? keyring_decrypt(m, ring) : mobi_drm_setkey_keyring(m, ring);
+        if (ret != MOBI_SUCCESS) {
+            printf("Variants: document %zu not matched (%i)\n", n, ret);
+            result = 1;
+        }
+        mobi_free(m);
+    }
+    if (result == 0) {
+        printf("Variants: %zu documents matched\n", count);
+    }
+    mobi_free_keyring(ring);
+    return result;
+}
+
+/**
+ @brief Run key ring tests
+
+ @return 0 on success, 1 on failure
+ */
+static int check_keyring(void) {
+    TestBytes plain;
+    if (read_bytes(&plain, SAMPLE_PLAIN) != 0) {
+        printf("Loading %s failed\n", SAMPLE_PLAIN);
+        free(plain.data);
+        return 1;
+    }
+    int result = 0;
+    const char *pids[] = { PID_UNKNOWN, SAMPLE_V2_PID, NULL };
+    const char *pids_unknown[] = { PID_UNKNOWN, NULL };
+    const char *serials[] = { SERIAL_UNKNOWN, SERIAL, NULL };
+    const char *serials_unknown[] = { SERIAL_UNKNOWN, NULL };
+    MOBIData *m = mobi_init();
+    if (m && mobi_load_filename(m, SAMPLE_V2) != MOBI_SUCCESS) {
+        mobi_free(m);
+        m = NULL;
+    }
+    result |= check_match("Device PID", m, pids, NULL, MOBI_SUCCESS);
+    result |= check_match("Device serial", encrypt_copy(&plain, NULL, SERIAL, NULL), NULL, serials, MOBI_SUCCESS);
+    result |= check_match("Book PID", encrypt_copy(&plain, "watermark", NULL, SERIAL), pids_unknown, serials, MOBI_SUCCESS);
+    result |= check_match("Book PID without tamperproof keys", encrypt_copy(&plain, NULL, NULL, SERIAL), NULL, serials, MOBI_SUCCESS);
+    result |= check_match("Default key", encrypt_copy(&plain, NULL, NULL, NULL), pids_unknown, serials_unknown, MOBI_SUCCESS);
+    m = mobi_init();
+    if (m && mobi_load_filename(m, SAMPLE_V2) != MOBI_SUCCESS) {
+        mobi_free(m);
+        m = NULL;
+    }
+    result |= check_match("Unknown keys", m, pids_unknown, serials_unknown, MOBI_DRM_KEYNOTFOUND);
+    result |= check_match("Unknown book PID", encrypt_copy(&plain, "watermark", NULL, SERIAL), pids_unknown, serials_unknown, MOBI_DRM_KEYNOTFOUND);
+    result |= check_variants_max(&plain);
+    free(plain.data);
+    return result;
+}
+
+#endif /* USE_ENCRYPTION */
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure, 77 if encryption is disabled
+ */
+int main(void) {
+#ifdef USE_ENCRYPTION
+    return check_keyring();
+#else
+    printf("%s", "Encryption is disabled\n");
+    return SKIP;
+#endif
+}
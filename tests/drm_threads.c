@@ -0,0 +1,268 @@
+/** @file drm_threads.c
+ *
+ * @brief Test of parallel decryption and encryption
+ *
+ * Decrypts DRM samples sequentially and with several worker threads
+ * and compares written documents. Then encrypts decrypted documents
+ * with one number of threads, decrypts them with the other
+ * and compares text records with sequentially decrypted ones.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mobi.h"
+
+#define THREADS 4
+#define SERIAL "B001XXXXXXXXXXXX"
+#define SKIP 77
+
+#ifdef USE_ENCRYPTION
+
+/**
+ @brief Sample file with optional PID
+ */
+typedef struct {
+    const char *name; /**< File name in samples directory */
+    const char *pid; /**< PID for decryption or NULL */
+} TestSample;
+
+static const TestSample samples[] = {
+    { "sample-drm-v1.mobi", NULL },
+    { "sample-drm_pidLTKULBB^5V-v2.mobi", "LTKULBB*5V" },
+};
+
+/**
+ @brief Byte array
+ */
+typedef struct {
+    unsigned char *data; /**< Data */
+    size_t size; /**< Size of data */
+} TestBytes;
+
+/**
+ @brief Write document into byte array
+
+ @param[in,out] m MOBIData structure
+ @param[out] bytes Written document, data must be freed by caller
+ @return 0 on success, 1 on failure
+ */
+static int write_bytes(MOBIData *m, TestBytes *bytes) {
+    bytes->data = NULL;
+    bytes->size = 0;
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        return 1;
+    }
+    int result = 1;
+    if (mobi_write_file(file, m) != MOBI_SUCCESS || fseek(file, 0, SEEK_END) != 0) {
+        goto cleanup;
+    }
+    long size = ftell(file);
+    if (size <= 0) {
+        goto cleanup;
+    }
+    bytes->size = (size_t) size;
+    bytes->data = malloc(bytes->size);
+    if (bytes->data == NULL || fseek(file, 0, SEEK_SET) != 0
+        || fread(bytes->data, 1, bytes->size, file) != bytes->size) {
+        goto cleanup;
+    }
+    result = 0;
+cleanup:
+    fclose(file);
+    return result;
+}
+
+/**
+ @brief Concatenate text records of document
+
+ @param[in] m MOBIData structure
+ @param[out] bytes Text records, data must be freed by caller
+ @return 0 on success, 1 on failure
+ */
+static int text_bytes(const MOBIData *m, TestBytes *bytes) {
+    bytes->data = NULL;
+    bytes->size = 0;
+    if (m->rh == NULL || m->rec == NULL) {
+        return 1;
+    }
+    const MOBIPdbRecord *record = m->rec->next;
+    for (size_t i = 0; i < m->rh->text_record_count && record; i++) {
+        bytes->size += record->size;
+        record = record->next;
+    }
+    bytes->data = malloc(bytes->size);
+    if (bytes->data == NULL) {
+        return 1;
+    }
+    unsigned char *p = bytes->data;
+    record = m->rec->next;
+    for (size_t i = 0; i < m->rh->text_record_count && record; i++) {
+        if (record->data == NULL) {
+            return 1;
+        }
+        memcpy(p, record->data, record->size);
+        p += record->size;
+        record = record->next;
+    }
+    return 0;
+}
+
+/**
+ @brief Compare byte arrays
+
+ @param[in] a First array
+ @param[in] b Second array
+ @return True if equal
+ */
+static bool bytes_equal(const TestBytes *a, const TestBytes *b) {
+    return a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+/**
+ @brief Load and decrypt sample
+
+ @param[in] path Sample path
+ @param[in] pid PID or NULL
+ @param[in] threads Number of threads
+ @return Decrypted document, NULL on failure
+ */
+static MOBIData * load_decrypted(const char *path, const char *pid, const size_t threads) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return NULL;
+    }
+    if (mobi_set_threads(m, threads) != MOBI_SUCCESS
+        || mobi_load_filename(m, path) != MOBI_SUCCESS
+        || (pid && mobi_drm_setkey(m, pid) != MOBI_SUCCESS)
+        || mobi_drm_decrypt(m) != MOBI_SUCCESS) {
+        mobi_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+/**
+ @brief Encrypt document, reload it and decrypt
+
+ @param[in,out] m Decrypted document, encrypted on return
+ @param[in] encrypt_threads Number of threads for encryption
+ @param[in] decrypt_threads Number of threads for decryption
+ @param[in] expected Expected text records after decryption
+ @return 0 on success, 1 on failure
+ */
+static int check_roundtrip(MOBIData *m, const size_t encrypt_threads, const size_t decrypt_threads, const TestBytes *expected) {
+    TestBytes encrypted = { NULL, 0 };
+    TestBytes text = { NULL, 0 };
+    MOBIData *reloaded = NULL;
+    FILE *file = NULL;
+    int result = 1;
+    if (mobi_set_threads(m, encrypt_threads) != MOBI_SUCCESS
+        || mobi_drm_addvoucher(m, SERIAL, -1, -1, NULL, 0) != MOBI_SUCCESS
+        || mobi_drm_encrypt(m) != MOBI_SUCCESS) {
+        printf("Encryption with %zu threads failed\n", encrypt_threads);
+        goto cleanup;
+    }
+    if (text_bytes(m, &encrypted) != 0 || bytes_equal(&encrypted, expected)) {
+        printf("Encryption with %zu threads left text unchanged\n", encrypt_threads);
+        goto cleanup;
+    }
+    file = tmpfile();
+    reloaded = mobi_init();
+    if (file == NULL || reloaded == NULL || mobi_write_file(file, m) != MOBI_SUCCESS
+        || fseek(file, 0, SEEK_SET) != 0
+        || mobi_set_threads(reloaded, decrypt_threads) != MOBI_SUCCESS
+        || mobi_load_file(reloaded, file) != MOBI_SUCCESS
+        || mobi_drm_setkey_serial(reloaded, SERIAL) != MOBI_SUCCESS
+        || mobi_drm_decrypt(reloaded) != MOBI_SUCCESS) {
+        printf("Decryption with %zu threads of document encrypted with %zu threads failed\n", decrypt_threads, encrypt_threads);
+        goto cleanup;
+    }
+    if (text_bytes(reloaded, &text) != 0 || !bytes_equal(&text, expected)) {
+        printf("Round trip with %zu and %zu threads changed text\n", encrypt_threads, decrypt_threads);
+        goto cleanup;
+    }
+    result = 0;
+cleanup:
+    if (file) {
+        fclose(file);
+    }
+    mobi_free(reloaded);
+    free(encrypted.data);
+    free(text.data);
+    return result;
+}
+
+/**
+ @brief Compare parallel and sequential DRM operations on a sample
+
+ @param[in] sample Sample file
+ @return 0 on success, 1 on failure
+ */
+static int check_sample(const TestSample *sample) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", TEST_SAMPLES, sample->name);
+    int result = 1;
+    TestBytes sequential = { NULL, 0 };
+    TestBytes parallel = { NULL, 0 };
+    TestBytes text = { NULL, 0 };
+    MOBIData *m_sequential = load_decrypted(path, sample->pid, 1);
+    MOBIData *m_parallel = load_decrypted(path, sample->pid, THREADS);
+    if (m_sequential == NULL || m_parallel == NULL) {
+        printf("%s: decryption failed\n", sample->name);
+        goto cleanup;
+    }
+    if (write_bytes(m_sequential, &sequential) != 0 || write_bytes(m_parallel, &parallel) != 0
+        || text_bytes(m_sequential, &text) != 0) {
+        printf("%s: writing decrypted document failed\n", sample->name);
+        goto cleanup;
+    }
+    if (!bytes_equal(&sequential, &parallel)) {
+        printf("%s: parallel decryption differs\n", sample->name);
+        goto cleanup;
+    }
+    printf("%s: decrypted documents match (%zu bytes)\n", sample->name, parallel.size);
+    if (check_roundtrip(m_parallel, THREADS, 1, &text) != 0
+        || check_roundtrip(m_sequential, 1, THREADS, &text) != 0) {
+        printf("%s: round trip failed\n", sample->name);
+        goto cleanup;
+    }
+    printf("%s: round trips match (%zu bytes of text)\n", sample->name, text.size);
+    result = 0;
+cleanup:
+    mobi_free(m_sequential);
+    mobi_free(m_parallel);
+    free(sequential.data);
+    free(parallel.data);
+    free(text.data);
+    return result;
+}
+
+#endif /* USE_ENCRYPTION */
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure, 77 if encryption is disabled
+ */
+int main(void) {
+#ifdef USE_ENCRYPTION
+    int result = 0;
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        result |= check_sample(&samples[i]);
+    }
+    return result;
+#else
+    printf("%s", "Encryption is disabled\n");
+    return SKIP;
+#endif
+}
@@ -0,0 +1,191 @@
+/** @file fuzz_lz77.c
+ *
+ * @brief Fuzz equivalence test of PalmDOC LZ77 decompressor
+ *
+ * Compares mobi_decompress_lz77() with reference byte by byte
+ * implementation (previous MOBIBuffer based decompressor)
+ * on random and randomly generated valid input.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compression.h"
+#include "buffer.h"
+
+#define ITERATIONS 200000
+#define MAX_IN 512
+#define MAX_OUT 4096
+
+static uint32_t state = 2463534242U;
+
+/**
+ @brief Xorshift pseudo random generator, deterministic between runs
+ @return Random value
+ */
+static uint32_t rnd(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/**
+ @brief Reference decompressor, byte by byte implementation on MOBIBuffer
+
+ @param[out] out Decompressed destination data
+ @param[in] in Compressed source data
+ @param[in,out] len_out Size of the memory reserved for decompressed data.
+ On return it is set to actual size of decompressed data
+ @param[in] len_in Size of compressed data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET reference_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in) {
+    MOBI_RET ret = MOBI_SUCCESS;
+    MOBIBuffer *buf_in = mobi_buffer_init_null((unsigned char *) in, len_in);
+    if (buf_in == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBIBuffer *buf_out = mobi_buffer_init_null(out, *len_out);
+    if (buf_out == NULL) {
+        mobi_buffer_free_null(buf_in);
+        return MOBI_MALLOC_FAILED;
+    }
+    while (ret == MOBI_SUCCESS && buf_in->offset < buf_in->maxlen) {
+        uint8_t byte = mobi_buffer_get8(buf_in);
+        if (byte >= 0xc0) {
+            mobi_buffer_add8(buf_out, ' ');
+            mobi_buffer_add8(buf_out, byte ^ 0x80);
+        }
+        else if (byte >= 0x80) {
+            uint8_t next = mobi_buffer_get8(buf_in);
+            uint16_t distance = ((((byte << 8) | ((uint8_t)next)) >> 3) & 0x7ff);
+            uint8_t length = (next & 0x7) + 3;
+            if (distance == 0) {
+                /* not in original implementation, which copied not yet written output byte onto itself */
+                buf_out->error = MOBI_BUFFER_END;
+            }
+            while (length--) {
+                mobi_buffer_move(buf_out, -distance, 1);
+            }
+        }
+        else if (byte >= 0x09) {
+            mobi_buffer_add8(buf_out, byte);
+        }
+        else if (byte >= 0x01) {
+            mobi_buffer_copy(buf_out, buf_in, byte);
+        }
+        else {
+            mobi_buffer_add8(buf_out, byte);
+        }
+        if (buf_in->error || buf_out->error) {
+            ret = MOBI_BUFFER_END;
+        }
+    }
+    *len_out = buf_out->offset;
+    mobi_buffer_free_null(buf_out);
+    mobi_buffer_free_null(buf_in);
+    return ret;
+}
+
+/**
+ @brief Generate random sequence of valid tokens
+
+ @param[out] in Buffer for compressed data
+ @param[in] max Buffer size
+ @return Generated data size
+ */
+static size_t generate_valid(unsigned char *in, const size_t max) {
+    size_t len = 0;
+    size_t produced = 0;
+    while (len + 9 < max && rnd() % 64) {
+        switch (rnd() % 5) {
+            case 0:
+                in[len++] = (unsigned char) (0xc0 | (rnd() & 0x3f));
+                produced += 2;
+                break;
+            case 1:
+                if (produced > 0) {
+                    size_t distance = 1 + rnd() % (produced < 2047 ? produced : 2047);
+                    if (rnd() % 2) { distance = 1 + rnd() % (distance < 10 ? distance : 10); }
+                    const size_t length = rnd() % 8;
+                    const unsigned value = 0x8000 | (unsigned) (distance << 3) | (unsigned) length;
+                    in[len++] = (unsigned char) (value >> 8);
+                    in[len++] = (unsigned char) value;
+                    produced += length + 3;
+                }
+                break;
+            case 2:
+            {
+                const size_t count = 1 + rnd() % 8;
+                in[len++] = (unsigned char) count;
+                for (size_t i = 0; i < count; i++) {
+                    in[len++] = (unsigned char) rnd();
+                }
+                produced += count;
+                break;
+            }
+            default:
+            {
+                const unsigned char c = (unsigned char) (rnd() % 0x80);
+                in[len++] = (c >= 0x01 && c <= 0x08) ? 0 : c;
+                produced++;
+                break;
+            }
+        }
+    }
+    return len;
+}
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on mismatch
+ */
+int main(void) {
+    unsigned char in[MAX_IN];
+    unsigned char out1[MAX_OUT];
+    unsigned char out2[MAX_OUT];
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        size_t len_in;
+        if (i % 4 == 0) {
+            len_in = rnd() % MAX_IN;
+            for (size_t j = 0; j < len_in; j++) {
+                in[j] = (unsigned char) rnd();
+            }
+        } else {
+            len_in = generate_valid(in, MAX_IN);
+            /* truncate or corrupt some */
+            if (i % 4 == 1 && len_in > 0) {
+                if (rnd() % 2) {
+                    len_in = rnd() % len_in;
+                } else {
+                    in[rnd() % len_in] = (unsigned char) rnd();
+                }
+            }
+        }
+        size_t len_out1 = (rnd() % 8) ? MAX_OUT : rnd() % MAX_OUT;
+        size_t len_out2 = len_out1;
+        memset(out1, 0, sizeof(out1));
+        memset(out2, 0, sizeof(out2));
+        const MOBI_RET ret1 = reference_lz77(out1, in, &len_out1, len_in);
+        const MOBI_RET ret2 = mobi_decompress_lz77(out2, in, &len_out2, len_in);
+        if (ret1 != ret2) {
+            printf("Iteration %zu: return value mismatch (%i, %i)\n", i, ret1, ret2);
+            return 1;
+        }
+        if (ret1 == MOBI_SUCCESS && (len_out1 != len_out2 || memcmp(out1, out2, len_out1) != 0)) {
+            printf("Iteration %zu: output mismatch (%zu, %zu)\n", i, len_out1, len_out2);
+            return 1;
+        }
+    }
+    printf("%i iterations passed\n", ITERATIONS);
+    return 0;
+}
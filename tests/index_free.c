@@ -0,0 +1,155 @@
+/** @file index_free.c
+ *
+ * @brief Test of parsing and freeing INDX indices
+ *
+ * Parses dictionary indices, which entries data fills more than one
+ * arena block and which are built from several INDX records,
+ * and frees them. Also frees index partially parsed before corrupt record.
+ * Memory errors are caught when run under memory checker.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mobi.h"
+
+/* must match size of index arena block in index.h */
+#define INDX_ARENA_BLOCKSIZE 0x10000
+
+/**
+ @brief Dictionary sample
+ */
+typedef struct {
+    const char *name; /**< File name in samples directory */
+    bool is_large; /**< True if orth index spans several INDX records and arena blocks */
+    bool corrupt; /**< True if last INDX record of orth index should be corrupted */
+} TestSample;
+
+static const TestSample samples[] = {
+    { "sample-dict-fileversion4.mobi", true, false },
+    { "sample-dict-fileversion4.mobi", true, true },
+    { "sample-dict-infl2.mobi", false, false },
+};
+
+/**
+ @brief Count INDX records of index
+
+ @param[in] m MOBIData structure
+ @param[in] indx_record_number Number of the first INDX record of index
+ @return Count of INDX records with entries, 0 on failure
+ */
+static size_t indx_records_count(const MOBIData *m, const size_t indx_record_number) {
+    const MOBIPdbRecord *record = mobi_get_record_by_seqnumber(m, indx_record_number);
+    if (record == NULL || record->size < 28 || memcmp(record->data, "INDX", 4) != 0) {
+        return 0;
+    }
+    /* 24: count of following records with entries */
+    const unsigned char *p = record->data + 24;
+    return (size_t) p[0] << 24 | (size_t) p[1] << 16 | (size_t) p[2] << 8 | p[3];
+}
+
+/**
+ @brief Calculate lower bound of memory used by index entries data
+
+ @param[in] indx Index
+ @return Size of labels, tags and tag values
+ */
+static size_t indx_data_size(const MOBIIndx *indx) {
+    size_t size = 0;
+    for (size_t i = 0; i < indx->entries_count; i++) {
+        const MOBIIndexEntry *entry = &indx->entries[i];
+        size += strlen(entry->label) + 1 + entry->tags_count * sizeof(MOBIIndexTag);
+        for (size_t j = 0; j < entry->tags_count; j++) {
+            size += entry->tags[j].tagvalues_count * sizeof(uint32_t);
+        }
+    }
+    return size;
+}
+
+/**
+ @brief Parse and free dictionary indices of a sample
+
+ @param[in] sample Sample file
+ @return 0 on success, 1 on failure
+ */
+static int check_sample(const TestSample *sample) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", TEST_SAMPLES, sample->name);
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    MOBIRawml *rawml = NULL;
+    const MOBI_RET load_ret = mobi_load_filename(m, path);
+    if (load_ret == MOBI_FILE_NOT_FOUND) {
+        /* large samples are not distributed */
+        printf("%s: missing sample, skipping\n", sample->name);
+        result = 0;
+        goto cleanup;
+    }
+    if (load_ret != MOBI_SUCCESS || (rawml = mobi_init_rawml(m)) == NULL) {
+        printf("Loading %s failed\n", path);
+        goto cleanup;
+    }
+    if (m->mh == NULL || m->mh->orth_index == NULL) {
+        printf("%s: not a dictionary\n", sample->name);
+        goto cleanup;
+    }
+    const size_t records_count = indx_records_count(m, *m->mh->orth_index);
+    if (sample->corrupt) {
+        /* entries of preceding records are parsed before failure */
+        MOBIPdbRecord *record = mobi_get_record_by_seqnumber(m, *m->mh->orth_index + records_count);
+        if (record == NULL || record->size < 4) {
+            printf("%s: last INDX record not found\n", sample->name);
+            goto cleanup;
+        }
+        memcpy(record->data, "XXXX", 4);
+    }
+    const MOBI_RET ret = mobi_parse_rawml_opt(rawml, m, true, true, false);
+    if (sample->corrupt) {
+        if (ret == MOBI_SUCCESS) {
+            printf("%s: parsing corrupt index succeeded\n", sample->name);
+            goto cleanup;
+        }
+        printf("%s: corrupt index rejected (%i)\n", sample->name, ret);
+        result = 0;
+        goto cleanup;
+    }
+    if (ret != MOBI_SUCCESS || rawml->orth == NULL) {
+        printf("%s: parsing index failed (%i)\n", sample->name, ret);
+        goto cleanup;
+    }
+    const size_t data_size = indx_data_size(rawml->orth);
+    printf("%s: %zu entries in %zu INDX records, %zu bytes of entries data\n",
+           sample->name, rawml->orth->entries_count, records_count, data_size);
+    if (sample->is_large && (records_count < 2 || data_size <= INDX_ARENA_BLOCKSIZE)) {
+        printf("%s: index too small for the test\n", sample->name);
+        goto cleanup;
+    }
+    result = 0;
+cleanup:
+    mobi_free_rawml(rawml);
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure
+ */
+int main(void) {
+    int result = 0;
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        result |= check_sample(&samples[i]);
+    }
+    return result;
+}
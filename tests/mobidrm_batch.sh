@@ -0,0 +1,71 @@
+#!/bin/sh
+# mobidrm_batch.sh
+# Copyright (c) 2022 Bartek Fabiszewski
+# http://www.fabiszewski.net
+#
+# This file is part of libmobi.
+# Licensed under LGPL, either version 3, or any later.
+# See <http://www.gnu.org/licenses/>
+
+# Test of mobidrm batch mode.
+# Decrypts files listed in manifest with several worker threads,
+# verifies report, output files and rejection of duplicate output names.
+# Environment: MOBIDRM path to mobidrm tool, TEST_SAMPLES path to samples directory.
+
+skip=77
+mobidrm="${MOBIDRM:-../tools/mobidrm}"
+samples="${TEST_SAMPLES:-samples}"
+pid="LTKULBB*5V"
+sample_v1="${samples}/sample-drm-v1.mobi"
+sample_v2="${samples}/sample-drm_pidLTKULBB^5V-v2.mobi"
+
+die() {
+    echo "$1"
+    exit "$2"
+}
+
+[ -x "${mobidrm}" ] || die "Missing mobidrm: ${mobidrm}" $skip
+[ -f "${sample_v1}" ] && [ -f "${sample_v2}" ] || die "Missing samples" $skip
+
+tmp_dir="$(mktemp -d "${TMPDIR:-/tmp}/mobidrm_batch.XXXXXX")" || die "Could not create temporary directory" 1
+trap 'rm -rf "${tmp_dir}"' EXIT
+
+mkdir "${tmp_dir}/in" "${tmp_dir}/dup" "${tmp_dir}/out" || die "Could not create directories" 1
+cp "${sample_v1}" "${tmp_dir}/in/v1.mobi" || die "Could not copy sample" 1
+cp "${sample_v2}" "${tmp_dir}/in/v2.mobi" || die "Could not copy sample" 1
+cp "${sample_v1}" "${tmp_dir}/dup/v1.mobi" || die "Could not copy sample" 1
+
+# count report lines with given status
+count_status() {
+    grep -c "^$1	" "${tmp_dir}/report"
+}
+
+# decrypt two files
+printf '%s\n\n%s\n' "${tmp_dir}/in/v1.mobi" "${tmp_dir}/in/v2.mobi" > "${tmp_dir}/manifest"
+"${mobidrm}" -d -p "${pid}" -j 2 -o "${tmp_dir}/out" -m "${tmp_dir}/manifest" -r "${tmp_dir}/report" \
+    || die "Batch decryption failed ($?)" 1
+cat "${tmp_dir}/report"
+[ "$(count_status ok)" -eq 2 ] || die "Expected 2 files processed" 1
+[ "$(count_status error)" -eq 0 ] || die "Expected no errors" 1
+for name in v1 v2; do
+    [ -s "${tmp_dir}/out/${name}-decrypted.mobi" ] || die "Missing output file ${name}-decrypted.mobi" 1
+done
+
+# decrypted files must not be encrypted
+"${mobidrm}" -d -j 2 -r "${tmp_dir}/report" "${tmp_dir}/out/v1-decrypted.mobi" "${tmp_dir}/out/v2-decrypted.mobi" \
+    && die "Decrypting decrypted files succeeded" 1
+cat "${tmp_dir}/report"
+[ "$(grep -c "Document is not encrypted" "${tmp_dir}/report")" -eq 2 ] || die "Output files are still encrypted" 1
+
+# files with the same base name would overwrite each other in output directory
+rm -f "${tmp_dir}/out/"*
+printf '%s\n%s\n%s\n' "${tmp_dir}/in/v1.mobi" "${tmp_dir}/in/v2.mobi" "${tmp_dir}/dup/v1.mobi" > "${tmp_dir}/manifest"
+"${mobidrm}" -d -p "${pid}" -j 3 -o "${tmp_dir}/out" -m "${tmp_dir}/manifest" -r "${tmp_dir}/report" \
+    && die "Duplicate output name was not reported" 1
+cat "${tmp_dir}/report"
+[ "$(count_status ok)" -eq 2 ] || die "Expected 2 files processed" 1
+grep -qF "error	${tmp_dir}/dup/v1.mobi	Output file name same as for ${tmp_dir}/in/v1.mobi" "${tmp_dir}/report" \
+    || die "Expected duplicate error for ${tmp_dir}/dup/v1.mobi" 1
+[ "$(count_status error)" -eq 1 ] || die "Expected 1 error" 1
+
+exit 0
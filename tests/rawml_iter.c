@@ -0,0 +1,121 @@
+/** @file rawml_iter.c
+ *
+ * @brief Test of iterator over decompressed text records
+ *
+ * Compares chunks joined from mobi_rawml_iter_next() with rawml
+ * from mobi_get_rawml(), for both parts of hybrid KF7/KF8 documents
+ * and for records with multibyte trailing entries.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mobi.h"
+
+/* flag of multibyte trailing entry */
+#define MULTIBYTE_FLAG 1
+
+/**
+ @brief Sample file
+ */
+typedef struct {
+    const char *name; /**< File name in samples directory */
+    bool use_kf8; /**< Part of hybrid file to load */
+    bool is_hybrid; /**< True if sample must be hybrid */
+    bool is_multibyte; /**< True if sample records must have multibyte trailing entries */
+} TestSample;
+
+static const TestSample samples[] = {
+    { "sample-unicode-huffdic.mobi", true, true, true },
+    { "sample-unicode-huffdic.mobi", false, true, true },
+    { "sample-unicode-uncompressed.mobi", true, true, true },
+    { "sample-unicode-uncompressed.mobi", false, true, true },
+    { "sample-obfuscated-fonts.mobi", true, false, true },
+    { "sample-cp1252.mobi", true, false, false },
+    { "sample-textread.mobi", true, false, false },
+};
+
+/**
+ @brief Compare joined iterator chunks with full rawml
+
+ @param[in] sample Sample file
+ @return 0 on success, 1 on failure
+ */
+static int check_sample(const TestSample *sample) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", TEST_SAMPLES, sample->name);
+    const char *part = sample->is_hybrid ? (sample->use_kf8 ? "KF8" : "KF7") : "single part";
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    char *rawml = NULL;
+    MOBIRawmlIter *it = NULL;
+    if (!sample->use_kf8) {
+        mobi_parse_kf7(m);
+    }
+    if (mobi_load_filename(m, path) != MOBI_SUCCESS) {
+        printf("Loading %s failed\n", path);
+        goto cleanup;
+    }
+    const uint16_t extra_flags = (m->mh && m->mh->extra_flags) ? *m->mh->extra_flags : 0;
+    if (mobi_is_hybrid(m) != sample->is_hybrid || ((extra_flags & MULTIBYTE_FLAG) != 0) != sample->is_multibyte) {
+        printf("%s (%s): unexpected sample properties\n", sample->name, part);
+        goto cleanup;
+    }
+    size_t rawml_len = mobi_get_text_maxsize(m);
+    rawml = malloc(rawml_len + 1);
+    if (rawml == NULL || mobi_get_rawml(m, rawml, &rawml_len) != MOBI_SUCCESS) {
+        printf("%s (%s): getting rawml failed\n", sample->name, part);
+        goto cleanup;
+    }
+    it = mobi_init_rawml_iter(m);
+    if (it == NULL) {
+        goto cleanup;
+    }
+    size_t offset = 0;
+    size_t chunks = 0;
+    const char *data;
+    size_t len;
+    MOBI_RET ret;
+    while ((ret = mobi_rawml_iter_next(it, &data, &len)) == MOBI_SUCCESS && data) {
+        if (len > rawml_len - offset || memcmp(data, rawml + offset, len) != 0) {
+            printf("%s (%s): chunk %zu at offset %zu differs\n", sample->name, part, chunks, offset);
+            goto cleanup;
+        }
+        offset += len;
+        chunks++;
+    }
+    if (ret != MOBI_SUCCESS || offset != rawml_len) {
+        printf("%s (%s): iterator stopped at offset %zu of %zu (%i)\n", sample->name, part, offset, rawml_len, ret);
+        goto cleanup;
+    }
+    printf("%s (%s): %zu chunks match %zu bytes\n", sample->name, part, chunks, rawml_len);
+    result = 0;
+cleanup:
+    mobi_free_rawml_iter(it);
+    free(rawml);
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure
+ */
+int main(void) {
+    int result = 0;
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        result |= check_sample(&samples[i]);
+    }
+    return result;
+}
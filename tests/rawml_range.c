@@ -0,0 +1,121 @@
+/** @file rawml_range.c
+ *
+ * @brief Test of random access to rawml text
+ *
+ * Compares ranges returned by mobi_get_rawml_range() and record offsets
+ * returned by mobi_get_text_record_number() with full rawml from mobi_get_rawml()
+ * on an uncompressed document, which text records are shrunk
+ * by removal of null characters (workaround for old files).
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mobi.h"
+
+#define SAMPLE TEST_SAMPLES "/sample-unicode-uncompressed.mobi"
+#define RANGE_START 20490
+#define RANGE_END 20530
+
+/**
+ @brief Compare rawml range with full rawml
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] rawml Full rawml text
+ @param[in] start Offset of the range start
+ @param[in] end Offset of the range end (exclusive)
+ @return 0 on success, 1 on mismatch
+ */
+static int check_range(const MOBIData *m, const char *rawml, const size_t start, const size_t end) {
+    char out[RANGE_END - RANGE_START];
+    if (end - start > sizeof(out)) {
+        return 1;
+    }
+    MOBI_RET ret = mobi_get_rawml_range(m, start, end, out);
+    if (ret != MOBI_SUCCESS) {
+        printf("Range %zu-%zu: error %i\n", start, end, ret);
+        return 1;
+    }
+    if (memcmp(out, rawml + start, end - start) != 0) {
+        printf("Range %zu-%zu: text mismatch\n", start, end);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure
+ */
+int main(void) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    char *rawml = NULL;
+    if (mobi_load_filename(m, SAMPLE) != MOBI_SUCCESS || mobi_parse_kf7(m) != MOBI_SUCCESS) {
+        printf("Loading %s failed\n", SAMPLE);
+        goto cleanup;
+    }
+    if (m->rh == NULL || m->rh->compression_type != MOBI_COMPRESSION_NONE || m->rh->text_record_count < 6
+        || m->mh == NULL || m->mh->version == NULL) {
+        printf("%s is not uncompressed mobi document\n", SAMPLE);
+        goto cleanup;
+    }
+    /* old file version, null characters are removed from text records */
+    *m->mh->version = 3;
+    MOBIPdbRecord *record = m->rec->next;
+    if (record == NULL || record->size < 100) {
+        printf("%s", "Text record not found\n");
+        goto cleanup;
+    }
+    record->data[10] = '\0';
+    size_t len = mobi_get_text_maxsize(m);
+    rawml = malloc(len);
+    if (rawml == NULL) {
+        goto cleanup;
+    }
+    if (mobi_get_rawml(m, rawml, &len) != MOBI_SUCCESS || len < RANGE_END) {
+        printf("%s", "Getting rawml failed\n");
+        goto cleanup;
+    }
+    if (check_range(m, rawml, RANGE_START, RANGE_END)
+        || check_range(m, rawml, 0, RANGE_END - RANGE_START)
+        || check_range(m, rawml, len - (RANGE_END - RANGE_START), len)) {
+        goto cleanup;
+    }
+    size_t number;
+    size_t start;
+    if (mobi_get_text_record_number(m, len - 1, &number, &start) != MOBI_SUCCESS
+        || number != (size_t) m->rh->text_record_count - 1) {
+        printf("%s", "Wrong number of last text record\n");
+        goto cleanup;
+    }
+    char *text = malloc(mobi_get_textrecord_maxsize(m));
+    if (text == NULL) {
+        goto cleanup;
+    }
+    size_t text_len = mobi_get_textrecord_maxsize(m);
+    if (mobi_get_text_record(m, number, text, &text_len) != MOBI_SUCCESS
+        || start + text_len != len || memcmp(text, rawml + start, text_len) != 0) {
+        printf("%s", "Wrong offset of last text record\n");
+        free(text);
+        goto cleanup;
+    }
+    free(text);
+    printf("%s", "Rawml ranges match\n");
+    result = 0;
+cleanup:
+    free(rawml);
+    mobi_free(m);
+    return result;
+}
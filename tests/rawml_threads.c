@@ -0,0 +1,124 @@
+/** @file rawml_threads.c
+ *
+ * @brief Test of parallel text decompression
+ *
+ * Compares rawml decompressed by several worker threads with rawml
+ * decompressed sequentially, for huff/cdic, uncompressed and encrypted documents.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mobi.h"
+
+#define THREADS 4
+
+/**
+ @brief Sample file with optional PID
+ */
+typedef struct {
+    const char *name; /**< File name in samples directory */
+    const char *pid; /**< PID for decryption or NULL */
+} TestSample;
+
+static const TestSample samples[] = {
+    { "sample-unicode-huffdic.mobi", NULL },
+    { "sample-unicode-uncompressed.mobi", NULL },
+    { "sample-cp1252.mobi", NULL },
+#ifdef USE_ENCRYPTION
+    { "sample-drm-v1.mobi", NULL },
+    { "sample-drm_pidLTKULBB^5V-v2.mobi", "LTKULBB*5V" },
+#endif
+};
+
+/**
+ @brief Decompress rawml with given number of threads
+
+ @param[in,out] m MOBIData structure loaded with MOBI data
+ @param[in] threads Number of threads
+ @param[out] len On success set to rawml length
+ @return Rawml text, must be freed by caller, NULL on failure
+ */
+static char * get_rawml(MOBIData *m, const size_t threads, size_t *len) {
+    if (mobi_set_threads(m, threads) != MOBI_SUCCESS) {
+        return NULL;
+    }
+    *len = mobi_get_text_maxsize(m);
+    char *text = malloc(*len + 1);
+    if (text == NULL) {
+        return NULL;
+    }
+    if (mobi_get_rawml(m, text, len) != MOBI_SUCCESS) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/**
+ @brief Compare sequential and parallel rawml of a sample
+
+ @param[in] sample Sample file
+ @return 0 on success, 1 on failure
+ */
+static int check_sample(const TestSample *sample) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", TEST_SAMPLES, sample->name);
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    char *sequential = NULL;
+    char *parallel = NULL;
+    if (mobi_load_filename(m, path) != MOBI_SUCCESS) {
+        printf("Loading %s failed\n", path);
+        goto cleanup;
+    }
+#ifdef USE_ENCRYPTION
+    if (sample->pid && mobi_drm_setkey(m, sample->pid) != MOBI_SUCCESS) {
+        printf("%s: setting PID failed\n", sample->name);
+        goto cleanup;
+    }
+#endif
+    size_t sequential_len;
+    size_t parallel_len;
+    sequential = get_rawml(m, 1, &sequential_len);
+    parallel = get_rawml(m, THREADS, &parallel_len);
+    if (sequential == NULL || parallel == NULL) {
+        printf("%s: getting rawml failed\n", sample->name);
+        goto cleanup;
+    }
+    if (sequential_len != parallel_len || memcmp(sequential, parallel, sequential_len) != 0) {
+        printf("%s: parallel rawml differs (%zu, %zu)\n", sample->name, sequential_len, parallel_len);
+        goto cleanup;
+    }
+    printf("%s: %zu bytes match\n", sample->name, sequential_len);
+    result = 0;
+cleanup:
+    free(sequential);
+    free(parallel);
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure
+ */
+int main(void) {
+    int result = 0;
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        result |= check_sample(&samples[i]);
+    }
+    return result;
+}
@@ -0,0 +1,243 @@
+/** @file rawml_views.c
+ *
+ * @brief Test of rawml views of uncompressed documents
+ *
+ * Compares views joined from mobi_get_rawml_views() with rawml
+ * from mobi_get_rawml(). Documents are also loaded from a buffer
+ * and from a file, which are released before views are read,
+ * so views must point into records data owned by the document.
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mobi.h"
+
+#define SAMPLE TEST_SAMPLES "/sample-unicode-uncompressed.mobi"
+#define SAMPLE_COMPRESSED TEST_SAMPLES "/sample-unicode-huffdic.mobi"
+#define SAMPLE_ENCRYPTED TEST_SAMPLES "/sample-drm-v1.mobi"
+
+/**
+ @brief Get full rawml of document
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] len Rawml length
+ @return Rawml, must be freed by caller, NULL on failure
+ */
+static char * get_rawml(const MOBIData *m, size_t *len) {
+    *len = mobi_get_text_maxsize(m);
+    char *rawml = malloc(*len + 1);
+    if (rawml && mobi_get_rawml(m, rawml, len) != MOBI_SUCCESS) {
+        free(rawml);
+        rawml = NULL;
+    }
+    return rawml;
+}
+
+/**
+ @brief Compare joined views of document with rawml
+
+ @param[in] name Test name
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] rawml Expected rawml
+ @param[in] rawml_len Expected rawml length
+ @return 0 on success, 1 on failure
+ */
+static int check_views(const char *name, const MOBIData *m, const char *rawml, const size_t rawml_len) {
+    MOBIRawmlView *views;
+    size_t count;
+    MOBI_RET ret = mobi_get_rawml_views(m, &views, &count);
+    if (ret != MOBI_SUCCESS) {
+        printf("%s: getting views failed (%i)\n", name, ret);
+        return 1;
+    }
+    int result = 1;
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (views[i].size > rawml_len - offset || memcmp(views[i].data, rawml + offset, views[i].size) != 0) {
+            printf("%s: view %zu at offset %zu differs\n", name, i, offset);
+            goto cleanup;
+        }
+        offset += views[i].size;
+    }
+    if (offset != rawml_len) {
+        printf("%s: views length %zu, rawml length %zu\n", name, offset, rawml_len);
+        goto cleanup;
+    }
+    printf("%s: %zu views match %zu bytes\n", name, count, rawml_len);
+    result = 0;
+cleanup:
+    mobi_free_rawml_views(views);
+    return result;
+}
+
+/**
+ @brief Load document from file and compare its views with its rawml
+
+ @param[in] name Test name
+ @param[in] use_kf8 Part of hybrid file to load
+ @param[in] old_version If true, document is treated as old version with null characters inside records
+ @return 0 on success, 1 on failure
+ */
+static int check_file(const char *name, const bool use_kf8, const bool old_version) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    char *rawml = NULL;
+    if (!use_kf8) {
+        mobi_parse_kf7(m);
+    }
+    if (mobi_load_filename(m, SAMPLE) != MOBI_SUCCESS) {
+        printf("%s: loading %s failed\n", name, SAMPLE);
+        goto cleanup;
+    }
+    if (old_version) {
+        MOBIPdbRecord *record = mobi_get_record_by_seqnumber(m, 1);
+        if (m->mh == NULL || m->mh->version == NULL || record == NULL || record->size < 100) {
+            goto cleanup;
+        }
+        /* null characters are removed from text records of old versions */
+        *m->mh->version = 3;
+        record->data[10] = '\0';
+        record->data[11] = '\0';
+        record->data[50] = '\0';
+    }
+    size_t rawml_len;
+    rawml = get_rawml(m, &rawml_len);
+    if (rawml == NULL) {
+        printf("%s: getting rawml failed\n", name);
+        goto cleanup;
+    }
+    result = check_views(name, m, rawml, rawml_len);
+cleanup:
+    free(rawml);
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Read views of documents, which sources were released after loading
+
+ @return 0 on success, 1 on failure
+ */
+static int check_released(void) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    char *rawml = NULL;
+    unsigned char *buffer = NULL;
+    MOBIData *m_buffer = NULL;
+    MOBIData *m_part = NULL;
+    if (mobi_load_filename(m, SAMPLE) != MOBI_SUCCESS) {
+        printf("Loading %s failed\n", SAMPLE);
+        goto cleanup;
+    }
+    size_t rawml_len;
+    rawml = get_rawml(m, &rawml_len);
+    if (rawml == NULL) {
+        goto cleanup;
+    }
+    /* buffer copied on load is overwritten and freed */
+    FILE *file = fopen(SAMPLE, "rb");
+    if (file == NULL) {
+        goto cleanup;
+    }
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+    }
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0 && (buffer = malloc((size_t) size)) != NULL
+        && fread(buffer, 1, (size_t) size, file) != (size_t) size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    m_buffer = mobi_init();
+    if (buffer == NULL || m_buffer == NULL
+        || mobi_load_buffer(m_buffer, buffer, (size_t) size, MOBI_LOAD_COPY) != MOBI_SUCCESS) {
+        printf("%s", "Loading from buffer failed\n");
+        goto cleanup;
+    }
+    memset(buffer, 0, (size_t) size);
+    free(buffer);
+    buffer = NULL;
+    if (check_views("Released buffer", m_buffer, rawml, rawml_len) != 0) {
+        goto cleanup;
+    }
+    /* file reader is released when partial loading is finished */
+    file = fopen(SAMPLE, "rb");
+    m_part = mobi_init();
+    if (file == NULL || m_part == NULL || mobi_load_file_part(m_part, file) != MOBI_SUCCESS) {
+        printf("%s", "Loading part failed\n");
+        if (file) {
+            fclose(file);
+        }
+        goto cleanup;
+    }
+    fclose(file);
+    if (check_views("Released file", m_part, rawml, rawml_len) != 0) {
+        goto cleanup;
+    }
+    result = 0;
+cleanup:
+    free(buffer);
+    free(rawml);
+    mobi_free(m_part);
+    mobi_free(m_buffer);
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Check that views are refused for given document
+
+ @param[in] path Document path
+ @param[in] expected Expected status code
+ @return 0 on success, 1 on failure
+ */
+static int check_unsupported(const char *path, const MOBI_RET expected) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return 1;
+    }
+    int result = 1;
+    MOBIRawmlView *views;
+    size_t count;
+    if (mobi_load_filename(m, path) != MOBI_SUCCESS) {
+        printf("Loading %s failed\n", path);
+    } else if (mobi_get_rawml_views(m, &views, &count) != expected || views != NULL || count != 0) {
+        printf("%s: views not refused\n", path);
+        mobi_free_rawml_views(views);
+    } else {
+        result = 0;
+    }
+    mobi_free(m);
+    return result;
+}
+
+/**
+ @brief Main
+
+ @return 0 on success, 1 on failure
+ */
+int main(void) {
+    int result = 0;
+    result |= check_file("KF8 part", true, false);
+    result |= check_file("KF7 part", false, false);
+    result |= check_file("Old version", false, true);
+    result |= check_released();
+    result |= check_unsupported(SAMPLE_COMPRESSED, MOBI_FILE_UNSUPPORTED);
+    result |= check_unsupported(SAMPLE_ENCRYPTED, MOBI_FILE_ENCRYPTED);
+    return result;
+}
@@ -574,30 +574,43 @@ int set_decryption_key(MOBIData *m, const char *serial, const char *pid) {
 }
 
 /**
- @brief Save mobi file
+ @brief Create output file path for mobi file
  
- @param[in,out] m MOBIData struicture
+ @param[out] outfile Buffer for output path
+ @param[in] buf_len Buffer size
+ @param[in] m MOBIData struicture
  @param[in] fullpath Full file path
  @param[in] suffix Suffix appended to file name
  @return SUCCESS or ERROR
  */
-int save_mobi(MOBIData *m, const char *fullpath, const char *suffix) {
-    char outfile[FILENAME_MAX];
+int get_outfile_name(char *outfile, const size_t buf_len, const MOBIData *m, const char *fullpath, const char *suffix) {
     char basename[FILENAME_MAX];
     char dirname[FILENAME_MAX];
     split_fullpath(fullpath, dirname, basename, FILENAME_MAX);
     const char *ext = (mobi_get_fileversion(m) >= 8) ? "azw3" : "mobi";
     int n;
     if (outdir_opt) {
-        n = snprintf(outfile, sizeof(outfile), "%s%s-%s.%s", outdir, basename, suffix, ext);
+        n = snprintf(outfile, buf_len, "%s%s-%s.%s", outdir, basename, suffix, ext);
     } else {
-        n = snprintf(outfile, sizeof(outfile), "%s%s-%s.%s", dirname, basename, suffix, ext);
+        n = snprintf(outfile, buf_len, "%s%s-%s.%s", dirname, basename, suffix, ext);
     }
-    if (n < 0) {
-        printf("Creating file name failed\n");
+    if (n < 0 || (size_t) n >= buf_len) {
         return ERROR;
     }
-    if ((size_t) n >= sizeof(outfile)) {
+    return SUCCESS;
+}
+
+/**
+ @brief Save mobi file
+ 
+ @param[in,out] m MOBIData struicture
+ @param[in] fullpath Full file path
+ @param[in] suffix Suffix appended to file name
+ @return SUCCESS or ERROR
+ */
+int save_mobi(MOBIData *m, const char *fullpath, const char *suffix) {
+    char outfile[FILENAME_MAX];
+    if (get_outfile_name(outfile, sizeof(outfile), m, fullpath, suffix) != SUCCESS) {
         printf("File name too long\n");
         return ERROR;
     }
@@ -74,5 +74,6 @@ void print_exth(const MOBIData *m);
 int set_decryption_key(MOBIData *m, const char *serial, const char *pid);
 int set_decryption_pid(MOBIData *m, const char *pid);
 int set_decryption_serial(MOBIData *m, const char *serial);
+int get_outfile_name(char *outfile, const size_t buf_len, const MOBIData *m, const char *fullpath, const char *suffix);
 int save_mobi(MOBIData *m, const char *fullpath, const char *suffix);
 #endif /* common_h */
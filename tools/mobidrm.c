@@ -17,8 +17,18 @@
 #include <mobi.h>
 
 #include "common.h"
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #define VOUCHERS_COUNT_MAX 20
+/* maximum number of worker threads */
+#define THREADS_MAX 64
+/* maximum length of error message in batch report */
+#define REPORT_ERROR_MAX 256
 
 /* command line options */
 bool decrypt_opt = false;
@@ -32,6 +42,21 @@ size_t serial_count = 0;
 size_t pid_count = 0;
 time_t valid_from = -1;
 time_t valid_to = -1;
+size_t threads_count = 0;
+char *manifest = NULL;
+char *report_path = NULL;
+
+/* batch mode state */
+MOBIKeyRing *keyring = NULL;
+FILE *report = NULL;
+char **batch_paths = NULL;
+size_t batch_count = 0;
+size_t batch_next = 0;
+size_t failed_count = 0;
+#ifdef HAVE_PTHREAD
+/* serializes taking paths, report lines and failure counter */
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 
 /**
@@ -39,7 +64,7 @@ time_t valid_to = -1;
  @param[in] progname Executed program name
  */
 static void print_usage(const char *progname) {
-    printf("usage: %s [-d | -e] [-hv] [-p pid] [-f date] [-t date] [-s serial] [-o dir] filename\n", progname);
+    printf("usage: %s [-d | -e] [-hv] [-j threads] [-p pid] [-f date] [-t date] [-s serial] [-o dir] [-m manifest] [-r report] filename [filename ...]\n", progname);
     printf("       without arguments prints document metadata and exits\n\n");
 
     printf("       Decrypt options:\n");
@@ -53,30 +78,36 @@ static void print_usage(const char *progname) {
     printf("       -f date   set validity period from date (yyyy-mm-dd) when encrypting (inclusive)\n");
     printf("       -t date   set validity period to date (yyyy-mm-dd) when encrypting (inclusive)\n\n");
     
+    printf("       Batch options (used with many filenames or manifest):\n");
+    printf("       -m manifest read filenames from manifest file, one per line\n");
+    printf("       -r report write status of each file to report (default is standard output)\n\n");
+    
     printf("       Common options:\n");
+    printf("       -j threads number of worker threads, processing records or files in batch mode\n");
     printf("       -o dir    save output to dir folder\n");
     printf("       -h        show this usage summary and exit\n");
     printf("       -v        show version and exit\n");
 }
 
 /**
- @brief Applies DRM
+ @brief Applies DRM without printing progress
  
  @param[in,out] m MOBIData structure
  @param[in] use_kf8 In case of hybrid file process KF8 part if true, the other part otherwise
+ @param[out] error Buffer for error message
+ @param[in] error_size Size of error buffer
  @return SUCCESS or ERROR
  */
-static int do_encrypt(MOBIData *m, bool use_kf8) {
+static int encrypt_document(MOBIData *m, bool use_kf8, char *error, const size_t error_size) {
     
     MOBI_RET mobi_ret;
     
     if (mobi_is_hybrid(m)) {
         mobi_ret = mobi_remove_hybrid_part(m, !use_kf8);
         if (mobi_ret != MOBI_SUCCESS) {
-            printf("Error removing hybrid part (%s)\n", libmobi_msg(mobi_ret));
+            snprintf(error, error_size, "Error removing hybrid part (%s)", libmobi_msg(mobi_ret));
             return ERROR;
         }
-        printf("\nProcessing file version %zu from hybrid file\n", mobi_get_fileversion(m));
     }
     
     MOBIExthTag *tags = NULL;
@@ -113,23 +144,44 @@ static int do_encrypt(MOBIData *m, bool use_kf8) {
     for (size_t i = 0; i < serial_count; i++) {
         mobi_ret = mobi_drm_addvoucher(m, serial[i], valid_from, valid_to, tags, tags_count);
         if (mobi_ret != MOBI_SUCCESS) {
-            printf("Error adding encryption voucher (%s)\n", libmobi_msg(mobi_ret));
+            snprintf(error, error_size, "Error adding encryption voucher (%s)", libmobi_msg(mobi_ret));
             return ERROR;
         }
     }
     if (serial_count == 0) {
         mobi_ret = mobi_drm_addvoucher(m, NULL, valid_from, valid_to, tags, tags_count);
         if (mobi_ret != MOBI_SUCCESS) {
-            printf("Error adding encryption voucher (%s)\n", libmobi_msg(mobi_ret));
+            snprintf(error, error_size, "Error adding encryption voucher (%s)", libmobi_msg(mobi_ret));
             return ERROR;
         }
     }
     
     mobi_ret = mobi_drm_encrypt(m);
     if (mobi_ret != MOBI_SUCCESS) {
-        printf("Error encrypting document (%s)\n", libmobi_msg(mobi_ret));
+        snprintf(error, error_size, "Error encrypting document (%s)", libmobi_msg(mobi_ret));
         return ERROR;
     }
+    return SUCCESS;
+}
+
+/**
+ @brief Applies DRM
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] use_kf8 In case of hybrid file process KF8 part if true, the other part otherwise
+ @return SUCCESS or ERROR
+ */
+static int do_encrypt(MOBIData *m, bool use_kf8) {
+    
+    const bool is_hybrid = mobi_is_hybrid(m);
+    char error[REPORT_ERROR_MAX];
+    if (encrypt_document(m, use_kf8, error, sizeof(error)) != SUCCESS) {
+        printf("%s\n", error);
+        return ERROR;
+    }
+    if (is_hybrid) {
+        printf("\nProcessing file version %zu from hybrid file\n", mobi_get_fileversion(m));
+    }
     
     printf("Encrypting with encryption type %u\n", m->rh->encryption_type);
     if (m->rh->encryption_type == MOBI_ENCRYPTION_V1 && serial_count) {
@@ -145,20 +197,63 @@ static int do_encrypt(MOBIData *m, bool use_kf8) {
 }
 
 /**
- @brief Removes DRM
+ @brief Check whether DRM may be removed from document
  
- @param[in,out] m MOBIData structure
- @return SUCCESS or ERROR
+ @param[in] m MOBIData structure
+ @return True if document is not rented
  */
-static int do_decrypt(MOBIData *m) {
+static bool is_removable(const MOBIData *m) {
     MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, EXTH_RENTAL);
     if (exth) {
         uint32_t is_rental = mobi_decode_exthvalue(exth->data, exth->size);
         if (is_rental) {
-            printf("Can't remove DRM from rented documents\n");
-            return ERROR;
+            return false;
         }
     }
+    return true;
+}
+
+/**
+ @brief Decrypts document with key already set and removes DRM related EXTH records
+ 
+ @param[in,out] m MOBIData structure
+ @param[out] error Buffer for error message
+ @param[in] error_size Size of error buffer
+ @return SUCCESS or ERROR
+ */
+static int decrypt_document(MOBIData *m, char *error, const size_t error_size) {
+    uint16_t encryption_type = m->rh->encryption_type;
+    MOBI_RET mobi_ret = mobi_drm_decrypt(m);
+    if (mobi_ret != MOBI_SUCCESS) {
+        snprintf(error, error_size, "Error decrypting document (%s)", libmobi_msg(mobi_ret));
+        return ERROR;
+    }
+    
+    if (encryption_type == MOBI_ENCRYPTION_V2) {
+        // remove EXTH records that impose restrictions or are DRM related
+        MOBIExthTag drmkeys[] = { EXTH_TAMPERKEYS, EXTH_WATERMARK, EXTH_TTSDISABLE, EXTH_CLIPPINGLIMIT, EXTH_READFORFREE, EXTH_RENTAL, EXTH_UNK407 };
+        for (size_t i = 0; i < ARRAYSIZE(drmkeys); i++) {
+            mobi_ret = mobi_delete_exthrecord_by_tag(m, drmkeys[i]);
+            if (mobi_ret != MOBI_SUCCESS) {
+                snprintf(error, error_size, "Error removing EXTH record %u", drmkeys[i]);
+                return ERROR;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ @brief Removes DRM
+ 
+ @param[in,out] m MOBIData structure
+ @return SUCCESS or ERROR
+ */
+static int do_decrypt(MOBIData *m) {
+    if (!is_removable(m)) {
+        printf("Can't remove DRM from rented documents\n");
+        return ERROR;
+    }
     uint16_t encryption_type = m->rh->encryption_type;
     printf("Removing encryption type %u\n", encryption_type);
     bool has_key = false;
@@ -177,23 +272,11 @@ static int do_decrypt(MOBIData *m) {
             }
         }
     }
-    MOBI_RET mobi_ret = mobi_drm_decrypt(m);
-    if (mobi_ret != MOBI_SUCCESS) {
-        printf("Error encrypting document (%s)\n", libmobi_msg(mobi_ret));
+    char error[REPORT_ERROR_MAX];
+    if (decrypt_document(m, error, sizeof(error)) != SUCCESS) {
+        printf("%s\n", error);
         return ERROR;
     }
-    
-    if (encryption_type == MOBI_ENCRYPTION_V2) {
-        // remove EXTH records that impose restrictions or are DRM related
-        MOBIExthTag drmkeys[] = { EXTH_TAMPERKEYS, EXTH_WATERMARK, EXTH_TTSDISABLE, EXTH_CLIPPINGLIMIT, EXTH_READFORFREE, EXTH_RENTAL, EXTH_UNK407 };
-        for (size_t i = 0; i < ARRAYSIZE(drmkeys); i++) {
-            mobi_ret = mobi_delete_exthrecord_by_tag(m, drmkeys[i]);
-            if (mobi_ret != MOBI_SUCCESS) {
-                printf("Error removing EXTH record %u\n", drmkeys[i]);
-                return ERROR;
-            }
-        }
-    }
     return SUCCESS;
 }
 
@@ -216,6 +299,9 @@ static int loadfilename(const char *fullpath) {
         printf("Memory allocation failed\n");
         return ERROR;
     }
+    if (threads_count > 1) {
+        mobi_set_threads(m, threads_count);
+    }
     
     errno = 0;
     FILE *file = fopen(fullpath, "rb");
@@ -289,6 +375,414 @@ static int loadfilename(const char *fullpath) {
     return SUCCESS;
 }
 
+/**
+ @brief Lock batch state
+ */
+static void batch_lock_acquire(void) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&batch_lock);
+#endif
+}
+
+/**
+ @brief Unlock batch state
+ */
+static void batch_lock_release(void) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&batch_lock);
+#endif
+}
+
+/**
+ @brief Write file status line to batch report
+ 
+ @param[in] path Input file path
+ @param[in] outfile Output file path, NULL on error
+ @param[in] error Error message, NULL on success
+ */
+static void report_status(const char *path, const char *outfile, const char *error) {
+    batch_lock_acquire();
+    if (error) {
+        fprintf(report, "error\t%s\t%s\n", path, error);
+        failed_count++;
+    } else {
+        fprintf(report, "ok\t%s\t%s\n", path, outfile);
+    }
+    batch_lock_release();
+}
+
+/**
+ @brief Load, decrypt or encrypt and save single document in batch mode
+ 
+ Nothing is printed, status is written to report.
+ 
+ @param[in] fullpath Full file path
+ @param[in] use_kf8 In case of encrypting hybrid file process KF8 part if true, the other part otherwise
+ @param[out] is_hybrid Set to true if loaded document is hybrid
+ */
+static void process_file(const char *fullpath, bool use_kf8, bool *is_hybrid) {
+    char error[REPORT_ERROR_MAX];
+    *is_hybrid = false;
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        report_status(fullpath, NULL, "Memory allocation failed");
+        return;
+    }
+    
+    MOBI_RET mobi_ret = mobi_load_filename_mmap(m, fullpath);
+    if (mobi_ret != MOBI_SUCCESS) {
+        snprintf(error, sizeof(error), "Error while loading document (%s)", libmobi_msg(mobi_ret));
+        report_status(fullpath, NULL, error);
+        mobi_free(m);
+        return;
+    }
+    *is_hybrid = mobi_is_hybrid(m);
+    
+    int ret;
+    const char *suffix;
+    if (encrypt_opt) {
+        suffix = "encrypted";
+        if (mobi_is_encrypted(m)) {
+            snprintf(error, sizeof(error), "Document is already encrypted");
+            ret = ERROR;
+        } else {
+            ret = encrypt_document(m, use_kf8, error, sizeof(error));
+        }
+    } else {
+        suffix = "decrypted";
+        if (!mobi_is_encrypted(m)) {
+            snprintf(error, sizeof(error), "Document is not encrypted");
+            ret = ERROR;
+        } else if (!is_removable(m)) {
+            snprintf(error, sizeof(error), "Can't remove DRM from rented documents");
+            ret = ERROR;
+        } else {
+            mobi_ret = mobi_drm_setkey_keyring(m, keyring);
+            if (mobi_ret != MOBI_SUCCESS) {
+                snprintf(error, sizeof(error), "Error setting decryption key (%s)", libmobi_msg(mobi_ret));
+                ret = ERROR;
+            } else {
+                ret = decrypt_document(m, error, sizeof(error));
+            }
+        }
+    }
+    
+    char outfile[FILENAME_MAX] = "";
+    if (ret == SUCCESS && get_outfile_name(outfile, sizeof(outfile), m, fullpath, suffix) != SUCCESS) {
+        snprintf(error, sizeof(error), "File name too long");
+        ret = ERROR;
+    }
+    if (ret == SUCCESS) {
+        errno = 0;
+        FILE *file_out = fopen(outfile, "wb");
+        if (file_out == NULL) {
+            int errsv = errno;
+            snprintf(error, sizeof(error), "Error opening output file (%s)", strerror(errsv));
+            ret = ERROR;
+        } else {
+            mobi_ret = mobi_write_file(file_out, m);
+            if (fclose(file_out) != 0 && mobi_ret == MOBI_SUCCESS) {
+                mobi_ret = MOBI_WRITE_FAILED;
+            }
+            if (mobi_ret != MOBI_SUCCESS) {
+                snprintf(error, sizeof(error), "Error writing file (%s)", libmobi_msg(mobi_ret));
+                ret = ERROR;
+            }
+        }
+    }
+    mobi_free(m);
+    report_status(fullpath, outfile, ret == SUCCESS ? NULL : error);
+}
+
+/**
+ @brief Batch worker routine
+ 
+ Takes paths until all are processed.
+ In case of encrypting hybrid file both parts are saved.
+ 
+ @param[in] arg Unused
+ @return NULL
+ */
+static void * batch_worker(void *arg) {
+    (void) arg;
+    while (true) {
+        batch_lock_acquire();
+        const size_t i = batch_next++;
+        batch_lock_release();
+        if (i >= batch_count) {
+            break;
+        }
+        if (batch_paths[i] == NULL) {
+            /* duplicate, already reported */
+            continue;
+        }
+        bool is_hybrid;
+        process_file(batch_paths[i], false, &is_hybrid);
+        if (encrypt_opt && is_hybrid) {
+            process_file(batch_paths[i], true, &is_hybrid);
+        }
+    }
+    return NULL;
+}
+
+/**
+ @brief Add path to batch
+ 
+ @param[in] path Path
+ @return SUCCESS or ERROR
+ */
+static int batch_add(const char *path) {
+    char **paths = realloc(batch_paths, (batch_count + 1) * sizeof(*batch_paths));
+    if (paths == NULL) {
+        printf("Memory allocation failed\n");
+        return ERROR;
+    }
+    batch_paths = paths;
+    const size_t path_length = strlen(path);
+    char *copy = malloc(path_length + 1);
+    if (copy == NULL) {
+        printf("Memory allocation failed\n");
+        return ERROR;
+    }
+    memcpy(copy, path, path_length + 1);
+    normalize_path(copy);
+    batch_paths[batch_count++] = copy;
+    return SUCCESS;
+}
+
+/**
+ @brief Add paths listed in manifest file to batch
+ 
+ Manifest contains one path per line, empty lines are skipped.
+ 
+ @param[in] path Manifest path
+ @return SUCCESS or ERROR
+ */
+static int batch_add_manifest(const char *path) {
+    errno = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        int errsv = errno;
+        printf("Error opening manifest: %s (%s)\n", path, strerror(errsv));
+        return ERROR;
+    }
+    int ret = SUCCESS;
+    char line[FILENAME_MAX + 1];
+    while (fgets(line, sizeof(line), file)) {
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            printf("Path in manifest too long\n");
+            ret = ERROR;
+            break;
+        }
+        while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (batch_add(line) != SUCCESS) {
+            ret = ERROR;
+            break;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+/**
+ @brief Free batch paths
+ */
+static void batch_free(void) {
+    for (size_t i = 0; i < batch_count; i++) {
+        free(batch_paths[i]);
+    }
+    free(batch_paths);
+    batch_paths = NULL;
+    batch_count = 0;
+}
+
+/**
+ @brief Output name of batch entry
+ */
+typedef struct {
+    char *name; /**< Output path without suffix and extension */
+    size_t index; /**< Index of entry in batch */
+} BatchName;
+
+/**
+ @brief Compare batch output names, qsort callback
+ 
+ Entries with equal names are ordered by their position in batch.
+ 
+ @param[in] a First BatchName
+ @param[in] b Second BatchName
+ @return Negative, zero or positive, as in strcmp
+ */
+static int batch_name_compare(const void *a, const void *b) {
+    const BatchName *name_a = a;
+    const BatchName *name_b = b;
+    const int cmp = strcmp(name_a->name, name_b->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (name_a->index > name_b->index) - (name_a->index < name_b->index);
+}
+
+/**
+ @brief Report batch files that would be saved under the same output name
+ 
+ Output name only depends on output directory and file base name without extension,
+ so collisions are found before any document is loaded.
+ First file of each group is processed, the others are reported as errors
+ and removed from batch.
+ 
+ @return SUCCESS or ERROR
+ */
+static int batch_check_duplicates(void) {
+    if (batch_count < 2) {
+        return SUCCESS;
+    }
+    BatchName *names = calloc(batch_count, sizeof(*names));
+    bool *duplicate = calloc(batch_count, sizeof(*duplicate));
+    if (names == NULL || duplicate == NULL) {
+        printf("Memory allocation failed\n");
+        free(names);
+        free(duplicate);
+        return ERROR;
+    }
+    int ret = SUCCESS;
+    char dirname[FILENAME_MAX];
+    char basename[FILENAME_MAX];
+    for (size_t i = 0; i < batch_count; i++) {
+        split_fullpath(batch_paths[i], dirname, basename, FILENAME_MAX);
+        const char *dir = outdir_opt ? outdir : dirname;
+        const size_t dir_length = strlen(dir);
+        const size_t base_length = strlen(basename);
+        names[i].name = malloc(dir_length + base_length + 1);
+        if (names[i].name == NULL) {
+            printf("Memory allocation failed\n");
+            ret = ERROR;
+            break;
+        }
+        memcpy(names[i].name, dir, dir_length);
+        memcpy(names[i].name + dir_length, basename, base_length + 1);
+        names[i].index = i;
+    }
+    if (ret == SUCCESS) {
+        qsort(names, batch_count, sizeof(*names), batch_name_compare);
+        size_t first = 0;
+        for (size_t i = 1; i < batch_count; i++) {
+            if (strcmp(names[i].name, names[first].name) != 0) {
+                first = i;
+                continue;
+            }
+            char error[REPORT_ERROR_MAX];
+            snprintf(error, sizeof(error), "Output file name same as for %s", batch_paths[names[first].index]);
+            report_status(batch_paths[names[i].index], NULL, error);
+            duplicate[names[i].index] = true;
+        }
+        for (size_t i = 0; i < batch_count; i++) {
+            if (duplicate[i]) {
+                free(batch_paths[i]);
+                batch_paths[i] = NULL;
+            }
+        }
+    }
+    for (size_t i = 0; i < batch_count; i++) {
+        free(names[i].name);
+    }
+    free(names);
+    free(duplicate);
+    return ret;
+}
+
+/**
+ @brief Process all batch files with pool of worker threads
+ 
+ Decryption keys are shared by all workers in key ring.
+ 
+ @return SUCCESS or ERROR if any file failed
+ */
+static int batch_run(void) {
+    if (decrypt_opt) {
+        keyring = mobi_init_keyring();
+        if (keyring == NULL) {
+            printf("Key ring initialization failed\n");
+            return ERROR;
+        }
+        for (size_t i = 0; i < pid_count; i++) {
+            MOBI_RET mobi_ret = mobi_keyring_addpid(keyring, pid[i]);
+            if (mobi_ret != MOBI_SUCCESS) {
+                printf("Skipping PID %s (%s)\n", pid[i], libmobi_msg(mobi_ret));
+            }
+        }
+        for (size_t i = 0; i < serial_count; i++) {
+            MOBI_RET mobi_ret = mobi_keyring_addserial(keyring, serial[i]);
+            if (mobi_ret != MOBI_SUCCESS) {
+                printf("Skipping serial %s (%s)\n", serial[i], libmobi_msg(mobi_ret));
+            }
+        }
+    }
+    report = stdout;
+    if (report_path) {
+        errno = 0;
+        report = fopen(report_path, "w");
+        if (report == NULL) {
+            int errsv = errno;
+            printf("Error opening report: %s (%s)\n", report_path, strerror(errsv));
+            mobi_free_keyring(keyring);
+            return ERROR;
+        }
+    }
+    if (batch_check_duplicates() != SUCCESS) {
+        if (report != stdout) {
+            fclose(report);
+        }
+        mobi_free_keyring(keyring);
+        keyring = NULL;
+        return ERROR;
+    }
+    
+#ifdef HAVE_PTHREAD
+    if (threads_count == 0) {
+# ifdef _SC_NPROCESSORS_ONLN
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_count = online < 1 ? 1 : (size_t) online;
+# endif
+        if (threads_count < 1) {
+            threads_count = 1;
+        }
+        if (threads_count > THREADS_MAX) {
+            threads_count = THREADS_MAX;
+        }
+    }
+    if (threads_count > batch_count) {
+        threads_count = batch_count;
+    }
+    /* calling thread is one of workers */
+    pthread_t threads[THREADS_MAX];
+    size_t started = 0;
+    while (started + 1 < threads_count && pthread_create(&threads[started], NULL, batch_worker, NULL) == 0) {
+        started++;
+    }
+    batch_worker(NULL);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    batch_worker(NULL);
+#endif
+    
+    if (report != stdout) {
+        fclose(report);
+    }
+    mobi_free_keyring(keyring);
+    keyring = NULL;
+    printf("Processed %zu files, %zu failed\n", batch_count, failed_count);
+    return failed_count ? ERROR : SUCCESS;
+}
+
 /**
  @brief Parse ISO8601 date into tm structure
  
@@ -330,7 +824,7 @@ int main(int argc, char *argv[]) {
     }
     opterr = 0;
     int c;
-    while ((c = getopt(argc, argv, "def:ho:p:s:t:vx:")) != -1) {
+    while ((c = getopt(argc, argv, "def:hj:m:o:p:r:s:t:vx:")) != -1) {
         switch(c) {
             case 'd':
                 if (encrypt_opt) {
@@ -363,6 +857,24 @@ int main(int argc, char *argv[]) {
                 }
                 expiry_opt = true;
                 break;
+            case 'j':
+            {
+                char *end;
+                const long threads = strtol(optarg, &end, 10);
+                if (*end != '\0' || threads < 1 || threads > THREADS_MAX) {
+                    printf("Threads count must be between 1 and %d\n", THREADS_MAX);
+                    return ERROR;
+                }
+                threads_count = (size_t) threads;
+                break;
+            }
+            case 'm':
+                if (strlen(optarg) == 2 && optarg[0] == '-') {
+                    printf("Option -%c requires an argument.\n", c);
+                    return ERROR;
+                }
+                manifest = optarg;
+                break;
             case 'o':
                 if (strlen(optarg) == 2 && optarg[0] == '-') {
                     printf("Option -%c requires an argument.\n", c);
@@ -401,6 +913,13 @@ int main(int argc, char *argv[]) {
                     printf("Maximum PIDs count reached, skipping PID...\n");
                 }
                 break;
+            case 'r':
+                if (strlen(optarg) == 2 && optarg[0] == '-') {
+                    printf("Option -%c requires an argument.\n", c);
+                    return ERROR;
+                }
+                report_path = optarg;
+                break;
             case 's':
                 if (strlen(optarg) == 2 && optarg[0] == '-') {
                     printf("Option -%c requires an argument.\n", c);
@@ -452,7 +971,7 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    if (argc <= optind) {
+    if (argc <= optind && manifest == NULL) {
         printf("Missing filename\n");
         print_usage(argv[0]);
         return ERROR;
@@ -476,6 +995,28 @@ int main(int argc, char *argv[]) {
         return ERROR;
     }
     
+    if (manifest || argc - optind > 1) {
+        /* batch mode */
+        int ret = SUCCESS;
+        if (manifest) {
+            ret = batch_add_manifest(manifest);
+        }
+        for (int i = optind; ret == SUCCESS && i < argc; i++) {
+            ret = batch_add(argv[i]);
+        }
+        if (ret == SUCCESS) {
+            ret = batch_run();
+        }
+        batch_free();
+        return ret;
+    }
+    
+    if (report_path) {
+        printf("Report can only be used in batch mode\n");
+        print_usage(argv[0]);
+        return ERROR;
+    }
+    
     int ret = 0;
     char filename[FILENAME_MAX];
     strncpy(filename, argv[optind], FILENAME_MAX - 1);
@@ -0,0 +1,556 @@
+/** @file mobiindex.c
+ *
+ * @brief mobiindex
+ *
+ * @example mobiindex.c
+ * Program for indexing metadata of ebook collections with libmobi library
+ *
+ * Copyright (c) 2022 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <mobi.h>
+
+#include "common.h"
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+/* maximum number of worker threads */
+#define THREADS_MAX 64
+/* number of paths waiting in queue, bounds memory usage on large trees */
+#define QUEUE_SIZE 256
+
+#if HAVE_ATTRIBUTE_NORETURN
+static void exit_with_usage(const char *progname) __attribute__((noreturn));
+#else
+static void exit_with_usage(const char *progname);
+#endif
+
+/* command line options */
+bool csv_opt = false;
+
+/**
+ @brief Bounded queue of paths shared between walker and workers
+ */
+typedef struct {
+    char *paths[QUEUE_SIZE]; /**< Ring buffer of paths */
+    size_t head; /**< Index of next path to take */
+    size_t count; /**< Number of queued paths */
+    bool done; /**< Set when walker finished */
+    pthread_mutex_t lock; /**< Queue lock */
+    pthread_cond_t not_empty; /**< Signalled when path is queued */
+    pthread_cond_t not_full; /**< Signalled when path is taken */
+} PathQueue;
+
+PathQueue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+
+/* serializes output lines and failure counter */
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t failed_count = 0;
+
+/**
+ @brief Growable string buffer for output line
+ */
+typedef struct {
+    char *data; /**< Buffer */
+    size_t len; /**< Used length */
+    size_t size; /**< Allocated size */
+} LineBuffer;
+
+/**
+ @brief Print usage info
+ @param[in] progname Executed program name
+ */
+static void exit_with_usage(const char *progname) {
+    char *p = strrchr(progname, separator);
+    if (p) { progname = ++p; }
+    printf("usage: %s [-c] [-j threads] [-hv] path [path ...]\n", progname);
+    printf("       prints metadata of ebooks found in given files and directories\n");
+    printf("       -c             print csv (default is ndjson)\n");
+    printf("       -j threads     number of worker threads\n");
+    printf("       -h             show this usage summary and exit\n");
+    printf("       -v             show version and exit\n");
+    exit(ERROR);
+}
+
+/**
+ @brief Append characters to line buffer
+ @param[in,out] line Line buffer
+ @param[in] string Characters to append
+ @param[in] len Number of characters
+ @return True on success, false on allocation failure
+ */
+static bool line_append(LineBuffer *line, const char *string, const size_t len) {
+    if (line->len + len + 1 > line->size) {
+        size_t size = line->size ? line->size : 256;
+        while (line->len + len + 1 > size) { size *= 2; }
+        char *data = realloc(line->data, size);
+        if (data == NULL) {
+            return false;
+        }
+        line->data = data;
+        line->size = size;
+    }
+    memcpy(line->data + line->len, string, len);
+    line->len += len;
+    line->data[line->len] = '\0';
+    return true;
+}
+
+/**
+ @brief Append string to line buffer
+ @param[in,out] line Line buffer
+ @param[in] string Null terminated string
+ @return True on success, false on allocation failure
+ */
+static bool line_puts(LineBuffer *line, const char *string) {
+    return line_append(line, string, strlen(string));
+}
+
+/**
+ @brief Append quoted and escaped value to line buffer
+
+ In ndjson mode value is escaped as JSON string, in csv mode
+ it is quoted and inner quotes are doubled.
+ NULL value is written as null in ndjson and as empty field in csv.
+
+ @param[in,out] line Line buffer
+ @param[in] value Null terminated UTF-8 string or NULL
+ @return True on success, false on allocation failure
+ */
+static bool line_put_string(LineBuffer *line, const char *value) {
+    if (value == NULL) {
+        return csv_opt ? true : line_puts(line, "null");
+    }
+    bool ret = line_append(line, "\"", 1);
+    const char *p = value;
+    while (ret && *p) {
+        const unsigned char c = (unsigned char) *p++;
+        if (csv_opt) {
+            ret = (c == '"') ? line_append(line, "\"\"", 2) : line_append(line, (const char *) &c, 1);
+        } else if (c == '"' || c == '\\') {
+            const char escaped[2] = { '\\', (char) c };
+            ret = line_append(line, escaped, 2);
+        } else if (c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            ret = line_append(line, escaped, 6);
+        } else {
+            ret = line_append(line, (const char *) &c, 1);
+        }
+    }
+    return ret && line_append(line, "\"", 1);
+}
+
+/**
+ @brief Append field to line buffer, prefixed with key name in ndjson mode
+ @param[in,out] line Line buffer
+ @param[in] key Field name
+ @param[in] first True if this is the first field in line
+ @return True on success, false on allocation failure
+ */
+static bool line_put_key(LineBuffer *line, const char *key, const bool first) {
+    if (csv_opt) {
+        return first ? true : line_append(line, ",", 1);
+    }
+    return line_puts(line, first ? "{\"" : ",\"") && line_puts(line, key) && line_append(line, "\":", 2);
+}
+
+/**
+ @brief Output fields in the order they are printed
+ */
+static const char *fields[] = {
+    "path", "error", "title", "author", "asin", "language",
+    "cover_offset", "kf8", "hybrid", "encrypted", "dictionary"
+};
+
+/**
+ @brief Print csv header line
+ */
+static void print_csv_header(void) {
+    for (size_t i = 0; i < ARRAYSIZE(fields); i++) {
+        printf("%s%s", i ? "," : "", fields[i]);
+    }
+    printf("\n");
+}
+
+/**
+ @brief Append boolean field
+ @param[in,out] line Line buffer
+ @param[in] key Field name
+ @param[in] value Value
+ @return True on success, false on allocation failure
+ */
+static bool line_put_bool(LineBuffer *line, const char *key, const bool value) {
+    return line_put_key(line, key, false) && line_puts(line, value ? "true" : "false");
+}
+
+/**
+ @brief Append metadata string field, frees value
+ @param[in,out] line Line buffer
+ @param[in] key Field name
+ @param[in] value Value allocated by libmobi or NULL
+ @return True on success, false on allocation failure
+ */
+static bool line_put_meta(LineBuffer *line, const char *key, char *value) {
+    const bool ret = line_put_key(line, key, false) && line_put_string(line, value);
+    free(value);
+    return ret;
+}
+
+/**
+ @brief Format single output line for a document
+ @param[in,out] line Line buffer, reset before use
+ @param[in] path Document path
+ @param[in] m MOBIData structure with loaded document or NULL on error
+ @param[in] error Error message or NULL
+ @return True on success, false on allocation failure
+ */
+static bool format_line(LineBuffer *line, const char *path, const MOBIData *m, const char *error) {
+    line->len = 0;
+    bool ret = line_put_key(line, "path", true) && line_put_string(line, path)
+        && line_put_key(line, "error", false) && line_put_string(line, error);
+    if (ret && m) {
+        ret = line_put_meta(line, "title", mobi_meta_get_title(m))
+            && line_put_meta(line, "author", mobi_meta_get_author(m))
+            && line_put_meta(line, "asin", mobi_meta_get_asin(m))
+            && line_put_meta(line, "language", mobi_meta_get_language(m));
+        if (ret) {
+            ret = line_put_key(line, "cover_offset", false);
+            const MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, EXTH_COVEROFFSET);
+            if (ret && exth) {
+                char offset[11];
+                snprintf(offset, sizeof(offset), "%u", mobi_decode_exthvalue(exth->data, exth->size));
+                ret = line_puts(line, offset);
+            } else if (ret && !csv_opt) {
+                ret = line_puts(line, "null");
+            }
+        }
+        ret = ret && line_put_bool(line, "kf8", mobi_is_kf8(m))
+            && line_put_bool(line, "hybrid", mobi_is_hybrid(m))
+            && line_put_bool(line, "encrypted", mobi_is_encrypted(m))
+            && line_put_bool(line, "dictionary", mobi_is_dictionary(m));
+    } else if (ret && csv_opt) {
+        /* keep column count constant */
+        for (size_t i = 2; ret && i < ARRAYSIZE(fields); i++) {
+            ret = line_append(line, ",", 1);
+        }
+    }
+    if (ret && !csv_opt) {
+        ret = line_append(line, "}", 1);
+    }
+    return ret && line_append(line, "\n", 1);
+}
+
+/**
+ @brief Load document metadata and print it
+
+ Errors are reported in output line, they do not stop processing.
+
+ @param[in,out] line Line buffer
+ @param[in] path Document path
+ */
+static void index_file(LineBuffer *line, const char *path) {
+    const char *error = NULL;
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        error = "Memory allocation failed";
+    } else {
+        const MOBI_RET mobi_ret = mobi_probe_filename(m, path);
+        if (mobi_ret != MOBI_SUCCESS) {
+            error = libmobi_msg(mobi_ret);
+        }
+    }
+    const bool ret = format_line(line, path, error ? NULL : m, error);
+    mobi_free(m);
+    pthread_mutex_lock(&output_lock);
+    if (ret) {
+        fwrite(line->data, 1, line->len, stdout);
+    } else {
+        fprintf(stderr, "Memory allocation failed (%s)\n", path);
+    }
+    if (error || !ret) {
+        failed_count++;
+    }
+    pthread_mutex_unlock(&output_lock);
+}
+
+/**
+ @brief Add path to queue, blocks while queue is full
+ @param[in] path Path, ownership is passed to queue
+ */
+static void queue_push(char *path) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUE_SIZE) {
+        pthread_cond_wait(&queue.not_full, &queue.lock);
+    }
+    queue.paths[(queue.head + queue.count) % QUEUE_SIZE] = path;
+    queue.count++;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/**
+ @brief Take path from queue, blocks while queue is empty
+ @return Path which must be freed by caller or NULL if walker finished
+ */
+static char * queue_pop(void) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0 && !queue.done) {
+        pthread_cond_wait(&queue.not_empty, &queue.lock);
+    }
+    char *path = NULL;
+    if (queue.count > 0) {
+        path = queue.paths[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_SIZE;
+        queue.count--;
+        pthread_cond_signal(&queue.not_full);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return path;
+}
+
+/**
+ @brief Mark queue as finished and wake up all workers
+ */
+static void queue_finish(void) {
+    pthread_mutex_lock(&queue.lock);
+    queue.done = true;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/**
+ @brief Worker thread routine
+ @param[in] arg Unused
+ @return NULL
+ */
+static void * worker(void *arg) {
+    (void) arg;
+    LineBuffer line = { NULL, 0, 0 };
+    char *path;
+    while ((path = queue_pop()) != NULL) {
+        index_file(&line, path);
+        free(path);
+    }
+    free(line.data);
+    return NULL;
+}
+
+/**
+ @brief Check whether file name has one of known ebook extensions
+ @param[in] name File name
+ @return True if extension is known
+ */
+static bool has_ebook_extension(const char *name) {
+    static const char *extensions[] = { "mobi", "azw", "azw3", "azw4", "prc", "pdb" };
+    const char *ext = strrchr(name, '.');
+    if (ext == NULL) {
+        return false;
+    }
+    ext++;
+    for (size_t i = 0; i < ARRAYSIZE(extensions); i++) {
+        const char *e = extensions[i];
+        const char *p = ext;
+        while (*e && *p && tolower((unsigned char) *p) == *e) { e++; p++; }
+        if (*e == '\0' && *p == '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ @brief Queue path for indexing
+ @param[in] path Path
+ @return SUCCESS or ERROR on allocation failure
+ */
+static int queue_path(const char *path) {
+    const size_t path_length = strlen(path);
+    char *copy = malloc(path_length + 1);
+    if (copy == NULL) {
+        printf("Memory allocation failed\n");
+        return ERROR;
+    }
+    memcpy(copy, path, path_length + 1);
+    queue_push(copy);
+    return SUCCESS;
+}
+
+/**
+ @brief Recursively walk directory and queue ebook files
+ 
+ Symbolic links to directories are not followed, they could lead to cycles.
+ 
+ @param[in] dir_path Directory path
+ @return SUCCESS or ERROR
+ */
+static int walk_directory(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        int errsv = errno;
+        fprintf(stderr, "Error opening directory: %s (%s)\n", dir_path, strerror(errsv));
+        return ERROR;
+    }
+    int ret = SUCCESS;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char path[FILENAME_MAX];
+        int n = snprintf(path, sizeof(path), "%s%c%s", dir_path, separator, entry->d_name);
+        if (n < 0 || (size_t) n >= sizeof(path)) {
+            fprintf(stderr, "Path too long: %s%c%s\n", dir_path, separator, entry->d_name);
+            ret = ERROR;
+            continue;
+        }
+        struct stat sb;
+#ifdef S_ISLNK
+        if (lstat(path, &sb) != 0) {
+            continue;
+        }
+        if (S_ISLNK(sb.st_mode)) {
+            /* follow links to files only */
+            if (stat(path, &sb) != 0 || S_ISDIR(sb.st_mode)) {
+                continue;
+            }
+        }
+#else
+        if (stat(path, &sb) != 0) {
+            continue;
+        }
+#endif
+        if (S_ISDIR(sb.st_mode)) {
+            if (walk_directory(path) != SUCCESS) {
+                ret = ERROR;
+            }
+        } else if (has_ebook_extension(entry->d_name)) {
+            if (queue_path(path) != SUCCESS) {
+                ret = ERROR;
+                break;
+            }
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+/**
+ @brief Main
+
+ @param[in] argc Arguments count
+ @param[in] argv Arguments array
+ @return SUCCESS (0) or ERROR (1)
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        exit_with_usage(argv[0]);
+    }
+    long threads_count = 0;
+    opterr = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "chj:v")) != -1) {
+        switch (opt) {
+            case 'c':
+                csv_opt = true;
+                break;
+            case 'j':
+            {
+                char *end;
+                threads_count = strtol(optarg, &end, 10);
+                if (*end != '\0' || threads_count < 1 || threads_count > THREADS_MAX) {
+                    printf("Threads count must be between 1 and %d\n", THREADS_MAX);
+                    exit_with_usage(argv[0]);
+                }
+                break;
+            }
+            case 'v':
+                printf("mobiindex build: " __DATE__ " " __TIME__ " (" COMPILER ")\n");
+                printf("libmobi: %s\n", mobi_version());
+                return SUCCESS;
+            case '?':
+                if (optopt == 'j') {
+                    fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+                }
+                else if (isprint(optopt)) {
+                    fprintf(stderr, "Unknown option `-%c'\n", optopt);
+                }
+                else {
+                    fprintf(stderr, "Unknown option character `\\x%x'\n", optopt);
+                }
+                exit_with_usage(argv[0]);
+            case 'h':
+            default:
+                exit_with_usage(argv[0]);
+        }
+    }
+    if (optind == argc) {
+        exit_with_usage(argv[0]);
+    }
+    if (threads_count == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (threads_count < 1) { threads_count = 1; }
+        if (threads_count > THREADS_MAX) { threads_count = THREADS_MAX; }
+    }
+
+    if (csv_opt) {
+        print_csv_header();
+        fflush(stdout);
+    }
+
+    pthread_t threads[THREADS_MAX];
+    long started = 0;
+    while (started < threads_count) {
+        if (pthread_create(&threads[started], NULL, worker, NULL) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        printf("Failed to start worker threads\n");
+        return ERROR;
+    }
+
+    int ret = SUCCESS;
+    for (int i = optind; i < argc; i++) {
+        struct stat sb;
+        if (stat(argv[i], &sb) != 0) {
+            int errsv = errno;
+            fprintf(stderr, "Error accessing path: %s (%s)\n", argv[i], strerror(errsv));
+            ret = ERROR;
+            continue;
+        }
+        /* explicitly listed files are indexed regardless of extension */
+        int walk_ret = S_ISDIR(sb.st_mode) ? walk_directory(argv[i]) : queue_path(argv[i]);
+        if (walk_ret != SUCCESS) {
+            ret = ERROR;
+        }
+    }
+    queue_finish();
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (failed_count > 0) {
+        ret = ERROR;
+    }
+    return ret;
+}
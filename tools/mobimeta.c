@@ -301,7 +301,13 @@ int main(int argc, char *argv[]) {
         printf("Error opening file: %s (%s)\n", infile, strerror(errsv));
         return ERROR;
     }
-    MOBI_RET mobi_ret = mobi_load_file(m, file_in);
+    MOBI_RET mobi_ret;
+    if (cmd_count == 0) {
+        /* only metadata is printed, skip records data */
+        mobi_ret = mobi_probe(m, file_in);
+    } else {
+        mobi_ret = mobi_load_file(m, file_in);
+    }
     fclose(file_in);
     if (mobi_ret != MOBI_SUCCESS) {
         mobi_free(m);